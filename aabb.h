@@ -134,6 +134,14 @@ public:
     else{                 z0 = z_max; }
     return sqrt( (x0-x)*(x0-x) + (y0-y)*(y0-y) + (z0-z)*(z0-z) );
   }
+  double SurfaceArea() const
+  {
+    if( !isnt_empty ) return 0;
+    const double lx = x_max-x_min;
+    const double ly = y_max-y_min;
+    const double lz = z_max-z_min;
+    return 2.0*(lx*ly + ly*lz + lz*lx);
+  }
   bool IsInside(double x, double y, double z) const
   {
    if( !isnt_empty ) return false; // âΩÇ‡Ç»Ç¢èÍçáÇÕèÌÇ…ãU
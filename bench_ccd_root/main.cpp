@@ -0,0 +1,244 @@
+﻿//
+//  main.cpp
+//
+//  bench_ccd_root, CCDで同一平面になる時刻の根を求める関数の速さと精度の計測
+//
+//  使い方: bench_ccd_root [問題の数]
+//  以前の15回の二分法と今の根を求める関数を,十分に小さい精度で求めた根と比べる
+//  また同じ問題をFVとEEの候補のバッチにして,スカラーとAVX2の判定の核の速さと結果を比べる
+//
+
+#include <iostream>
+#include <vector>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#include "../vector3d.h"
+#include "../bvh_aabb.h"
+#include "../ccd_avx2.h"
+
+/* ------------------------------------------------------------------------ */
+// 以前の根を求める関数(15回の再帰的な二分法)．比較のためにここに残す
+
+static double EvaluateCubic_Bisect
+(double r2, double k0, double k1, double k2, double k3)
+{
+  return k0 + k1*r2 + k2*r2*r2 + k3*r2*r2*r2;
+}
+
+static void BisectRangeCubicRoot
+(int& icnt, double& r0, double& r1, double v0, double v1,
+ double k0, double k1, double k2, double k3)
+{
+  icnt--;
+  if( icnt <= 0 ) return;
+  double r2 = 0.5*(r0+r1);
+  double v2 = EvaluateCubic_Bisect(r2, k0,k1,k2,k3);
+  if( v0*v2 < 0 ){ r1 = r2; }
+  else{            r0 = r2; }
+  BisectRangeCubicRoot(icnt,r0,r1,v0,v2,k0,k1,k2,k3);
+}
+
+static double FindRootCubic_Bisect
+(double r0, double r1, double v0, double v1,
+ double k0, double k1, double k2, double k3)
+{
+  int icnt=15;
+  BisectRangeCubicRoot(icnt, r0,r1, v0,v1, k0,k1,k2,k3);
+  return 0.5*(r0+r1);
+}
+
+static double FindCoplanerInterp_Bisect
+(const CVector3D& s0, const CVector3D& s1, const CVector3D& s2, const CVector3D& s3,
+ const CVector3D& e0, const CVector3D& e1, const CVector3D& e2, const CVector3D& e3)
+{
+  const CVector3D x1 = s1-s0;
+  const CVector3D x2 = s2-s0;
+  const CVector3D x3 = s3-s0;
+  const CVector3D v1 = e1-e0-x1;
+  const CVector3D v2 = e2-e0-x2;
+  const CVector3D v3 = e3-e0-x3;
+  const double k0 = ScalarTripleProduct(x3,x1,x2);
+  const double k1 = ScalarTripleProduct(v3,x1,x2)+ScalarTripleProduct(x3,v1,x2)+ScalarTripleProduct(x3,x1,v2);
+  const double k2 = ScalarTripleProduct(v3,v1,x2)+ScalarTripleProduct(v3,x1,v2)+ScalarTripleProduct(x3,v1,v2);
+  const double k3 = ScalarTripleProduct(v3,v1,v2);
+  double r0=-0.0;
+  double r1=+1.0;
+  const double f0 = EvaluateCubic_Bisect(r0,k0,k1,k2,k3);
+  const double f1 = EvaluateCubic_Bisect(r1,k0,k1,k2,k3);
+  double det = k2*k2-3*k1*k3;
+  if( fabs(k3) < 1.0e-10 && fabs(k2) > 1.0e-10 ){
+    double r2 = -k1/(2*k2);
+    const double f2 = EvaluateCubic_Bisect(r2, k0,k1,k2,k3);
+    if( r2 > 0 && r2 < 1 ){
+      if(      f0*f2 < 0 ){ return FindRootCubic_Bisect(r0,r2, f0,f2, k0,k1,k2,k3); }
+      else if( f2*f1 < 0 ){ return FindRootCubic_Bisect(r2,r1, f2,f1, k0,k1,k2,k3); }
+    }
+  }
+  if( det > 0 && fabs(k3) > 1.0e-10 ){
+    double r3 = (-k2-sqrt(det))/(3*k3);
+    double r4 = (-k2+sqrt(det))/(3*k3);
+    if( r3 > r4 ){ const double r = r3;  r3 = r4;  r4 = r; } // k3が負の時は逆になる(FindRootCubicCoplanerと同じ順)
+    const double f3 = EvaluateCubic_Bisect(r3, k0,k1,k2,k3);
+    if( r3 > 0 && r3 < 1 ){
+      if(      f0*f3 < 0 ){ return FindRootCubic_Bisect(r0,r3, f0,f3, k0,k1,k2,k3); }
+      else if( f3*f1 < 0 ){ return FindRootCubic_Bisect(r3,r1, f3,f1, k0,k1,k2,k3); }
+    }
+    const double f4 = EvaluateCubic_Bisect(r4, k0,k1,k2,k3);
+    if( r3 > 0 && r3 < 1 && r4 > 0 && r4 < 1 ){
+      if( f3*f4 < 0 ){ return FindRootCubic_Bisect(r3,r4, f3,f4, k0,k1,k2,k3); }
+    }
+    if( r4 > 0 && r4 < 1 ){
+      if(      f0*f4 < 0 ){ return FindRootCubic_Bisect(r0,r4, f0,f4, k0,k1,k2,k3); }
+      else if( f4*f1 < 0 ){ return FindRootCubic_Bisect(r4,r1, f4,f1, k0,k1,k2,k3); }
+    }
+  }
+  if( f0*f1 > 0 ){ return -1; }
+  return FindRootCubic_Bisect(r0,r1, f0,f1, k0,k1,k2,k3);
+}
+
+/* ------------------------------------------------------------------------ */
+
+static double RandomUnit(){ return (double)rand()/RAND_MAX; }
+
+static CVector3D RandomVector(double scale)
+{
+  return CVector3D( (RandomUnit()*2-1)*scale, (RandomUnit()*2-1)*scale, (RandomUnit()*2-1)*scale );
+}
+
+// 問題の集合: 4点の始めの位置と終わりの位置
+class CProblemCCD
+{
+public:
+  CVector3D s[4], e[4];
+};
+
+// 全ての問題の根をaTに入れ,かかった時間(秒)を返す．tol<0なら以前の二分法を使う
+static double SolveAll
+(std::vector<double>& aT,
+ const std::vector<CProblemCCD>& aProb,
+ double tol)
+{
+  aT.resize(aProb.size());
+  const clock_t c0 = clock();
+  for(unsigned int ip=0;ip<aProb.size();ip++){
+    const CProblemCCD& p = aProb[ip];
+    if( tol < 0 ){ aT[ip] = FindCoplanerInterp_Bisect(p.s[0],p.s[1],p.s[2],p.s[3], p.e[0],p.e[1],p.e[2],p.e[3]); }
+    else{          aT[ip] = FindCoplanerInterp(       p.s[0],p.s[1],p.s[2],p.s[3], p.e[0],p.e[1],p.e[2],p.e[3], tol); }
+  }
+  const clock_t c1 = clock();
+  return (double)(c1-c0)/CLOCKS_PER_SEC;
+}
+
+// 基準の根aT0と比べた誤差を表示する
+static void PrintError
+(const char* name,
+ double time,
+ const std::vector<double>& aT,
+ const std::vector<double>& aT0)
+{
+  double err_max = 0, err_ave = 0;
+  int nroot = 0, nmismatch = 0;
+  for(unsigned int ip=0;ip<aT.size();ip++){
+    const bool is_root0 = ( aT0[ip] >= 0 && aT0[ip] <= 1 );
+    const bool is_root1 = ( aT[ip]  >= 0 && aT[ip]  <= 1 );
+    if( is_root0 != is_root1 ){ nmismatch++; continue; }
+    if( !is_root0 ) continue;
+    const double err = fabs(aT[ip]-aT0[ip]);
+    if( err > err_max ){ err_max = err; }
+    err_ave += err;
+    nroot++;
+  }
+  if( nroot > 0 ){ err_ave /= nroot; }
+  std::cout << name;
+  std::cout << "  time: " << time << " sec";
+  std::cout << "  (" << time/aT.size()*1.0e9 << " nsec/query)";
+  std::cout << "  error max: " << err_max << "  ave: " << err_ave;
+  std::cout << "  root mismatch: " << nmismatch << std::endl;
+}
+
+// 全ての問題をFVかEEの候補としてバッチにためて判定し,接触した問題のaHitを1にする．かかった時間(秒)を返す
+// (バッチに入れる時間も含む．候補を除く前の判定は通ったものとする)
+static double JudgeAll
+(std::vector<int>& aHit,
+ CCounterFilterCCD& counter,
+ ////
+ const std::vector<CProblemCCD>& aProb,
+ bool is_fv)
+{
+  const int nprob = (int)aProb.size();
+  aHit.assign(nprob,0);
+  counter.Clear();
+  CBatchContactCCD b;
+  b.is_fv = is_fv;
+  const clock_t c0 = clock();
+  for(int ip0=0;ip0<nprob;ip0+=CBatchContactCCD::NBATCH){
+    b.n = 0;
+    for(int ip=ip0;ip<nprob && b.n<CBatchContactCCD::NBATCH;ip++){
+      for(int ipt=0;ipt<4;ipt++){
+        b.aS[ipt][0][b.n] = aProb[ip].s[ipt].x;  b.aS[ipt][1][b.n] = aProb[ip].s[ipt].y;  b.aS[ipt][2][b.n] = aProb[ip].s[ipt].z;
+        b.aE[ipt][0][b.n] = aProb[ip].e[ipt].x;  b.aE[ipt][1][b.n] = aProb[ip].e[ipt].y;  b.aE[ipt][2][b.n] = aProb[ip].e[ipt].z;
+      }
+      b.n++;
+    }
+    const unsigned long long flg_hit = JudgeBatchContactCCD(counter,b);
+    for(int i=0;i<b.n;i++){ aHit[ip0+i] = (int)((flg_hit>>i)&1); }
+  }
+  const clock_t c1 = clock();
+  return (double)(c1-c0)/CLOCKS_PER_SEC;
+}
+
+int main(int argc, char* argv[])
+{
+  const int nprob = ( argc > 1 ) ? atoi(argv[1]) : 1000000;
+  srand(0);
+  // 単位の大きさの四面体が,それと同じ程度の大きさだけ動く問題(半分くらいに根がある)
+  std::vector<CProblemCCD> aProb(nprob);
+  for(int ip=0;ip<nprob;ip++){
+    for(int i=0;i<4;i++){
+      aProb[ip].s[i] = RandomVector(1.0);
+      aProb[ip].e[i] = aProb[ip].s[i] + RandomVector(1.0);
+    }
+  }
+  std::vector<double> aT0, aT;
+  SolveAll(aT0, aProb, 1.0e-15); // 基準の根
+  int nroot = 0;
+  for(int ip=0;ip<nprob;ip++){ if( aT0[ip] >= 0 && aT0[ip] <= 1 ){ nroot++; } }
+  std::cout << "number of queries: " << nprob << "  with root: " << nroot << std::endl;
+  {
+    const double time = SolveAll(aT, aProb, -1);
+    PrintError("bisection 15 steps    ", time, aT, aT0);
+  }
+  const double aTol[3] = { 3.0e-5, TOL_ROOT_CUBIC_CCD, 1.0e-10 };
+  for(int itol=0;itol<3;itol++){
+    const double time = SolveAll(aT, aProb, aTol[itol]);
+    std::cout << "newton-bisection tol " << aTol[itol];
+    PrintError("", time, aT, aT0);
+  }
+  ////
+  const bool is_avx2 = ( SetBatchCCDKernel(BATCH_CCD_KERNEL_AVX2) == BATCH_CCD_KERNEL_AVX2 );
+  for(int ifv=1;ifv>=0;ifv--){
+    std::vector<int> aHit0, aHit1;
+    CCounterFilterCCD c0, c1;
+    SetBatchCCDKernel(BATCH_CCD_KERNEL_SCALAR);
+    const double time0 = JudgeAll(aHit0, c0, aProb, ifv==1);
+    const int* aNum0 = ( ifv == 1 ) ? c0.aNumFV : c0.aNumEE;
+    std::cout << "batch " << (( ifv == 1 ) ? "FV" : "EE") << "  scalar  time: " << time0 << " sec";
+    std::cout << "  (" << time0/nprob*1.0e9 << " nsec/query)";
+    std::cout << "  bernstein: " << aNum0[FILTER_CCD_BERNSTEIN] << "  root: " << aNum0[FILTER_CCD_ROOT];
+    std::cout << "  miss: " << aNum0[FILTER_CCD_MISS] << "  hit: " << aNum0[FILTER_CCD_HIT] << std::endl;
+    if( !is_avx2 ) continue;
+    SetBatchCCDKernel(BATCH_CCD_KERNEL_AVX2);
+    const double time1 = JudgeAll(aHit1, c1, aProb, ifv==1);
+    const int* aNum1 = ( ifv == 1 ) ? c1.aNumFV : c1.aNumEE;
+    int nmismatch = 0;
+    for(int ip=0;ip<nprob;ip++){ if( aHit0[ip] != aHit1[ip] ){ nmismatch++; } }
+    std::cout << "batch " << (( ifv == 1 ) ? "FV" : "EE") << "  avx2    time: " << time1 << " sec";
+    std::cout << "  (" << time1/nprob*1.0e9 << " nsec/query)";
+    std::cout << "  bernstein: " << aNum1[FILTER_CCD_BERNSTEIN] << "  root: " << aNum1[FILTER_CCD_ROOT];
+    std::cout << "  miss: " << aNum1[FILTER_CCD_MISS] << "  hit: " << aNum1[FILTER_CCD_HIT];
+    std::cout << "  hit mismatch: " << nmismatch << std::endl;
+  }
+  return 0;
+}
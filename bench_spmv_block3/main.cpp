@@ -0,0 +1,144 @@
+﻿//
+//  main.cpp
+//
+//  bench_spmv_block3, 3x3ブロックの疎行列の核(MatVecとILUの前進・後退代入)の速さの計測
+//
+//  使い方: bench_spmv_block3 [布の一辺の分割数] [繰り返しの回数]
+//  布のデモと同じ非ゼロパターンの行列を作り,スカラーの核とAVX2の核のGFLOP/sと結果の差を表示する
+//
+
+#include <iostream>
+#include <vector>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "../jagged_array.h"
+#include "../matrix_square_sparse.h"
+#include "../ilu_sparse.h"
+#include "../block3_avx2.h"
+
+static double RandomUnit(){ return (double)rand()/RAND_MAX; }
+
+// 経過時間(秒)
+static double WallTime()
+{
+#ifdef _OPENMP
+  return omp_get_wtime();
+#else
+  return (double)clock()/CLOCKS_PER_SEC;
+#endif
+}
+
+// 布のデモ(SetClothShape_Square)と同じ,辺と曲げの4頂点の組
+static void MakeClothQuad
+(std::vector<int>& aQuad,
+ ////
+ int ndiv)
+{
+  aQuad.clear();
+  for(int ix=0;ix<ndiv;ix++){
+    for(int iy=0;iy<ndiv;iy++){
+      const int q[4] = { ix*(ndiv+1)+iy, (ix+1)*(ndiv+1)+iy+1, (ix+1)*(ndiv+1)+iy, ix*(ndiv+1)+iy+1 };
+      aQuad.insert(aQuad.end(),q,q+4);
+    }
+  }
+  for(int ix=0;ix<ndiv;ix++){
+    for(int iy=0;iy<ndiv-1;iy++){
+      const int q[4] = { (ix+1)*(ndiv+1)+iy, ix*(ndiv+1)+iy+2, (ix+1)*(ndiv+1)+iy+1, ix*(ndiv+1)+iy+1 };
+      aQuad.insert(aQuad.end(),q,q+4);
+    }
+  }
+  for(int ix=0;ix<ndiv-1;ix++){
+    for(int iy=0;iy<ndiv;iy++){
+      const int q[4] = { ix*(ndiv+1)+iy+1, (ix+2)*(ndiv+1)+iy, (ix+1)*(ndiv+1)+iy, (ix+1)*(ndiv+1)+iy+1 };
+      aQuad.insert(aQuad.end(),q,q+4);
+    }
+  }
+}
+
+static double MaxDiff
+(const std::vector<double>& a,
+ const std::vector<double>& b)
+{
+  double dmax = 0, amax = 0;
+  for(unsigned int i=0;i<a.size();i++){
+    if( fabs(a[i]-b[i]) > dmax ){ dmax = fabs(a[i]-b[i]); }
+    if( fabs(a[i]) > amax ){ amax = fabs(a[i]); }
+  }
+  return ( amax > 0 ) ? dmax/amax : dmax;
+}
+
+// 核ikernelでMatVecとILUの前進・後退代入をnitr回ずつ計り,結果をy,zに入れる
+static void Measure
+(std::vector<double>& y,
+ std::vector<double>& z,
+ ////
+ int ikernel,
+ int nitr,
+ const CMatrixSquareSparse& mat,
+ const CPreconditionerILU& ilu,
+ const std::vector<double>& x)
+{
+  SetBlock3Kernel(ikernel);
+  const double flop_matvec = 18.0*(mat.m_ncrs+mat.m_nblk);
+  const double flop_ilu = 18.0*mat.m_ncrs+15.0*mat.m_nblk;
+  y.assign(x.size(),0.0);
+  const double t0 = WallTime();
+  for(int iitr=0;iitr<nitr;iitr++){ mat.MatVec(1.0,x,0.0,y); }
+  const double t1 = WallTime();
+  for(int iitr=0;iitr<nitr;iitr++){ z = x; ilu.Solve(z); }
+  const double t2 = WallTime();
+  std::cout << ( ikernel == BLOCK3_KERNEL_AVX2 ? "avx2  " : "scalar" );
+  std::cout << "  MatVec: " << (t1-t0)/nitr*1.0e3 << " msec " << flop_matvec*nitr/(t1-t0)*1.0e-9 << " GFLOP/s";
+  std::cout << "  ILU solve: " << (t2-t1)/nitr*1.0e3 << " msec " << flop_ilu*nitr/(t2-t1)*1.0e-9 << " GFLOP/s" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+  const int ndiv = ( argc > 1 ) ? atoi(argv[1]) : 447; // 448x448で約20万頂点
+  const int nitr = ( argc > 2 ) ? atoi(argv[2]) : 50;
+  const int np = (ndiv+1)*(ndiv+1);
+  srand(0);
+  CMatrixSquareSparse mat;
+  mat.Initialize(np,3);
+  {
+    std::vector<int> aQuad;
+    MakeClothQuad(aQuad,ndiv);
+    CJaggedArray crs;
+    crs.SetEdgeOfElem(aQuad, (int)aQuad.size()/4, 4, np, false);
+    crs.Sort();
+    mat.SetPattern(crs.index, crs.array);
+  }
+  // 対角が優位な値をいれる
+  for(int i=0;i<mat.m_ncrs*9;i++){ mat.m_valCrs[i] = RandomUnit()*2-1; }
+  for(int iblk=0;iblk<np;iblk++){
+    for(int i=0;i<9;i++){ mat.m_valDia[iblk*9+i] = RandomUnit()*2-1; }
+    for(int i=0;i<3;i++){ mat.m_valDia[iblk*9+i*4] += 100.0; }
+  }
+  CPreconditionerILU ilu;
+  ilu.Initialize_ILU0(mat);
+  ilu.SetValueILU(mat);
+  ilu.DoILUDecomp();
+  std::vector<double> x(np*3);
+  for(int i=0;i<np*3;i++){ x[i] = RandomUnit()*2-1; }
+  
+  int nthread = 1;
+#ifdef _OPENMP
+  nthread = omp_get_max_threads();
+#endif
+  std::cout << "number of vertices: " << np << "  non-zero blocks: " << mat.m_ncrs+mat.m_nblk;
+  std::cout << "  threads: " << nthread << std::endl;
+  std::vector<double> y0, z0, y1, z1;
+  Measure(y0,z0, BLOCK3_KERNEL_SCALAR, nitr, mat,ilu,x);
+  if( SetBlock3Kernel(BLOCK3_KERNEL_AVX2) != BLOCK3_KERNEL_AVX2 ){
+    std::cout << "this CPU has no AVX2" << std::endl;
+    return 0;
+  }
+  Measure(y1,z1, BLOCK3_KERNEL_AVX2, nitr, mat,ilu,x);
+  std::cout << "relative difference  MatVec: " << MaxDiff(y0,y1) << "  ILU solve: " << MaxDiff(z0,z1) << std::endl;
+  return 0;
+}
@@ -0,0 +1,451 @@
+﻿//
+//  block3_avx2.cpp
+//
+//  3x3ブロックの疎行列の核のAVX2版．この関数だけをAVX2とFMAでコンパイルし，
+//  使うかどうかは実行時にCPUを調べて決める
+//
+
+#include <assert.h>
+
+#include "block3_avx2.h"
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define BLOCK3_AVX2_ENABLED
+#include <immintrin.h>
+#define TARGET_AVX2 __attribute__((target("avx2,fma")))
+#endif
+
+static int SelectBlock3Kernel()
+{
+#ifdef BLOCK3_AVX2_ENABLED
+  __builtin_cpu_init();
+  if( __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") ){ return BLOCK3_KERNEL_AVX2; }
+#endif
+  return BLOCK3_KERNEL_SCALAR;
+}
+
+static int ikernel_block3 = SelectBlock3Kernel();
+
+int GetBlock3Kernel()
+{
+  return ikernel_block3;
+}
+
+int SetBlock3Kernel(int ikernel)
+{
+  ikernel_block3 = BLOCK3_KERNEL_SCALAR;
+  if( ikernel == BLOCK3_KERNEL_AVX2 ){ ikernel_block3 = SelectBlock3Kernel(); }
+  return ikernel_block3;
+}
+
+/* ------------------------------------------------------------------------------------- */
+
+#ifdef BLOCK3_AVX2_ENABLED
+
+// ブロックaとベクトルxjの積を3行ぶんの4レーンの和に加える．
+// 行0,1は(a0..a3)*(x0,x1,x2,0)，行2は(a5..a8)*(0,x0,x1,x2)として,ブロックとxjの外は読まない
+TARGET_AVX2 static inline void AddBlock3_AVX2
+(__m256d& s0, __m256d& s1, __m256d& s2,
+ ////
+ const double* a, const double* xj)
+{
+  const __m256d x  = _mm256_maskload_pd(xj, _mm256_set_epi64x(0,-1,-1,-1));
+  const __m256d xs = _mm256_permute4x64_pd(x, _MM_SHUFFLE(2,1,0,3));
+  s0 = _mm256_fmadd_pd(_mm256_loadu_pd(a+0), x,  s0);
+  s1 = _mm256_fmadd_pd(_mm256_loadu_pd(a+3), x,  s1);
+  s2 = _mm256_fmadd_pd(_mm256_loadu_pd(a+5), xs, s2);
+}
+
+// Σ_{icrs0<=icrs<icrs1} [A_icrs]{x_rowptr[icrs]} の3行ぶんのレーンの和．
+// 2ブロックずつ別の和にためてFMAの待ちを隠す
+TARGET_AVX2 static inline void RowBlock3_AVX2
+(__m256d& s0, __m256d& s1, __m256d& s2,
+ ////
+ const double* vcrs, const int* rowptr, int icrs0, int icrs1,
+ const double* x)
+{
+  __m256d t0 = _mm256_setzero_pd();
+  __m256d t1 = _mm256_setzero_pd();
+  __m256d t2 = _mm256_setzero_pd();
+  int icrs = icrs0;
+  for(;icrs+1<icrs1;icrs+=2){
+    AddBlock3_AVX2(s0,s1,s2, vcrs+icrs*9,   x+rowptr[icrs  ]*3);
+    AddBlock3_AVX2(t0,t1,t2, vcrs+icrs*9+9, x+rowptr[icrs+1]*3);
+  }
+  if( icrs < icrs1 ){
+    AddBlock3_AVX2(s0,s1,s2, vcrs+icrs*9, x+rowptr[icrs]*3);
+  }
+  s0 = _mm256_add_pd(s0,t0);
+  s1 = _mm256_add_pd(s1,t1);
+  s2 = _mm256_add_pd(s2,t2);
+}
+
+// floatのブロックを読むAddBlock3_AVX2
+TARGET_AVX2 static inline void AddBlock3F_AVX2
+(__m256d& s0, __m256d& s1, __m256d& s2,
+ ////
+ const float* a, const double* xj)
+{
+  const __m256d x  = _mm256_maskload_pd(xj, _mm256_set_epi64x(0,-1,-1,-1));
+  const __m256d xs = _mm256_permute4x64_pd(x, _MM_SHUFFLE(2,1,0,3));
+  s0 = _mm256_fmadd_pd(_mm256_cvtps_pd(_mm_loadu_ps(a+0)), x,  s0);
+  s1 = _mm256_fmadd_pd(_mm256_cvtps_pd(_mm_loadu_ps(a+3)), x,  s1);
+  s2 = _mm256_fmadd_pd(_mm256_cvtps_pd(_mm_loadu_ps(a+5)), xs, s2);
+}
+
+// floatのブロックを読むRowBlock3_AVX2
+TARGET_AVX2 static inline void RowBlock3F_AVX2
+(__m256d& s0, __m256d& s1, __m256d& s2,
+ ////
+ const float* vcrs, const int* rowptr, int icrs0, int icrs1,
+ const double* x)
+{
+  __m256d t0 = _mm256_setzero_pd();
+  __m256d t1 = _mm256_setzero_pd();
+  __m256d t2 = _mm256_setzero_pd();
+  int icrs = icrs0;
+  for(;icrs+1<icrs1;icrs+=2){
+    AddBlock3F_AVX2(s0,s1,s2, vcrs+icrs*9,   x+rowptr[icrs  ]*3);
+    AddBlock3F_AVX2(t0,t1,t2, vcrs+icrs*9+9, x+rowptr[icrs+1]*3);
+  }
+  if( icrs < icrs1 ){
+    AddBlock3F_AVX2(s0,s1,s2, vcrs+icrs*9, x+rowptr[icrs]*3);
+  }
+  s0 = _mm256_add_pd(s0,t0);
+  s1 = _mm256_add_pd(s1,t1);
+  s2 = _mm256_add_pd(s2,t2);
+}
+
+// 3行ぶんのレーンの和をまとめる
+TARGET_AVX2 static inline void HorizontalSum3_AVX2
+(double r[3],
+ ////
+ __m256d s0, __m256d s1, __m256d s2)
+{
+  const __m256d h01 = _mm256_hadd_pd(s0,s1);
+  const __m256d h22 = _mm256_hadd_pd(s2,s2);
+  const __m128d r01 = _mm_add_pd(_mm256_castpd256_pd128(h01), _mm256_extractf128_pd(h01,1));
+  const __m128d r22 = _mm_add_pd(_mm256_castpd256_pd128(h22), _mm256_extractf128_pd(h22,1));
+  _mm_storeu_pd(r,r01);
+  r[2] = _mm_cvtsd_f64(r22);
+}
+
+TARGET_AVX2 void MatVec_Block3_AVX2
+(std::vector<double>& y,
+ ////
+ double alpha,
+ const std::vector<double>& x,
+ double beta,
+ const CMatrixSquareSparse& mat,
+ int iblk0, int iblk1)
+{
+  assert( mat.m_len == 3 );
+  const int* colind = mat.m_colInd;
+  const int* rowptr = mat.m_rowPtr;
+  const double* vcrs = mat.m_valCrs;
+  const double* vdia = mat.m_valDia;
+  const double* px = &x[0];
+  double* py = &y[0];
+  for(int iblk=iblk0;iblk<iblk1;iblk++){
+    __m256d s0 = _mm256_setzero_pd();
+    __m256d s1 = _mm256_setzero_pd();
+    __m256d s2 = _mm256_setzero_pd();
+    AddBlock3_AVX2(s0,s1,s2, vdia+iblk*9, px+iblk*3);
+    RowBlock3_AVX2(s0,s1,s2, vcrs,rowptr,colind[iblk],colind[iblk+1], px);
+    double r[3]; HorizontalSum3_AVX2(r, s0,s1,s2);
+    py[iblk*3+0] = beta*py[iblk*3+0] + alpha*r[0];
+    py[iblk*3+1] = beta*py[iblk*3+1] + alpha*r[1];
+    py[iblk*3+2] = beta*py[iblk*3+2] + alpha*r[2];
+  }
+}
+
+TARGET_AVX2 void MatVecSym_Block3_AVX2
+(std::vector<double>& y,
+ double* spill,
+ ////
+ double alpha,
+ const std::vector<double>& x,
+ const CMatrixSquareSparse& mat,
+ int iblk0, int iblk1)
+{
+  assert( mat.m_len == 3 && mat.m_is_sym );
+  const int* colind = mat.m_colInd;
+  const int* rowptr = mat.m_rowPtr;
+  const double* vcrs = mat.m_valCrs;
+  const double* vdia = mat.m_valDia;
+  const double* px = &x[0];
+  double* py = &y[0];
+  const __m256i mask = _mm256_set_epi64x(0,-1,-1,-1);
+  for(int iblk=iblk0;iblk<iblk1;iblk++){
+    __m256d s0 = _mm256_setzero_pd();
+    __m256d s1 = _mm256_setzero_pd();
+    __m256d s2 = _mm256_setzero_pd();
+    AddBlock3_AVX2(s0,s1,s2, vdia+iblk*9, px+iblk*3);
+    // 転置の寄与 alpha*[A_ij]^T{x_i} は行を(alpha*x_i)の成分倍して足したもの
+    const __m256d axi0 = _mm256_set1_pd(alpha*px[iblk*3+0]);
+    const __m256d axi1 = _mm256_set1_pd(alpha*px[iblk*3+1]);
+    const __m256d axi2 = _mm256_set1_pd(alpha*px[iblk*3+2]);
+    for(int icrs=colind[iblk];icrs<colind[iblk+1];icrs++){
+      const int jblk0 = rowptr[icrs];
+      const double* a = vcrs+icrs*9;
+      AddBlock3_AVX2(s0,s1,s2, a, px+jblk0*3);
+      __m256d t = _mm256_mul_pd(_mm256_loadu_pd(a+0), axi0);
+      t = _mm256_fmadd_pd(_mm256_loadu_pd(a+3),       axi1, t);
+      t = _mm256_fmadd_pd(_mm256_maskload_pd(a+6,mask),axi2, t);
+      double tj[4]; _mm256_storeu_pd(tj,t);
+      double* yj = ( jblk0 < iblk1 ) ? py+jblk0*3 : spill+(jblk0-iblk1)*3;
+      yj[0] += tj[0];
+      yj[1] += tj[1];
+      yj[2] += tj[2];
+    }
+    double r[3]; HorizontalSum3_AVX2(r, s0,s1,s2);
+    py[iblk*3+0] += alpha*r[0];
+    py[iblk*3+1] += alpha*r[1];
+    py[iblk*3+2] += alpha*r[2];
+  }
+}
+
+TARGET_AVX2 void MatVecFloat_Block3_AVX2
+(std::vector<double>& y,
+ ////
+ double alpha,
+ const std::vector<double>& x,
+ double beta,
+ const CMatrixSquareSparse& mat,
+ int iblk0, int iblk1)
+{
+  assert( mat.m_len == 3 );
+  const int* colind = mat.m_colInd;
+  const int* rowptr = mat.m_rowPtr;
+  const float* vcrs = mat.m_aValCrsF.empty() ? 0 : &mat.m_aValCrsF[0];
+  const float* vdia = &mat.m_aValDiaF[0];
+  const double* px = &x[0];
+  double* py = &y[0];
+  for(int iblk=iblk0;iblk<iblk1;iblk++){
+    __m256d s0 = _mm256_setzero_pd();
+    __m256d s1 = _mm256_setzero_pd();
+    __m256d s2 = _mm256_setzero_pd();
+    AddBlock3F_AVX2(s0,s1,s2, vdia+iblk*9, px+iblk*3);
+    RowBlock3F_AVX2(s0,s1,s2, vcrs,rowptr,colind[iblk],colind[iblk+1], px);
+    double r[3]; HorizontalSum3_AVX2(r, s0,s1,s2);
+    py[iblk*3+0] = beta*py[iblk*3+0] + alpha*r[0];
+    py[iblk*3+1] = beta*py[iblk*3+1] + alpha*r[1];
+    py[iblk*3+2] = beta*py[iblk*3+2] + alpha*r[2];
+  }
+}
+
+TARGET_AVX2 void MatVecSymFloat_Block3_AVX2
+(std::vector<double>& y,
+ double* spill,
+ ////
+ double alpha,
+ const std::vector<double>& x,
+ const CMatrixSquareSparse& mat,
+ int iblk0, int iblk1)
+{
+  assert( mat.m_len == 3 && mat.m_is_sym );
+  const int* colind = mat.m_colInd;
+  const int* rowptr = mat.m_rowPtr;
+  const float* vcrs = mat.m_aValCrsF.empty() ? 0 : &mat.m_aValCrsF[0];
+  const float* vdia = &mat.m_aValDiaF[0];
+  const double* px = &x[0];
+  double* py = &y[0];
+  const __m128i mask = _mm_set_epi32(0,-1,-1,-1);
+  for(int iblk=iblk0;iblk<iblk1;iblk++){
+    __m256d s0 = _mm256_setzero_pd();
+    __m256d s1 = _mm256_setzero_pd();
+    __m256d s2 = _mm256_setzero_pd();
+    AddBlock3F_AVX2(s0,s1,s2, vdia+iblk*9, px+iblk*3);
+    const __m256d axi0 = _mm256_set1_pd(alpha*px[iblk*3+0]);
+    const __m256d axi1 = _mm256_set1_pd(alpha*px[iblk*3+1]);
+    const __m256d axi2 = _mm256_set1_pd(alpha*px[iblk*3+2]);
+    for(int icrs=colind[iblk];icrs<colind[iblk+1];icrs++){
+      const int jblk0 = rowptr[icrs];
+      const float* a = vcrs+icrs*9;
+      AddBlock3F_AVX2(s0,s1,s2, a, px+jblk0*3);
+      __m256d t = _mm256_mul_pd(_mm256_cvtps_pd(_mm_loadu_ps(a+0)), axi0);
+      t = _mm256_fmadd_pd(_mm256_cvtps_pd(_mm_loadu_ps(a+3)),        axi1, t);
+      t = _mm256_fmadd_pd(_mm256_cvtps_pd(_mm_maskload_ps(a+6,mask)), axi2, t);
+      double tj[4]; _mm256_storeu_pd(tj,t);
+      double* yj = ( jblk0 < iblk1 ) ? py+jblk0*3 : spill+(jblk0-iblk1)*3;
+      yj[0] += tj[0];
+      yj[1] += tj[1];
+      yj[2] += tj[2];
+    }
+    double r[3]; HorizontalSum3_AVX2(r, s0,s1,s2);
+    py[iblk*3+0] += alpha*r[0];
+    py[iblk*3+1] += alpha*r[1];
+    py[iblk*3+2] += alpha*r[2];
+  }
+}
+
+TARGET_AVX2 void ForwardSubstitution_Block3_AVX2
+(std::vector<double>& vec,
+ ////
+ const CMatrixSquareSparse& mat,
+ const int* diaInd)
+{
+  assert( mat.m_len == 3 );
+  const int nblk = mat.m_nblk;
+  const int* colind = mat.m_colInd;
+  const int* rowptr = mat.m_rowPtr;
+  const double* vcrs = mat.m_valCrs;
+  const double* vdia = mat.m_valDia;
+  double* pv = &vec[0];
+  for(int iblk=0;iblk<nblk;iblk++){
+    __m256d s0 = _mm256_setzero_pd();
+    __m256d s1 = _mm256_setzero_pd();
+    __m256d s2 = _mm256_setzero_pd();
+    RowBlock3_AVX2(s0,s1,s2, vcrs,rowptr,colind[iblk],diaInd[iblk], pv);
+    double r[3]; HorizontalSum3_AVX2(r, s0,s1,s2);
+    const double t0 = pv[iblk*3+0]-r[0];
+    const double t1 = pv[iblk*3+1]-r[1];
+    const double t2 = pv[iblk*3+2]-r[2];
+    const double* vii = vdia+iblk*9;
+    pv[iblk*3+0] = vii[0]*t0+vii[1]*t1+vii[2]*t2;
+    pv[iblk*3+1] = vii[3]*t0+vii[4]*t1+vii[5]*t2;
+    pv[iblk*3+2] = vii[6]*t0+vii[7]*t1+vii[8]*t2;
+  }
+}
+
+TARGET_AVX2 void BackwardSubstitution_Block3_AVX2
+(std::vector<double>& vec,
+ ////
+ const CMatrixSquareSparse& mat,
+ const int* diaInd)
+{
+  assert( mat.m_len == 3 );
+  const int nblk = mat.m_nblk;
+  const int* colind = mat.m_colInd;
+  const int* rowptr = mat.m_rowPtr;
+  const double* vcrs = mat.m_valCrs;
+  double* pv = &vec[0];
+  for(int iblk=nblk-1;iblk>=0;iblk--){
+    __m256d s0 = _mm256_setzero_pd();
+    __m256d s1 = _mm256_setzero_pd();
+    __m256d s2 = _mm256_setzero_pd();
+    RowBlock3_AVX2(s0,s1,s2, vcrs,rowptr,diaInd[iblk],colind[iblk+1], pv);
+    double r[3]; HorizontalSum3_AVX2(r, s0,s1,s2);
+    pv[iblk*3+0] -= r[0];
+    pv[iblk*3+1] -= r[1];
+    pv[iblk*3+2] -= r[2];
+  }
+}
+
+TARGET_AVX2 void ForwardSubstitutionFloat_Block3_AVX2
+(std::vector<double>& vec,
+ ////
+ const CMatrixSquareSparse& mat,
+ const int* diaInd)
+{
+  assert( mat.m_len == 3 );
+  const int nblk = mat.m_nblk;
+  const int* colind = mat.m_colInd;
+  const int* rowptr = mat.m_rowPtr;
+  const float* vcrs = mat.m_aValCrsF.empty() ? 0 : &mat.m_aValCrsF[0];
+  const float* vdia = &mat.m_aValDiaF[0];
+  double* pv = &vec[0];
+  for(int iblk=0;iblk<nblk;iblk++){
+    __m256d s0 = _mm256_setzero_pd();
+    __m256d s1 = _mm256_setzero_pd();
+    __m256d s2 = _mm256_setzero_pd();
+    RowBlock3F_AVX2(s0,s1,s2, vcrs,rowptr,colind[iblk],diaInd[iblk], pv);
+    double r[3]; HorizontalSum3_AVX2(r, s0,s1,s2);
+    const double t0 = pv[iblk*3+0]-r[0];
+    const double t1 = pv[iblk*3+1]-r[1];
+    const double t2 = pv[iblk*3+2]-r[2];
+    const float* vii = vdia+iblk*9;
+    pv[iblk*3+0] = vii[0]*t0+vii[1]*t1+vii[2]*t2;
+    pv[iblk*3+1] = vii[3]*t0+vii[4]*t1+vii[5]*t2;
+    pv[iblk*3+2] = vii[6]*t0+vii[7]*t1+vii[8]*t2;
+  }
+}
+
+TARGET_AVX2 void BackwardSubstitutionFloat_Block3_AVX2
+(std::vector<double>& vec,
+ ////
+ const CMatrixSquareSparse& mat,
+ const int* diaInd)
+{
+  assert( mat.m_len == 3 );
+  const int nblk = mat.m_nblk;
+  const int* colind = mat.m_colInd;
+  const int* rowptr = mat.m_rowPtr;
+  const float* vcrs = mat.m_aValCrsF.empty() ? 0 : &mat.m_aValCrsF[0];
+  double* pv = &vec[0];
+  for(int iblk=nblk-1;iblk>=0;iblk--){
+    __m256d s0 = _mm256_setzero_pd();
+    __m256d s1 = _mm256_setzero_pd();
+    __m256d s2 = _mm256_setzero_pd();
+    RowBlock3F_AVX2(s0,s1,s2, vcrs,rowptr,diaInd[iblk],colind[iblk+1], pv);
+    double r[3]; HorizontalSum3_AVX2(r, s0,s1,s2);
+    pv[iblk*3+0] -= r[0];
+    pv[iblk*3+1] -= r[1];
+    pv[iblk*3+2] -= r[2];
+  }
+}
+
+#else // BLOCK3_AVX2_ENABLED
+
+// AVX2を使えないコンパイラでは選ばれることはない
+void MatVec_Block3_AVX2
+(std::vector<double>& y,
+ double alpha, const std::vector<double>& x, double beta,
+ const CMatrixSquareSparse& mat, int iblk0, int iblk1)
+{
+  assert(0);
+}
+
+void MatVecSym_Block3_AVX2
+(std::vector<double>& y, double* spill,
+ double alpha, const std::vector<double>& x,
+ const CMatrixSquareSparse& mat, int iblk0, int iblk1)
+{
+  assert(0);
+}
+
+void ForwardSubstitution_Block3_AVX2
+(std::vector<double>& vec,
+ const CMatrixSquareSparse& mat, const int* diaInd)
+{
+  assert(0);
+}
+
+void BackwardSubstitution_Block3_AVX2
+(std::vector<double>& vec,
+ const CMatrixSquareSparse& mat, const int* diaInd)
+{
+  assert(0);
+}
+
+void MatVecFloat_Block3_AVX2
+(std::vector<double>& y,
+ double alpha, const std::vector<double>& x, double beta,
+ const CMatrixSquareSparse& mat, int iblk0, int iblk1)
+{
+  assert(0);
+}
+
+void MatVecSymFloat_Block3_AVX2
+(std::vector<double>& y, double* spill,
+ double alpha, const std::vector<double>& x,
+ const CMatrixSquareSparse& mat, int iblk0, int iblk1)
+{
+  assert(0);
+}
+
+void ForwardSubstitutionFloat_Block3_AVX2
+(std::vector<double>& vec,
+ const CMatrixSquareSparse& mat, const int* diaInd)
+{
+  assert(0);
+}
+
+void BackwardSubstitutionFloat_Block3_AVX2
+(std::vector<double>& vec,
+ const CMatrixSquareSparse& mat, const int* diaInd)
+{
+  assert(0);
+}
+
+#endif // BLOCK3_AVX2_ENABLED
@@ -0,0 +1,91 @@
+﻿//
+//  block3_avx2.h
+//
+//  3x3ブロックの疎行列の核(MatVecと前進・後退代入)のAVX2版．
+//  CPUがAVX2とFMAを持つときだけ実行時に選ばれ，それ以外はスカラーのコードを使う
+//
+
+#if !defined(BLOCK3_AVX2_H)
+#define BLOCK3_AVX2_H
+
+#include <vector>
+
+#include "matrix_square_sparse.h"
+
+enum { BLOCK3_KERNEL_SCALAR=0, BLOCK3_KERNEL_AVX2=1 };
+
+// 実行時に選ばれた3x3ブロックの核
+int GetBlock3Kernel();
+
+// 核を指定する(計測用)．AVX2が使えなければSCALARになる．実際に選ばれた核を返す
+int SetBlock3Kernel(int ikernel);
+
+// 行ブロック[iblk0,iblk1)について {y} = alpha*[A]{x} + beta*{y}
+void MatVec_Block3_AVX2
+(std::vector<double>& y,
+ ////
+ double alpha,
+ const std::vector<double>& x,
+ double beta,
+ const CMatrixSquareSparse& mat,
+ int iblk0, int iblk1);
+
+// 対称な行列(上三角だけを持つ)の行ブロック[iblk0,iblk1)について {y} += alpha*[A]{x}．
+// 転置の寄与のうちiblk1以降の行へのものはspill(先頭がiblk1行目)に足す
+void MatVecSym_Block3_AVX2
+(std::vector<double>& y,
+ double* spill,
+ ////
+ double alpha,
+ const std::vector<double>& x,
+ const CMatrixSquareSparse& mat,
+ int iblk0, int iblk1);
+
+// floatの複製(mat.SetValueFloat)を使うMatVec_Block3_AVX2
+void MatVecFloat_Block3_AVX2
+(std::vector<double>& y,
+ ////
+ double alpha,
+ const std::vector<double>& x,
+ double beta,
+ const CMatrixSquareSparse& mat,
+ int iblk0, int iblk1);
+
+// floatの複製(mat.SetValueFloat)を使うMatVecSym_Block3_AVX2
+void MatVecSymFloat_Block3_AVX2
+(std::vector<double>& y,
+ double* spill,
+ ////
+ double alpha,
+ const std::vector<double>& x,
+ const CMatrixSquareSparse& mat,
+ int iblk0, int iblk1);
+
+// ILU分解した行列の前進代入 {vec} = [D^-1]([L]^-1{vec})
+void ForwardSubstitution_Block3_AVX2
+(std::vector<double>& vec,
+ ////
+ const CMatrixSquareSparse& mat,
+ const int* diaInd);
+
+// ILU分解した行列の後退代入 {vec} = [U]^-1{vec}
+void BackwardSubstitution_Block3_AVX2
+(std::vector<double>& vec,
+ ////
+ const CMatrixSquareSparse& mat,
+ const int* diaInd);
+
+// floatの複製(mat.SetValueFloat)を使う前進代入と後退代入
+void ForwardSubstitutionFloat_Block3_AVX2
+(std::vector<double>& vec,
+ ////
+ const CMatrixSquareSparse& mat,
+ const int* diaInd);
+
+void BackwardSubstitutionFloat_Block3_AVX2
+(std::vector<double>& vec,
+ ////
+ const CMatrixSquareSparse& mat,
+ const int* diaInd);
+
+#endif // BLOCK3_AVX2_H
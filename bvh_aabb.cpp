@@ -6,9 +6,17 @@
 //
 
 #include <stdio.h>
-#include <set>
+#include <math.h>
+#include <algorithm>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "bvh_aabb.h"
+#include "ccd_avx2.h"
 #include "jagged_array.h"
 #include "vector3d.h"
 
@@ -19,6 +27,100 @@ static inline void AddPoint
   bb.AddPoint(p.x, p.y, p.z, eps);
 }
 
+// itri0からntri個の三角形を囲むBounding Boxを作る,三角形同士の近接計算用
+static inline void SetBoundingBoxLeaf_Prx
+(CAABB3D& bb,
+ int itri0, int ntri,
+ double delta,
+ const std::vector<double>& aXYZ,
+ const std::vector<int>& aTri)
+{
+  assert( itri0+ntri <= (int)aTri.size()/3 );
+  bb.isnt_empty = false;
+  for(int itri=itri0;itri<itri0+ntri;itri++){
+    const int ino0 = aTri[itri*3+0];
+    const int ino1 = aTri[itri*3+1];
+    const int ino2 = aTri[itri*3+2];
+    bb.AddPoint(aXYZ[ino0*3+0],aXYZ[ino0*3+1],aXYZ[ino0*3+2], delta*0.5);
+    bb.AddPoint(aXYZ[ino1*3+0],aXYZ[ino1*3+1],aXYZ[ino1*3+2], delta*0.5);
+    bb.AddPoint(aXYZ[ino2*3+0],aXYZ[ino2*3+1],aXYZ[ino2*3+2], delta*0.5);
+  }
+}
+
+// itri0からntri個の三角形の軌跡を囲むBounding Boxを作る,三角形同士のCCD交差計算用
+static inline void SetBoundingBoxLeaf_CCD
+(CAABB3D& bb,
+ int itri0, int ntri,
+ double dt,
+ const std::vector<double>& aXYZ,
+ const std::vector<double>& aUVW,
+ const std::vector<int>& aTri)
+{
+  const double eps = 1.0e-10;
+  assert( itri0+ntri <= (int)aTri.size()/3 );
+  bb.isnt_empty = false;
+  for(int itri=itri0;itri<itri0+ntri;itri++){
+    for(int inotri=0;inotri<3;inotri++){
+      const int ino = aTri[itri*3+inotri];
+      const double* p = &aXYZ[ino*3];
+      const double* v = &aUVW[ino*3];
+      bb.AddPoint(p[0],        p[1],        p[2],         eps);
+      bb.AddPoint(p[0]+dt*v[0],p[1]+dt*v[1],p[2]+dt*v[2], eps);
+    }
+  }
+}
+
+// 箱bbとSoAに並べた二つの子ノードの箱との交差を調べる．子ノード0と交差すればbit0,子ノード1と交差すればbit1が立つ
+static inline int IsIntersectChild
+(const CAABB3D& bb,
+ const CAABBChildBVH& bbc)
+{
+#ifdef __SSE2__
+  __m128d m = _mm_and_pd( _mm_cmple_pd(_mm_loadu_pd(bbc.x_min),_mm_set1_pd(bb.x_max)),
+                          _mm_cmple_pd(_mm_set1_pd(bb.x_min),_mm_loadu_pd(bbc.x_max)) );
+  m = _mm_and_pd(m, _mm_and_pd( _mm_cmple_pd(_mm_loadu_pd(bbc.y_min),_mm_set1_pd(bb.y_max)),
+                                _mm_cmple_pd(_mm_set1_pd(bb.y_min),_mm_loadu_pd(bbc.y_max)) ) );
+  m = _mm_and_pd(m, _mm_and_pd( _mm_cmple_pd(_mm_loadu_pd(bbc.z_min),_mm_set1_pd(bb.z_max)),
+                                _mm_cmple_pd(_mm_set1_pd(bb.z_min),_mm_loadu_pd(bbc.z_max)) ) );
+  return _mm_movemask_pd(m);
+#else
+  int imask = 0;
+  for(int i=0;i<2;i++){ // 分岐をしないようにビット演算でまとめる
+    const int is_intersect =
+    (bbc.x_min[i] <= bb.x_max) & (bb.x_min <= bbc.x_max[i]) &
+    (bbc.y_min[i] <= bb.y_max) & (bb.y_min <= bbc.y_max[i]) &
+    (bbc.z_min[i] <= bb.z_max) & (bb.z_min <= bbc.z_max[i]);
+    imask |= is_intersect << i;
+  }
+  return imask;
+#endif
+}
+
+// 子ノードの箱をSoAのilane番目に書き込む
+static inline void SetChild
+(CAABBChildBVH& bbc,
+ int ilane,
+ const CAABB3D& bb)
+{
+  bbc.x_min[ilane] = bb.x_min;  bbc.x_max[ilane] = bb.x_max;
+  bbc.y_min[ilane] = bb.y_min;  bbc.y_max[ilane] = bb.y_max;
+  bbc.z_min[ilane] = bb.z_min;  bbc.z_max[ilane] = bb.z_max;
+}
+
+// 二つの子ノードの箱を囲む箱
+static inline void SetUnionChild
+(CAABB3D& bb,
+ const CAABBChildBVH& bbc)
+{
+  bb.x_min = ( bbc.x_min[0] < bbc.x_min[1] ) ? bbc.x_min[0] : bbc.x_min[1];
+  bb.x_max = ( bbc.x_max[0] > bbc.x_max[1] ) ? bbc.x_max[0] : bbc.x_max[1];
+  bb.y_min = ( bbc.y_min[0] < bbc.y_min[1] ) ? bbc.y_min[0] : bbc.y_min[1];
+  bb.y_max = ( bbc.y_max[0] > bbc.y_max[1] ) ? bbc.y_max[0] : bbc.y_max[1];
+  bb.z_min = ( bbc.z_min[0] < bbc.z_min[1] ) ? bbc.z_min[0] : bbc.z_min[1];
+  bb.z_max = ( bbc.z_max[0] > bbc.z_max[1] ) ? bbc.z_max[0] : bbc.z_max[1];
+  bb.isnt_empty = true;
+}
+
 // BVHのBounding Boxを構築,三角形同士の近接計算用
 void BuildBoundingBoxChild_Prx
 (int ibvh,
@@ -32,20 +134,8 @@ void BuildBoundingBoxChild_Prx
   assert( ibvh < aNodeBVH.size() );
   int ichild0 = aNodeBVH[ibvh].ichild[0];
   int ichild1 = aNodeBVH[ibvh].ichild[1];
-  if( ichild1 == -1 ){ // leaf、葉ノード
-    int itri = ichild0;
-    assert( itri < aTri.size() );
-    int ino0 = aTri[itri*3+0];
-    int ino1 = aTri[itri*3+1];
-    int ino2 = aTri[itri*3+2];
-    const CVector3D p0( aXYZ[ino0*3+0], aXYZ[ino0*3+1], aXYZ[ino0*3+2] );
-    const CVector3D p1( aXYZ[ino1*3+0], aXYZ[ino1*3+1], aXYZ[ino1*3+2] );
-    const CVector3D p2( aXYZ[ino2*3+0], aXYZ[ino2*3+1], aXYZ[ino2*3+2] );
-    CAABB3D& bb = aBB[ibvh];
-    bb.isnt_empty = false;
-    bb.AddPoint(p0.x,p0.y,p0.z, delta*0.5);
-    bb.AddPoint(p1.x,p1.y,p1.z, delta*0.5);
-    bb.AddPoint(p2.x,p2.y,p2.z, delta*0.5);
+  if( ichild1 < 0 ){ // leaf、葉ノード
+    SetBoundingBoxLeaf_Prx(aBB[ibvh], ichild0,-ichild1, delta, aXYZ,aTri);
     return;
   }
   // internal node,内部ノードは子ノードのBounding Volume
@@ -70,27 +160,12 @@ void BuildBoundingBoxChild_CCD
  const std::vector<CNodeBVH>& aNodeBVH,
  std::vector<CAABB3D>& aBB)
 {
-  double eps = 1.0e-10;
   //  std::cout << ibvh << " " << aNodeBVH_TreeTopo.size() << std::endl;
   assert( ibvh < aNodeBVH.size() );
   int ichild0 = aNodeBVH[ibvh].ichild[0];
   int ichild1 = aNodeBVH[ibvh].ichild[1];
-  if( ichild1 == -1 ){ // leaf
-    const int itri = ichild0;
-    assert( itri < aTri.size() );
-    const int ino0 = aTri[itri*3+0];
-    const int ino1 = aTri[itri*3+1];
-    const int ino2 = aTri[itri*3+2];
-    const CVector3D p0( aXYZ[ino0*3+0],                   aXYZ[ino0*3+1],                   aXYZ[ino0*3+2] );
-    const CVector3D p1( aXYZ[ino1*3+0],                   aXYZ[ino1*3+1],                   aXYZ[ino1*3+2] );
-    const CVector3D p2( aXYZ[ino2*3+0],                   aXYZ[ino2*3+1],                   aXYZ[ino2*3+2] );
-    const CVector3D q0( aXYZ[ino0*3+0]+dt*aUVW[ino0*3+0], aXYZ[ino0*3+1]+dt*aUVW[ino0*3+1], aXYZ[ino0*3+2]+dt*aUVW[ino0*3+2] );
-    const CVector3D q1( aXYZ[ino1*3+0]+dt*aUVW[ino1*3+0], aXYZ[ino1*3+1]+dt*aUVW[ino1*3+1], aXYZ[ino1*3+2]+dt*aUVW[ino1*3+2] );
-    const CVector3D q2( aXYZ[ino2*3+0]+dt*aUVW[ino2*3+0], aXYZ[ino2*3+1]+dt*aUVW[ino2*3+1], aXYZ[ino2*3+2]+dt*aUVW[ino2*3+2] );
-    CAABB3D& bb = aBB[ibvh];
-    bb.isnt_empty = false;
-    AddPoint(bb,p0, eps);  AddPoint(bb,p1, eps);  AddPoint(bb,p2, eps);
-    AddPoint(bb,q0, eps);  AddPoint(bb,q1, eps);  AddPoint(bb,q2, eps);
+  if( ichild1 < 0 ){ // leaf
+    SetBoundingBoxLeaf_CCD(aBB[ibvh], ichild0,-ichild1, dt, aXYZ,aUVW,aTri);
     return;
   }
   // internal node,内部ノードは子ノードのBounding Volume  
@@ -105,6 +180,121 @@ void BuildBoundingBoxChild_CCD
   return;
 }
 
+// 葉からの高さごとにBVHのノードを分類する.同じ高さのノードは互いに独立に更新できる
+void MakeBVHLevelOrder
+(CJaggedArray& aLevel,
+ int iroot,
+ const std::vector<CNodeBVH>& aNodeBVH)
+{
+  const int nnode = (int)aNodeBVH.size();
+  std::vector<int> aHeight(nnode,-1);
+  int nlevel = 0;
+  { // 帰りがけ順に高さを決める
+    std::vector<int> stack;
+    stack.push_back(iroot);
+    while(!stack.empty()){
+      const int ibvh = stack.back();
+      const int ichild0 = aNodeBVH[ibvh].ichild[0];
+      const int ichild1 = aNodeBVH[ibvh].ichild[1];
+      if( ichild1 < 0 ){ // leaf
+        aHeight[ibvh] = 0;
+        stack.pop_back();
+        continue;
+      }
+      if( aHeight[ichild0] == -1 ){ stack.push_back(ichild0); continue; }
+      if( aHeight[ichild1] == -1 ){ stack.push_back(ichild1); continue; }
+      const int h0 = aHeight[ichild0];
+      const int h1 = aHeight[ichild1];
+      aHeight[ibvh] = ( h0 > h1 ) ? h0+1 : h1+1;
+      if( aHeight[ibvh]+1 > nlevel ){ nlevel = aHeight[ibvh]+1; }
+      stack.pop_back();
+    }
+    if( nlevel == 0 ){ nlevel = 1; }
+  }
+  aLevel.InitializeSize(nlevel);
+  for(int ibvh=0;ibvh<nnode;ibvh++){
+    if( aHeight[ibvh] == -1 ) continue; // not connected to the root
+    aLevel.index[ aHeight[ibvh]+1 ]++;
+  }
+  for(int ilev=0;ilev<nlevel;ilev++){ aLevel.index[ilev+1] += aLevel.index[ilev]; }
+  aLevel.array.resize( aLevel.index[nlevel] );
+  for(int ibvh=0;ibvh<nnode;ibvh++){
+    const int ilev = aHeight[ibvh];
+    if( ilev == -1 ) continue;
+    aLevel.array[ aLevel.index[ilev] ] = ibvh;
+    aLevel.index[ilev]++;
+  }
+  for(int ilev=nlevel;ilev>0;ilev--){ aLevel.index[ilev] = aLevel.index[ilev-1]; }
+  aLevel.index[0] = 0;
+}
+
+// 高さごとに並列にBounding Boxを構築,三角形同士の近接計算用
+void BuildBoundingBoxLevel_Prx
+(double delta,
+ const std::vector<double>& aXYZ,
+ const std::vector<int>& aTri,
+ const std::vector<CNodeBVH>& aNodeBVH,
+ const CJaggedArray& aLevel,
+ std::vector<CAABB3D>& aBB,
+ std::vector<CAABBChildBVH>& aBBC)
+{
+  aBB.resize( aNodeBVH.size() );
+  aBBC.resize( aNodeBVH.size() );
+  for(int ilev=0;ilev<aLevel.Size();ilev++){
+    const int ind0 = aLevel.index[ilev];
+    const int ind1 = aLevel.index[ilev+1];
+#pragma omp parallel for if( ind1-ind0 > 256 )
+    for(int ind=ind0;ind<ind1;ind++){
+      const int ibvh = aLevel.array[ind];
+      const int ichild0 = aNodeBVH[ibvh].ichild[0];
+      const int ichild1 = aNodeBVH[ibvh].ichild[1];
+      if( ichild1 < 0 ){ // leaf、葉ノード
+        SetBoundingBoxLeaf_Prx(aBB[ibvh], ichild0,-ichild1, delta, aXYZ,aTri);
+      }
+      else{ // 子ノードは一つ下の高さまでに更新済み
+        SetUnionChild(aBB[ibvh],aBBC[ibvh]);
+      }
+      const int iroot = aNodeBVH[ibvh].iroot;
+      if( iroot < 0 ) continue;
+      SetChild(aBBC[iroot], (aNodeBVH[iroot].ichild[0]==ibvh)?0:1, aBB[ibvh]);
+    }
+  }
+}
+
+// 高さごとに並列にBounding Boxを構築,三角形同士のCCD交差計算用
+void BuildBoundingBoxLevel_CCD
+(double dt,
+ const std::vector<double>& aXYZ,
+ const std::vector<double>& aUVW,
+ const std::vector<int>& aTri,
+ const std::vector<CNodeBVH>& aNodeBVH,
+ const CJaggedArray& aLevel,
+ std::vector<CAABB3D>& aBB,
+ std::vector<CAABBChildBVH>& aBBC)
+{
+  aBB.resize( aNodeBVH.size() );
+  aBBC.resize( aNodeBVH.size() );
+  for(int ilev=0;ilev<aLevel.Size();ilev++){
+    const int ind0 = aLevel.index[ilev];
+    const int ind1 = aLevel.index[ilev+1];
+#pragma omp parallel for if( ind1-ind0 > 256 )
+    for(int ind=ind0;ind<ind1;ind++){
+      const int ibvh = aLevel.array[ind];
+      const int ichild0 = aNodeBVH[ibvh].ichild[0];
+      const int ichild1 = aNodeBVH[ibvh].ichild[1];
+      if( ichild1 < 0 ){ // leaf、葉ノード
+        SetBoundingBoxLeaf_CCD(aBB[ibvh], ichild0,-ichild1, dt, aXYZ,aUVW,aTri);
+      }
+      else{ // 子ノードは一つ下の高さまでに更新済み
+        SetUnionChild(aBB[ibvh],aBBC[ibvh]);
+      }
+      const int iroot = aNodeBVH[ibvh].iroot;
+      if( iroot < 0 ) continue;
+      SetChild(aBBC[iroot], (aNodeBVH[iroot].ichild[0]==ibvh)?0:1, aBB[ibvh]);
+    }
+  }
+}
+
 // 三角形を囲む三角形を構築する
 static void MakeTriSurTri
 (std::vector<int>& aTriSur,
@@ -312,292 +502,1094 @@ int MakeBVHTopology_TopDown
   return 0;
 }
 
-
-
 /* ---------------------------------------------------------------------------------- */
+// Linear BVH (Morton符号で並べた三角形から階層を作る)
 
-
-// VFの距離
-double DistanceFaceVertex
-(const CVector3D& p0, const CVector3D& p1, const CVector3D& p2,
- const CVector3D& p3,
- double& w0, double& w1)
+// 10bitの整数の各ビットの間に0を2つずつ挟む
+static inline unsigned int ExpandBits_Morton(unsigned int v)
 {
-  CVector3D v20 =p0-p2;
-  CVector3D v21 =p1-p2;
-  double t0 = Dot(v20,v20);
-  double t1 = Dot(v21,v21);
-  double t2 = Dot(v20,v21);
-  double t3 = Dot(v20,p3-p2);
-  double t4 = Dot(v21,p3-p2);
-  double det = t0*t1-t2*t2;
-  double invdet = 1.0/det;
-  w0 = (+t1*t3-t2*t4)*invdet;
-  w1 = (-t2*t3+t0*t4)*invdet;
-  const double w2 = 1-w0-w1;
-  CVector3D pw = w0*p0 + w1*p1 + w2*p2;
-  return (pw-p3).Length();
+  v = (v * 0x00010001u) & 0xFF0000FFu;
+  v = (v * 0x00000101u) & 0x0F00F00Fu;
+  v = (v * 0x00000011u) & 0xC30C30C3u;
+  v = (v * 0x00000005u) & 0x49249249u;
+  return v;
 }
 
-//　EEの距離
-double DistanceEdgeEdge
-(const CVector3D& p0, const CVector3D& p1,
- const CVector3D& q0, const CVector3D& q1,
- double& ratio_p, double& ratio_q)
+// [0,1]^3の座標から30bitのMorton符号を作る
+static inline unsigned int MortonCode
+(double x, double y, double z)
 {
-  const CVector3D& vp =p1-p0;
-  const CVector3D& vq =q1-q0;
-  if( Cross(vp,vq).Length() < 1.0e-10 ){ // handling parallel edge
-    CVector3D pq0 = p0-q0;
-    CVector3D nvp = vp; nvp.SetNormalizedVector();
-    CVector3D vert = pq0 - Dot(pq0,nvp)*nvp;
-    double dist = vert.Length();
-    double lp0 = Dot(p0,nvp);
-    double lp1 = Dot(p1,nvp);
-    double lq0 = Dot(q0,nvp);
-    double lq1 = Dot(q1,nvp);
-    double p_min  = ( lp0 < lp1 ) ? lp0 : lp1;
-    double p_max  = ( lp0 > lp1 ) ? lp0 : lp1;
-    double q_min  = ( lq0 < lq1 ) ? lq0 : lq1;
-    double q_max  = ( lq0 > lq1 ) ? lq0 : lq1;
-    double lm;
-    if(      p_max < q_min ){ lm = (p_max+q_min)*0.5; }
-    else if( q_max < p_min ){ lm = (q_max+p_min)*0.5; }
-    else if( p_max < q_max ){ lm = (p_max+q_min)*0.5; }
-    else{                     lm = (q_max+p_min)*0.5; }
-    ratio_p = (lm-lp0)/(lp1-lp0);
-    ratio_q = (lm-lq0)/(lq1-lq0);
-    return dist;
-  }
-  double t0 = Dot(vp,vp);
-  double t1 = Dot(vq,vq);
-  double t2 = Dot(vp,vq);
-  double t3 = Dot(vp,q0-p0);
-  double t4 = Dot(vq,q0-p0);
-  double det = t0*t1-t2*t2;
-  double invdet = 1.0/det;
-  ratio_p = (+t1*t3-t2*t4)*invdet;
-  ratio_q = (+t2*t3-t0*t4)*invdet;
-  CVector3D pc = p0 + ratio_p*vp;
-  CVector3D qc = q0 + ratio_q*vq;
-  return (pc-qc).Length();
+  double ix = x*1024.0;  if( ix < 0 ){ ix = 0; }  if( ix > 1023 ){ ix = 1023; }
+  double iy = y*1024.0;  if( iy < 0 ){ iy = 0; }  if( iy > 1023 ){ iy = 1023; }
+  double iz = z*1024.0;  if( iz < 0 ){ iz = 0; }  if( iz > 1023 ){ iz = 1023; }
+  const unsigned int xx = ExpandBits_Morton((unsigned int)ix);
+  const unsigned int yy = ExpandBits_Morton((unsigned int)iy);
+  const unsigned int zz = ExpandBits_Morton((unsigned int)iz);
+  return xx*4 + yy*2 + zz;
 }
 
+// 32bit整数の上位から連続する0の数
+static inline int CountLeadingZero(unsigned int v)
+{
+  if( v == 0 ) return 32;
+  int n = 0;
+  if( (v & 0xFFFF0000u) == 0 ){ n += 16; v <<= 16; }
+  if( (v & 0xFF000000u) == 0 ){ n +=  8; v <<=  8; }
+  if( (v & 0xF0000000u) == 0 ){ n +=  4; v <<=  4; }
+  if( (v & 0xC0000000u) == 0 ){ n +=  2; v <<=  2; }
+  if( (v & 0x80000000u) == 0 ){ n +=  1; }
+  return n;
+}
 
-
-/////////////////////////////////////////////////////////////////////
-
-
-// VFの距離が所定の距離以下にあるかどうか
-bool IsContact_FV_Proximity
-(int ino0, int ino1, int ino2, int ino3,
- const CVector3D& p0, const CVector3D& p1, const CVector3D& p2, const CVector3D& p3,
- const CAABB3D& bb,
- const double delta)
+// ソートされたMorton符号のi番目とj番目の共通の上位ビットの長さ．符号が同じ時は番号で区別する
+static inline int LengthCommonPrefix_Morton
+(int i, int j,
+ const std::vector<unsigned int>& aCode)
 {
-  if( ino3 == ino0 || ino3 == ino1 || ino3 == ino2 ){ return false; }
-  if( !bb.IsInside(p3.x,p3.y,p3.z) ) return false;
-  double height = fabs( Height(p0,p1,p2,p3) );
-  if( height > delta ) return false;
-  double w0,w1;
-  const double dist = DistanceFaceVertex(p0,p1,p2,p3,w0,w1);
-  const double w2 = 1-w0-w1;
-  if( dist > delta ) return false;
-  double mgn = ( Distance(p0, p1) + Distance(p1, p2) + Distance(p2, p3) ) / 3.0;
-  mgn = 0;
-  if( w0 < -mgn || w0 > 1+mgn ) return false;
-  if( w1 < -mgn || w1 > 1+mgn ) return false;
-  if( w2 < -mgn || w2 > 1+mgn ) return false;
-  return true;
+  const int n = (int)aCode.size();
+  if( j < 0 || j >= n ) return -1;
+  if( aCode[i] == aCode[j] ){ return 32 + CountLeadingZero((unsigned int)i ^ (unsigned int)j); }
+  return CountLeadingZero(aCode[i] ^ aCode[j]);
 }
 
-// EEの距離が所定の距離以下にあるかどうか
-bool IsContact_EE_Proximity
-(int ino0,        int ino1,        int jno0,        int jno1,
- const CVector3D& p0, const CVector3D& p1, const CVector3D& q0, const CVector3D& q1,
- const double delta)
+// Morton符号を基数ソートする(1回に8bit,安定なソート)
+static void SortMortonCode
+(std::vector<unsigned int>& aCode,
+ std::vector<int>& aIndex)
 {
-  if( ino0 == jno0 || ino0 == jno1 || ino1 == jno0 || ino1 == jno1 ) return false;
-  if( q0.x+delta < p0.x && q0.x+delta < p1.x && q1.x+delta < p0.x && q1.x+delta < p1.x ) return false;
-  if( q0.x-delta > p0.x && q0.x-delta > p1.x && q1.x-delta > p0.x && q1.x-delta > p1.x ) return false;
-  if( q0.y+delta < p0.y && q0.y+delta < p1.y && q1.y+delta < p0.y && q1.y+delta < p1.y ) return false;
-  if( q0.y-delta > p0.y && q0.y-delta > p1.y && q1.y-delta > p0.y && q1.y-delta > p1.y ) return false;
-  if( q0.z+delta < p0.z && q0.z+delta < p1.z && q1.z+delta < p0.z && q1.z+delta < p1.z ) return false;
-  if( q0.z-delta > p0.z && q0.z-delta > p1.z && q1.z-delta > p0.z && q1.z-delta > p1.z ) return false;
-  double ratio_p, ratio_q;
-  double dist = DistanceEdgeEdge(p0, p1, q0, q1, ratio_p, ratio_q);
-  if( dist > delta ) return false;
-  if( ratio_p < 0 ) return false;
-  if( ratio_p > 1 ) return false;
-  if( ratio_q < 0 ) return false;
-  if( ratio_q > 1 ) return false;
-  const CVector3D& pm = (1-ratio_p)*p0 + ratio_p*p1;
-  const CVector3D& qm = (1-ratio_q)*q0 + ratio_q*q1;
-  if( (pm-qm).Length() > delta ) return false;
-  return true;
+  const int n = (int)aCode.size();
+  std::vector<unsigned int> aCode1(n);
+  std::vector<int> aIndex1(n);
+  for(int ibyte=0;ibyte<4;ibyte++){
+    const int ishift = ibyte*8;
+    int aCnt[257];
+    for(int i=0;i<257;i++){ aCnt[i] = 0; }
+    for(int i=0;i<n;i++){ aCnt[((aCode[i]>>ishift)&0xFF)+1]++; }
+    if( aCnt[((aCode[0]>>ishift)&0xFF)+1] == n ) continue; // 全て同じ値なので並べ替えの必要はない
+    for(int i=0;i<256;i++){ aCnt[i+1] += aCnt[i]; }
+    for(int i=0;i<n;i++){
+      const int jdst = aCnt[(aCode[i]>>ishift)&0xFF]++;
+      aCode1[jdst] = aCode[i];
+      aIndex1[jdst] = aIndex[i];
+    }
+    aCode.swap(aCode1);
+    aIndex.swap(aIndex1);
+  }
 }
 
-// ２つのノードの下の階層ので接触する要素を抽出
-void GetContactElement_Proximity
-(std::set<CContactElement>& aContactElem,
- ////
- double delta,
+int MakeBVHTopology_Morton
+(const std::vector<int>& aTri,
  const std::vector<double>& aXYZ,
- const std::vector<int>& aTri,
- int ibvh0,
- int ibvh1,
- const std::vector<CNodeBVH>& aBVH,
- const std::vector<CAABB3D>& aBB)
+ std::vector<CNodeBVH>& aNodeBVH)
 {
-  assert( ibvh0 < aBB.size() );
-  assert( ibvh1 < aBB.size() );
-  if( !aBB[ibvh0].IsIntersect(aBB[ibvh1]) ) return;
-  const int ichild0_0 = aBVH[ibvh0].ichild[0];
-  const int ichild0_1 = aBVH[ibvh0].ichild[1];
-  const int ichild1_0 = aBVH[ibvh1].ichild[0];
-  const int ichild1_1 = aBVH[ibvh1].ichild[1];
-  const bool is_leaf0 = (ichild0_1 == -1);
-  const bool is_leaf1 = (ichild1_1 == -1);
-  if(      !is_leaf0 && !is_leaf1 ){
-    GetContactElement_Proximity(aContactElem, delta,aXYZ,aTri, ichild0_0,ichild1_0, aBVH,aBB);
-    GetContactElement_Proximity(aContactElem, delta,aXYZ,aTri, ichild0_1,ichild1_0, aBVH,aBB);
-    GetContactElement_Proximity(aContactElem, delta,aXYZ,aTri, ichild0_0,ichild1_1, aBVH,aBB);
-    GetContactElement_Proximity(aContactElem, delta,aXYZ,aTri, ichild0_1,ichild1_1, aBVH,aBB);
+  aNodeBVH.clear();
+  const int ntri = (int)aTri.size()/3;
+  if( ntri == 0 ) return -1;
+  if( ntri == 1 ){
+    aNodeBVH.resize(1);
+    aNodeBVH[0].iroot = -1;
+    aNodeBVH[0].ichild[0] = 0;
+    aNodeBVH[0].ichild[1] = -1;
+    return 0;
   }
-  else if( !is_leaf0 &&  is_leaf1 ){
-    GetContactElement_Proximity(aContactElem, delta,aXYZ,aTri, ichild0_0,ibvh1,aBVH,aBB);
-    GetContactElement_Proximity(aContactElem, delta,aXYZ,aTri, ichild0_1,ibvh1,aBVH,aBB);
+  // 三角形の重心のAABB
+  std::vector<double> aCG(ntri*3);
+  CAABB3D bb;
+  for(int itri=0;itri<ntri;itri++){
+    const CVector3D cg = TriGravityCenter(itri,aTri,aXYZ);
+    aCG[itri*3+0] = cg.x;
+    aCG[itri*3+1] = cg.y;
+    aCG[itri*3+2] = cg.z;
+    AddPoint(bb,cg, 1.0e-10);
   }
-  else if(  is_leaf0 && !is_leaf1 ){
-    GetContactElement_Proximity(aContactElem, delta,aXYZ,aTri, ibvh0,ichild1_0,aBVH,aBB);
-    GetContactElement_Proximity(aContactElem, delta,aXYZ,aTri, ibvh0,ichild1_1,aBVH,aBB);
-  }
-  else if(  is_leaf0 &&  is_leaf1 ){
-    const int itri = ichild0_0;
-    const int jtri = ichild1_0;
-    const int in0 = aTri[itri*3+0];
-    const int in1 = aTri[itri*3+1];
-    const int in2 = aTri[itri*3+2];
-    const int jn0 = aTri[jtri*3+0];
-    const int jn1 = aTri[jtri*3+1];
-    const int jn2 = aTri[jtri*3+2];
-    const CVector3D p0(aXYZ[in0*3+0], aXYZ[in0*3+1], aXYZ[in0*3+2]);
-    const CVector3D p1(aXYZ[in1*3+0], aXYZ[in1*3+1], aXYZ[in1*3+2]);
-    const CVector3D p2(aXYZ[in2*3+0], aXYZ[in2*3+1], aXYZ[in2*3+2]);
-    const CVector3D q0(aXYZ[jn0*3+0], aXYZ[jn0*3+1], aXYZ[jn0*3+2]);
-    const CVector3D q1(aXYZ[jn1*3+0], aXYZ[jn1*3+1], aXYZ[jn1*3+2]);
-    const CVector3D q2(aXYZ[jn2*3+0], aXYZ[jn2*3+1], aXYZ[jn2*3+2]);
-    if( IsContact_FV_Proximity(   in0,in1,in2,jn0, p0,p1,p2,q0, aBB[ichild0_0], delta) ){
-      aContactElem.insert( CContactElement(true,    in0,in1,in2,jn0) );
-    }
-    if( IsContact_FV_Proximity(   in0,in1,in2,jn1, p0,p1,p2,q1, aBB[ichild0_0], delta) ){
-      aContactElem.insert( CContactElement(true,    in0,in1,in2,jn1) );
-    }
-    if( IsContact_FV_Proximity(   in0,in1,in2,jn2, p0,p1,p2,q2, aBB[ichild0_0], delta) ){
-      aContactElem.insert( CContactElement(true,    in0,in1,in2,jn2) );
-    }
-    if( IsContact_FV_Proximity(   jn0,jn1,jn2,in0, q0,q1,q2,p0, aBB[ichild1_0], delta) ){
-      aContactElem.insert( CContactElement(true,    jn0,jn1,jn2,in0) );
-    }
-    if( IsContact_FV_Proximity(   jn0,jn1,jn2,in1, q0,q1,q2,p1, aBB[ichild1_0], delta) ){
-      aContactElem.insert( CContactElement(true,    jn0,jn1,jn2,in1) );
-    }
-    if( IsContact_FV_Proximity(   jn0,jn1,jn2,in2, q0,q1,q2,p2, aBB[ichild1_0], delta) ){
-      aContactElem.insert( CContactElement(true,    jn0,jn1,jn2,in2) );
-    }
-    ////
-    if( IsContact_EE_Proximity(      in0,in1,jn0,jn1, p0,p1,q0,q1, delta) ){
-      aContactElem.insert( CContactElement(false,    in0,in1,jn0,jn1) );
-    }
-    if( IsContact_EE_Proximity(      in0,in1,jn1,jn2, p0,p1,q1,q2, delta) ){
-      aContactElem.insert( CContactElement(false,    in0,in1,jn1,jn2) );
-    }
-    if( IsContact_EE_Proximity(      in0,in1,jn2,jn0, p0,p1,q2,q0, delta) ){
-      aContactElem.insert( CContactElement(false,    in0,in1,jn2,jn0) );
-    }
-    if( IsContact_EE_Proximity(      in1,in2,jn0,jn1, p1,p2,q0,q1, delta) ){
-      aContactElem.insert( CContactElement(false,    in1,in2,jn0,jn1) );
+  const double invlx = 1.0/(bb.x_max-bb.x_min);
+  const double invly = 1.0/(bb.y_max-bb.y_min);
+  const double invlz = 1.0/(bb.z_max-bb.z_min);
+  std::vector<unsigned int> aCode(ntri);
+  std::vector<int> aIndex(ntri);
+#pragma omp parallel for
+  for(int itri=0;itri<ntri;itri++){
+    aCode[itri] = MortonCode((aCG[itri*3+0]-bb.x_min)*invlx,
+                             (aCG[itri*3+1]-bb.y_min)*invly,
+                             (aCG[itri*3+2]-bb.z_min)*invlz);
+    aIndex[itri] = itri;
+  }
+  SortMortonCode(aCode,aIndex);
+  // ノードの番号：0からntri-2までが内部ノード(0が根)，ntri-1からが葉ノード
+  const int nleaf_start = ntri-1;
+  aNodeBVH.resize(ntri*2-1);
+  aNodeBVH[0].iroot = -1;
+#pragma omp parallel for
+  for(int ileaf=0;ileaf<ntri;ileaf++){
+    aNodeBVH[nleaf_start+ileaf].ichild[0] = aIndex[ileaf];
+    aNodeBVH[nleaf_start+ileaf].ichild[1] = -1;
+  }
+  // 内部ノードはそれぞれ独立に作れる (Karras 2012)
+#pragma omp parallel for
+  for(int inode=0;inode<ntri-1;inode++){
+    // 担当する範囲の向きを決める
+    const int d = ( LengthCommonPrefix_Morton(inode,inode+1,aCode)
+                   - LengthCommonPrefix_Morton(inode,inode-1,aCode) > 0 ) ? 1 : -1;
+    // 範囲のもう一方の端を探す
+    const int lcp_min = LengthCommonPrefix_Morton(inode,inode-d,aCode);
+    int lmax = 2;
+    while( LengthCommonPrefix_Morton(inode,inode+lmax*d,aCode) > lcp_min ){ lmax *= 2; }
+    int l = 0;
+    for(int t=lmax/2;t>=1;t/=2){
+      if( LengthCommonPrefix_Morton(inode,inode+(l+t)*d,aCode) > lcp_min ){ l += t; }
     }
-    if( IsContact_EE_Proximity(      in1,in2,jn1,jn2, p1,p2,q1,q2, delta) ){
-      aContactElem.insert( CContactElement(false,    in1,in2,jn1,jn2) );
+    const int jnode = inode+l*d;
+    // 範囲を分割する位置を二分探索する
+    const int lcp_node = LengthCommonPrefix_Morton(inode,jnode,aCode);
+    int s = 0;
+    for(int div=2;;div*=2){
+      const int t = (l+div-1)/div;
+      if( LengthCommonPrefix_Morton(inode,inode+(s+t)*d,aCode) > lcp_node ){ s += t; }
+      if( t == 1 ) break;
     }
-    if( IsContact_EE_Proximity(      in1,in2,jn2,jn0, p1,p2,q2,q0, delta) ){
-      aContactElem.insert( CContactElement(false,    in1,in2,jn2,jn0) );
+    const int isplit = inode+s*d+((d<0)?-1:0);
+    const int ich0 = ( ((inode<jnode)?inode:jnode) == isplit   ) ? nleaf_start+isplit   : isplit;
+    const int ich1 = ( ((inode>jnode)?inode:jnode) == isplit+1 ) ? nleaf_start+isplit+1 : isplit+1;
+    aNodeBVH[inode].ichild[0] = ich0;
+    aNodeBVH[inode].ichild[1] = ich1;
+    aNodeBVH[ich0].iroot = inode;
+    aNodeBVH[ich1].iroot = inode;
+  }
+  return 0;
+}
+
+
+
+/* ---------------------------------------------------------------------------------- */
+// Binned SAH (表面積ヒューリスティクス)でBVHを作る
+
+static const int NBIN_SAH = 16;
+
+// aIndex[ibegin]からaIndex[iend-1]までの三角形を囲むノードinodeを作り,再帰的に分割する
+static void DevideTriArySAH
+(int inode,
+ std::vector<CNodeBVH>& aNodeBVH,
+ std::vector<int>& aIndex,
+ int ibegin, int iend,
+ const std::vector<CAABB3D>& aBBTri,
+ const std::vector<double>& aCG)
+{
+  assert( iend-ibegin > 1 );
+  CAABB3D bbc; // 重心のAABB
+  for(int i=ibegin;i<iend;i++){
+    const int itri = aIndex[i];
+    AddPoint(bbc,CVector3D(aCG[itri*3+0],aCG[itri*3+1],aCG[itri*3+2]), 1.0e-10);
+  }
+  const double cmin[3] = { bbc.x_min, bbc.y_min, bbc.z_min };
+  const double cmax[3] = { bbc.x_max, bbc.y_max, bbc.z_max };
+  double cost_best = -1;
+  int idim_best = -1, ibin_best = -1;
+  for(int idim=0;idim<3;idim++){
+    const double len = cmax[idim]-cmin[idim];
+    CAABB3D aBBBin[NBIN_SAH];
+    int aCntBin[NBIN_SAH];
+    for(int ibin=0;ibin<NBIN_SAH;ibin++){ aCntBin[ibin] = 0; }
+    for(int i=ibegin;i<iend;i++){
+      const int itri = aIndex[i];
+      int ibin = (int)((aCG[itri*3+idim]-cmin[idim])/len*NBIN_SAH);
+      if( ibin >= NBIN_SAH ){ ibin = NBIN_SAH-1; }
+      aBBBin[ibin] += aBBTri[itri];
+      aCntBin[ibin]++;
     }
-    if( IsContact_EE_Proximity(      in2,in0,jn0,jn1, p2,p0,q0,q1, delta) ){
-      aContactElem.insert( CContactElement(false,    in2,in0,jn0,jn1) );
+    // 左から累積した面積を作っておき,右から累積しながら分割のコストを評価する
+    double aAreaL[NBIN_SAH];
+    int aCntL[NBIN_SAH];
+    {
+      CAABB3D bb;
+      int icnt = 0;
+      for(int ibin=0;ibin<NBIN_SAH;ibin++){
+        bb += aBBBin[ibin];
+        icnt += aCntBin[ibin];
+        aAreaL[ibin] = bb.SurfaceArea();
+        aCntL[ibin] = icnt;
+      }
     }
-    if( IsContact_EE_Proximity(      in2,in0,jn1,jn2, p2,p0,q1,q2, delta) ){
-      aContactElem.insert( CContactElement(false,    in2,in0,jn1,jn2) );
+    CAABB3D bbr;
+    int icntr = 0;
+    for(int ibin=NBIN_SAH-1;ibin>0;ibin--){ // ibin-1までが左,ibin以降が右
+      bbr += aBBBin[ibin];
+      icntr += aCntBin[ibin];
+      if( icntr == 0 || aCntL[ibin-1] == 0 ) continue;
+      const double cost = aAreaL[ibin-1]*aCntL[ibin-1] + bbr.SurfaceArea()*icntr;
+      if( cost_best < 0 || cost < cost_best ){
+        cost_best = cost;
+        idim_best = idim;
+        ibin_best = ibin;
+      }
     }
-    if( IsContact_EE_Proximity(      in2,in0,jn2,jn0, p2,p0,q2,q0, delta) ){
-      aContactElem.insert( CContactElement(false,    in2,in0,jn2,jn0) );
+  }
+  int imid;
+  if( idim_best == -1 ){ // 重心が全て同じ場所にあるので半分に分ける
+    imid = (ibegin+iend)/2;
+  }
+  else{
+    const double len = cmax[idim_best]-cmin[idim_best];
+    int i0 = ibegin, i1 = iend-1;
+    while( i0 <= i1 ){ // 左のビンに入る三角形を前に集める
+      const int itri = aIndex[i0];
+      int ibin = (int)((aCG[itri*3+idim_best]-cmin[idim_best])/len*NBIN_SAH);
+      if( ibin >= NBIN_SAH ){ ibin = NBIN_SAH-1; }
+      if( ibin < ibin_best ){ i0++; continue; }
+      aIndex[i0] = aIndex[i1];
+      aIndex[i1] = itri;
+      i1--;
     }
+    imid = i0;
+  }
+  assert( imid > ibegin && imid < iend );
+  const int inode_ch0 = (int)aNodeBVH.size();
+  const int inode_ch1 = (int)aNodeBVH.size()+1;
+  aNodeBVH.resize(aNodeBVH.size()+2);
+  aNodeBVH[inode_ch0].iroot = inode;
+  aNodeBVH[inode_ch1].iroot = inode;
+  aNodeBVH[inode].ichild[0] = inode_ch0;
+  aNodeBVH[inode].ichild[1] = inode_ch1;
+  if( imid-ibegin == 1 ){
+    aNodeBVH[inode_ch0].ichild[0] = aIndex[ibegin];
+    aNodeBVH[inode_ch0].ichild[1] = -1;
+  }
+  else{
+    DevideTriArySAH(inode_ch0,aNodeBVH,aIndex,ibegin,imid,aBBTri,aCG);
+  }
+  if( iend-imid == 1 ){
+    aNodeBVH[inode_ch1].ichild[0] = aIndex[imid];
+    aNodeBVH[inode_ch1].ichild[1] = -1;
+  }
+  else{
+    DevideTriArySAH(inode_ch1,aNodeBVH,aIndex,imid,iend,aBBTri,aCG);
   }
 }
 
-// この木の階層の中で近くにある要素を抽出
-void GetContactElement_Proximity
-(std::set<CContactElement>& aContactElem,
- ////
- double delta,
+int MakeBVHTopology_SAH
+(const std::vector<int>& aTri,
  const std::vector<double>& aXYZ,
- const std::vector<int>& aTri,
- int ibvh,
- const std::vector<CNodeBVH>& aBVH,
- const std::vector<CAABB3D>& aBB)
+ std::vector<CNodeBVH>& aNodeBVH)
 {
-  const int ichild0 = aBVH[ibvh].ichild[0];
-  const int ichild1 = aBVH[ibvh].ichild[1];
-  const bool is_leaf = (ichild1 == -1);
-  if( is_leaf ) return;
-  GetContactElement_Proximity(aContactElem, delta,aXYZ,aTri, ichild0,ichild1,aBVH,aBB);
-  GetContactElement_Proximity(aContactElem, delta,aXYZ,aTri, ichild0,        aBVH,aBB);
-  GetContactElement_Proximity(aContactElem, delta,aXYZ,aTri, ichild1,        aBVH,aBB);
+  aNodeBVH.clear();
+  const int ntri = (int)aTri.size()/3;
+  if( ntri == 0 ) return -1;
+  aNodeBVH.reserve(ntri*2-1);
+  aNodeBVH.resize(1);
+  aNodeBVH[0].iroot = -1;
+  if( ntri == 1 ){
+    aNodeBVH[0].ichild[0] = 0;
+    aNodeBVH[0].ichild[1] = -1;
+    return 0;
+  }
+  std::vector<CAABB3D> aBBTri(ntri);
+  std::vector<double> aCG(ntri*3);
+  for(int itri=0;itri<ntri;itri++){
+    SetBoundingBoxLeaf_Prx(aBBTri[itri],itri,1,1.0e-10,aXYZ,aTri);
+    const CVector3D cg = TriGravityCenter(itri,aTri,aXYZ);
+    aCG[itri*3+0] = cg.x;
+    aCG[itri*3+1] = cg.y;
+    aCG[itri*3+2] = cg.z;
+  }
+  std::vector<int> aIndex(ntri);
+  for(int itri=0;itri<ntri;itri++){ aIndex[itri] = itri; }
+  DevideTriArySAH(0,aNodeBVH,aIndex,0,ntri,aBBTri,aCG);
+  return 0;
 }
 
+/* ---------------------------------------------------------------------------------- */
+// 複数の三角形を持つ葉
 
-/* ------------------------------------------------------------------------------------- */
-
-// 三次関数を評価する関数
-inline double EvaluateCubic
-(double r2, // 入力の値
- double k0, double k1, double k2, double k3) // 三次関数の係数
+// ノードの下にある三角形の数を数える
+static int CountTriBVH
+(std::vector<int>& aNTri,
+ int ibvh,
+ const std::vector<CNodeBVH>& aNodeBVH)
 {
-  return k0 + k1*r2 + k2*r2*r2 + k3*r2*r2*r2;
+  const int ichild0 = aNodeBVH[ibvh].ichild[0];
+  const int ichild1 = aNodeBVH[ibvh].ichild[1];
+  if( ichild1 < 0 ){
+    aNTri[ibvh] = -ichild1;
+    return aNTri[ibvh];
+  }
+  aNTri[ibvh] = CountTriBVH(aNTri,ichild0,aNodeBVH) + CountTriBVH(aNTri,ichild1,aNodeBVH);
+  return aNTri[ibvh];
+}
+
+// ノードの下にある三角形の頂点番号をaTriLeafの後ろに加える
+static void GatherTriBVH
+(std::vector<int>& aTriLeaf,
+ int ibvh,
+ const std::vector<CNodeBVH>& aNodeBVH,
+ const std::vector<int>& aTri)
+{
+  const int ichild0 = aNodeBVH[ibvh].ichild[0];
+  const int ichild1 = aNodeBVH[ibvh].ichild[1];
+  if( ichild1 < 0 ){
+    aTriLeaf.insert(aTriLeaf.end(), aTri.begin()+ichild0*3, aTri.begin()+(ichild0-ichild1)*3);
+    return;
+  }
+  GatherTriBVH(aTriLeaf,ichild0,aNodeBVH,aTri);
+  GatherTriBVH(aTriLeaf,ichild1,aNodeBVH,aTri);
+}
+
+// 古い木のノードibvhに対応するノードを新しい木に作り,その番号を返す
+static int CollapseBVHLeaf_Node
+(std::vector<CNodeBVH>& aNodeNew,
+ std::vector<int>& aTriLeaf,
+ ////
+ int ibvh,
+ int iroot_new,
+ const std::vector<CNodeBVH>& aNodeOld,
+ const std::vector<int>& aNTri,
+ const std::vector<int>& aTri,
+ int ntri_leaf_max)
+{
+  const int inode = (int)aNodeNew.size();
+  aNodeNew.resize(inode+1);
+  aNodeNew[inode].iroot = iroot_new;
+  if( aNTri[ibvh] <= ntri_leaf_max ){ // 部分木の三角形を並べて葉にする
+    aNodeNew[inode].ichild[0] = (int)aTriLeaf.size()/3;
+    aNodeNew[inode].ichild[1] = -aNTri[ibvh];
+    GatherTriBVH(aTriLeaf,ibvh,aNodeOld,aTri);
+    return inode;
+  }
+  const int ich0 = CollapseBVHLeaf_Node(aNodeNew,aTriLeaf, aNodeOld[ibvh].ichild[0],inode, aNodeOld,aNTri,aTri,ntri_leaf_max);
+  const int ich1 = CollapseBVHLeaf_Node(aNodeNew,aTriLeaf, aNodeOld[ibvh].ichild[1],inode, aNodeOld,aNTri,aTri,ntri_leaf_max);
+  aNodeNew[inode].ichild[0] = ich0;
+  aNodeNew[inode].ichild[1] = ich1;
+  return inode;
+}
+
+int CollapseBVHLeaf
+(std::vector<int>& aTriLeaf,
+ std::vector<CNodeBVH>& aNodeBVH,
+ ////
+ int iroot,
+ const std::vector<int>& aTri,
+ int ntri_leaf_max)
+{
+  assert( ntri_leaf_max >= 1 && ntri_leaf_max <= NTRI_BVH_LEAF_MAX );
+  std::vector<int> aNTri(aNodeBVH.size(),0);
+  CountTriBVH(aNTri,iroot,aNodeBVH);
+  std::vector<CNodeBVH> aNodeNew;
+  aNodeNew.reserve(aNodeBVH.size());
+  aTriLeaf.clear();
+  aTriLeaf.reserve(aTri.size());
+  CollapseBVHLeaf_Node(aNodeNew,aTriLeaf, iroot,-1, aNodeBVH,aNTri,aTri,ntri_leaf_max);
+  aNodeBVH.swap(aNodeNew);
+  return 0;
+}
+
+/* ---------------------------------------------------------------------------------- */
+// 頂点と辺の持ち主の三角形
+
+void MakeFeatureOwnerTri
+(std::vector<unsigned char>& aFlgOwn,
+ ////
+ const std::vector<int>& aTri)
+{
+  const int ntri = (int)aTri.size()/3;
+  int nno = 0;
+  for(int i=0;i<(int)aTri.size();i++){ if( aTri[i]+1 > nno ){ nno = aTri[i]+1; } }
+  CJaggedArray aTSV;  aTSV.SetNodeToElem(aTri, ntri, 3, nno);
+  aFlgOwn.assign(ntri,0);
+#pragma omp parallel for if( ntri > 4096 )
+  for(int itri=0;itri<ntri;itri++){
+    unsigned char flg = 0;
+    for(int inotri=0;inotri<3;inotri++){
+      const int ino0 = aTri[itri*3+inotri];
+      const int ino1 = aTri[itri*3+(inotri+1)%3];
+      bool is_own_vtx = true, is_own_edge = true; // 番号の最も小さい三角形が持ち主
+      for(int itsv=aTSV.index[ino0];itsv<aTSV.index[ino0+1];itsv++){
+        const int jtri = aTSV.array[itsv];
+        if( jtri >= itri ) continue;
+        is_own_vtx = false;
+        if( aTri[jtri*3+0] == ino1 || aTri[jtri*3+1] == ino1 || aTri[jtri*3+2] == ino1 ){ is_own_edge = false; }
+      }
+      if( is_own_vtx ){  flg |= (1<<inotri); }
+      if( is_own_edge ){ flg |= (1<<(inotri+3)); }
+    }
+    aFlgOwn[itri] = flg;
+  }
+}
+
+/* ---------------------------------------------------------------------------------- */
+// BVHの品質の評価
+
+void EvaluateQualityBVH
+(double& cost_sah,
+ int& ndepth_max,
+ double& ratio_overlap,
+ ////
+ int iroot,
+ const std::vector<CNodeBVH>& aNodeBVH,
+ const std::vector<CAABB3D>& aBB)
+{
+  cost_sah = 0;
+  ndepth_max = 0;
+  ratio_overlap = 0;
+  const double area_root = aBB[iroot].SurfaceArea();
+  if( area_root <= 0 ) return;
+  std::vector< std::pair<int,int> > stack; // (ノード,深さ)
+  stack.push_back( std::make_pair(iroot,0) );
+  while( !stack.empty() ){
+    const int ibvh = stack.back().first;
+    const int idepth = stack.back().second;
+    stack.pop_back();
+    const double area = aBB[ibvh].SurfaceArea()/area_root;
+    if( aNodeBVH[ibvh].ichild[1] < 0 ){ // 葉
+      cost_sah += area*(-aNodeBVH[ibvh].ichild[1]);
+      if( idepth > ndepth_max ){ ndepth_max = idepth; }
+      continue;
+    }
+    cost_sah += area;
+    const int ichild0 = aNodeBVH[ibvh].ichild[0];
+    const int ichild1 = aNodeBVH[ibvh].ichild[1];
+    { // 兄弟の箱の重なり
+      const CAABB3D& bb0 = aBB[ichild0];
+      const CAABB3D& bb1 = aBB[ichild1];
+      if( bb0.IsIntersect(bb1) ){
+        const CAABB3D bbi((bb0.x_min>bb1.x_min)?bb0.x_min:bb1.x_min, (bb0.x_max<bb1.x_max)?bb0.x_max:bb1.x_max,
+                          (bb0.y_min>bb1.y_min)?bb0.y_min:bb1.y_min, (bb0.y_max<bb1.y_max)?bb0.y_max:bb1.y_max,
+                          (bb0.z_min>bb1.z_min)?bb0.z_min:bb1.z_min, (bb0.z_max<bb1.z_max)?bb0.z_max:bb1.z_max);
+        ratio_overlap += bbi.SurfaceArea()/area_root;
+      }
+    }
+    stack.push_back( std::make_pair(ichild0,idepth+1) );
+    stack.push_back( std::make_pair(ichild1,idepth+1) );
+  }
+}
+
+/* ---------------------------------------------------------------------------------- */
+// 法線のコーンによる自己接触の判定の省略
+
+static const int NEDGE_CONTOUR_MAX = 64; // 輪郭の辺がこれより多いノードは判定しない(輪郭の判定が辺の数の二乗の手間なので)
+
+// 互いに素な集合の根
+static inline int FindRootUnion(std::vector<int>& aParent, int i)
+{
+  while( aParent[i] != i ){
+    aParent[i] = aParent[aParent[i]];
+    i = aParent[i];
+  }
+  return i;
+}
+
+void CNormalConeBVH::Initialize
+(int iroot,
+ const std::vector<CNodeBVH>& aNodeBVH,
+ const std::vector<int>& aTri)
+{
+  const int nnode = (int)aNodeBVH.size();
+  const int ntri = (int)aTri.size()/3;
+  int nno = 0;
+  for(int i=0;i<(int)aTri.size();i++){ if( aTri[i]+1 > nno ){ nno = aTri[i]+1; } }
+  std::vector<int> aTriSur;
+  MakeTriSurTri(aTriSur,nno,aTri);
+  // ノードの下の三角形の範囲を求める(葉の順に並んでいれば部分木の三角形は連続している)
+  std::vector<int> aRange(nnode*2,-1);
+  {
+    std::vector<int> stack(1,iroot);
+    while( !stack.empty() ){
+      const int ibvh = stack.back();
+      const int ichild0 = aNodeBVH[ibvh].ichild[0];
+      const int ichild1 = aNodeBVH[ibvh].ichild[1];
+      if( ichild1 < 0 ){
+        aRange[ibvh*2+0] = ichild0;
+        aRange[ibvh*2+1] = ichild0-ichild1;
+        stack.pop_back();
+        continue;
+      }
+      if( aRange[ichild0*2+1] == -1 ){ stack.push_back(ichild0); continue; }
+      if( aRange[ichild1*2+1] == -1 ){ stack.push_back(ichild1); continue; }
+      stack.pop_back();
+      if( aRange[ichild0*2+1] != aRange[ichild1*2+0] ){ aRange[ibvh*2+1] = -2; continue; } // 連続していない
+      if( aRange[ichild0*2+0] < 0 || aRange[ichild1*2+1] < 0 ){ aRange[ibvh*2+1] = -2; continue; }
+      aRange[ibvh*2+0] = aRange[ichild0*2+0];
+      aRange[ibvh*2+1] = aRange[ichild1*2+1];
+    }
+  }
+  // 三角形がつながっていて輪郭の辺が少ないノードについて輪郭を作る
+  const int e2n[3][2] = {{1,2},{2,0},{0,1}};
+  aIsCullable.assign(nnode,0);
+  aContour.InitializeSize(nnode);
+  std::vector<int> aParent(ntri);
+  std::vector< std::vector<int> > aaEdge(nnode);
+#pragma omp parallel for schedule(dynamic,16) firstprivate(aParent)
+  for(int ibvh=0;ibvh<nnode;ibvh++){
+    const int itri0 = aRange[ibvh*2+0];
+    const int itri1 = aRange[ibvh*2+1];
+    if( itri0 < 0 || itri1 < 0 ) continue;
+    std::vector<int>& aEdge = aaEdge[ibvh];
+    for(int itri=itri0;itri<itri1;itri++){ aParent[itri] = itri; }
+    int ncomp = itri1-itri0;
+    for(int itri=itri0;itri<itri1;itri++){
+      for(int iedge=0;iedge<3;iedge++){
+        const int jtri = aTriSur[itri*3+iedge];
+        if( jtri >= itri0 && jtri < itri1 ){
+          const int ir = FindRootUnion(aParent,itri);
+          const int jr = FindRootUnion(aParent,jtri);
+          if( ir != jr ){ aParent[ir] = jr; ncomp--; }
+          continue;
+        }
+        aEdge.push_back( aTri[itri*3+e2n[iedge][0]] );
+        aEdge.push_back( aTri[itri*3+e2n[iedge][1]] );
+      }
+      if( (int)aEdge.size() > NEDGE_CONTOUR_MAX*2 ) break;
+    }
+    if( ncomp != 1 || (int)aEdge.size() > NEDGE_CONTOUR_MAX*2 ){ aEdge.clear(); continue; }
+    aIsCullable[ibvh] = 1;
+  }
+  for(int ibvh=0;ibvh<nnode;ibvh++){ aContour.index[ibvh+1] = aContour.index[ibvh] + (int)aaEdge[ibvh].size()/2; }
+  aContour.array.resize( aContour.index[nnode]*2 );
+  for(int ibvh=0;ibvh<nnode;ibvh++){
+    std::copy(aaEdge[ibvh].begin(),aaEdge[ibvh].end(),aContour.array.begin()+aContour.index[ibvh]*2);
+  }
+  aAxis.assign(nnode*3,0.0);
+  aAngle.assign(nnode,M_PI);
+}
+
+// 法線の集合を含むコーンを作る(長さが0の法線があれば全方向)
+static void SetNormalCone
+(double axis[3], double& angle,
+ const CVector3D* aNorm, int nnorm)
+{
+  CVector3D a(0,0,0);
+  for(int inorm=0;inorm<nnorm;inorm++){
+    const double len = aNorm[inorm].Length();
+    if( len < 1.0e-20 ){ angle = M_PI; return; }
+    a += aNorm[inorm]*(1.0/len);
+  }
+  const double len = a.Length();
+  if( len < 1.0e-10 ){ angle = M_PI; return; }
+  a *= 1.0/len;
+  angle = 0;
+  for(int inorm=0;inorm<nnorm;inorm++){
+    double c = Dot(a,aNorm[inorm])/aNorm[inorm].Length();
+    if( c > 1 ){ c = 1; }
+    if( c < -1 ){ c = -1; }
+    const double ang = acos(c);
+    if( ang > angle ){ angle = ang; }
+  }
+  axis[0] = a.x;  axis[1] = a.y;  axis[2] = a.z;
+}
+
+// 子ノードのコーンを含むコーン
+static void MergeNormalCone
+(double axis[3], double& angle,
+ const double axis0[3], double angle0,
+ const double axis1[3], double angle1)
+{
+  if( angle0 >= M_PI || angle1 >= M_PI ){ angle = M_PI; return; }
+  CVector3D a(axis0[0]+axis1[0], axis0[1]+axis1[1], axis0[2]+axis1[2]);
+  const double len = a.Length();
+  if( len < 1.0e-10 ){ angle = M_PI; return; }
+  a *= 1.0/len;
+  double c0 = a.x*axis0[0] + a.y*axis0[1] + a.z*axis0[2];
+  double c1 = a.x*axis1[0] + a.y*axis1[1] + a.z*axis1[2];
+  c0 = ( c0 > 1 ) ? 1 : c0;
+  c1 = ( c1 > 1 ) ? 1 : c1;
+  const double ang0 = acos(c0)+angle0;
+  const double ang1 = acos(c1)+angle1;
+  angle = ( ang0 > ang1 ) ? ang0 : ang1;
+  if( angle > M_PI ){ angle = M_PI; }
+  axis[0] = a.x;  axis[1] = a.y;  axis[2] = a.z;
+}
+
+// 高さごとにコーンを更新する．pUVWが0でなければ時間dtの間に法線が動く範囲を含める
+static void UpdateNormalCone
+(CNormalConeBVH& cone,
+ double dt,
+ const std::vector<double>& aXYZ,
+ const std::vector<double>* pUVW,
+ const std::vector<int>& aTri,
+ const std::vector<CNodeBVH>& aNodeBVH,
+ const CJaggedArray& aLevel)
+{
+  if( cone.aIsCullable.size() != aNodeBVH.size() ) return; // 初期化されていない
+  for(int ilev=0;ilev<aLevel.Size();ilev++){
+    const int ind0 = aLevel.index[ilev];
+    const int ind1 = aLevel.index[ilev+1];
+#pragma omp parallel for if( ind1-ind0 > 256 )
+    for(int ind=ind0;ind<ind1;ind++){
+      const int ibvh = aLevel.array[ind];
+      const int ichild0 = aNodeBVH[ibvh].ichild[0];
+      const int ichild1 = aNodeBVH[ibvh].ichild[1];
+      if( ichild1 >= 0 ){
+        MergeNormalCone(cone.aAxis.data()+ibvh*3,   cone.aAngle[ibvh],
+                        cone.aAxis.data()+ichild0*3,cone.aAngle[ichild0],
+                        cone.aAxis.data()+ichild1*3,cone.aAngle[ichild1]);
+        continue;
+      }
+      // 葉の三角形の法線．動く三角形の法線は時間の二次関数なのでそのベジエの制御点を使う
+      CVector3D aNorm[NTRI_BVH_LEAF_MAX*3];
+      int nnorm = 0;
+      for(int itri=ichild0;itri<ichild0-ichild1;itri++){
+        const int ino0 = aTri[itri*3+0];
+        const int ino1 = aTri[itri*3+1];
+        const int ino2 = aTri[itri*3+2];
+        const CVector3D p0(aXYZ[ino0*3+0],aXYZ[ino0*3+1],aXYZ[ino0*3+2]);
+        const CVector3D e1 = CVector3D(aXYZ[ino1*3+0],aXYZ[ino1*3+1],aXYZ[ino1*3+2]) - p0;
+        const CVector3D e2 = CVector3D(aXYZ[ino2*3+0],aXYZ[ino2*3+1],aXYZ[ino2*3+2]) - p0;
+        const CVector3D n0 = Cross(e1,e2);
+        aNorm[nnorm++] = n0;
+        if( pUVW == 0 ) continue;
+        const std::vector<double>& aUVW = *pUVW;
+        const CVector3D v0(aUVW[ino0*3+0],aUVW[ino0*3+1],aUVW[ino0*3+2]);
+        const CVector3D v1 = (CVector3D(aUVW[ino1*3+0],aUVW[ino1*3+1],aUVW[ino1*3+2]) - v0)*dt;
+        const CVector3D v2 = (CVector3D(aUVW[ino2*3+0],aUVW[ino2*3+1],aUVW[ino2*3+2]) - v0)*dt;
+        aNorm[nnorm++] = n0 + (Cross(e1,v2)+Cross(v1,e2))*0.5;
+        aNorm[nnorm++] = Cross(e1+v1,e2+v2);
+      }
+      SetNormalCone(cone.aAxis.data()+ibvh*3,cone.aAngle[ibvh], aNorm,nnorm);
+    }
+  }
+}
+
+void CNormalConeBVH::Update_Prx
+(const std::vector<double>& aXYZ,
+ const std::vector<int>& aTri,
+ const std::vector<CNodeBVH>& aNodeBVH,
+ const CJaggedArray& aLevel)
+{
+  UpdateNormalCone(*this, 0,aXYZ,0,aTri, aNodeBVH,aLevel);
+}
+
+void CNormalConeBVH::Update_CCD
+(double dt,
+ const std::vector<double>& aXYZ,
+ const std::vector<double>& aUVW,
+ const std::vector<int>& aTri,
+ const std::vector<CNodeBVH>& aNodeBVH,
+ const CJaggedArray& aLevel)
+{
+  UpdateNormalCone(*this, dt,aXYZ,&aUVW,aTri, aNodeBVH,aLevel);
+}
+
+// 平面上の二つの線分の距離
+static double DistanceSegSeg2D
+(const double a0[2], const double a1[2],
+ const double b0[2], const double b1[2])
+{
+  { // 交差していれば0
+    const double d0 = (a1[0]-a0[0])*(b0[1]-a0[1]) - (a1[1]-a0[1])*(b0[0]-a0[0]);
+    const double d1 = (a1[0]-a0[0])*(b1[1]-a0[1]) - (a1[1]-a0[1])*(b1[0]-a0[0]);
+    const double d2 = (b1[0]-b0[0])*(a0[1]-b0[1]) - (b1[1]-b0[1])*(a0[0]-b0[0]);
+    const double d3 = (b1[0]-b0[0])*(a1[1]-b0[1]) - (b1[1]-b0[1])*(a1[0]-b0[0]);
+    if( d0*d1 <= 0 && d2*d3 <= 0 ) return 0;
+  }
+  const double* aP[4] = { a0, a1, b0, b1 };
+  const double* aS[4][2] = { {b0,b1}, {b0,b1}, {a0,a1}, {a0,a1} };
+  double dist = -1;
+  for(int i=0;i<4;i++){ // 端点ともう一方の線分の距離の最小値
+    const double* p = aP[i];
+    const double* s0 = aS[i][0];
+    const double* s1 = aS[i][1];
+    const double sx = s1[0]-s0[0], sy = s1[1]-s0[1];
+    const double sqlen = sx*sx + sy*sy;
+    double r = ( sqlen > 1.0e-20 ) ? ((p[0]-s0[0])*sx + (p[1]-s0[1])*sy)/sqlen : 0;
+    r = ( r < 0 ) ? 0 : ( ( r > 1 ) ? 1 : r );
+    const double dx = s0[0]+r*sx-p[0], dy = s0[1]+r*sy-p[1];
+    const double d = sqrt(dx*dx+dy*dy);
+    if( dist < 0 || d < dist ){ dist = d; }
+  }
+  return dist;
+}
+
+bool CNormalConeBVH::IsSelfContactFree
+(int ibvh,
+ double dt,
+ double delta,
+ const std::vector<double>& aXYZ,
+ const std::vector<double>* pUVW) const
+{
+  if( ibvh >= (int)aIsCullable.size() ) return false;
+  if( !aIsCullable[ibvh] ) return false;
+  if( aAngle[ibvh] > M_PI*0.5-1.0e-3 ) return false; // 法線が半球に収まっていない
+  // 輪郭をコーンの軸に垂直な平面に投影して,辺同士が十分離れていることを確かめる
+  const CVector3D n(aAxis[ibvh*3+0],aAxis[ibvh*3+1],aAxis[ibvh*3+2]);
+  CVector3D u = ( fabs(n.x) < 0.5 ) ? Cross(n,CVector3D(1,0,0)) : Cross(n,CVector3D(0,1,0));
+  u *= 1.0/u.Length();
+  const CVector3D v = Cross(n,u);
+  const int iedge0 = aContour.index[ibvh];
+  const int nedge = aContour.index[ibvh+1]-iedge0;
+  double aPos[NEDGE_CONTOUR_MAX][2][2];
+  double aMove[NEDGE_CONTOUR_MAX]; // 辺が平面上で動く距離の最大値
+  for(int iedge=0;iedge<nedge;iedge++){
+    aMove[iedge] = 0;
+    for(int inoed=0;inoed<2;inoed++){
+      const int ino = aContour.array[(iedge0+iedge)*2+inoed];
+      const CVector3D p(aXYZ[ino*3+0],aXYZ[ino*3+1],aXYZ[ino*3+2]);
+      aPos[iedge][inoed][0] = Dot(p,u);
+      aPos[iedge][inoed][1] = Dot(p,v);
+      if( pUVW == 0 ) continue;
+      const CVector3D d = CVector3D((*pUVW)[ino*3+0],(*pUVW)[ino*3+1],(*pUVW)[ino*3+2])*dt;
+      const double du = Dot(d,u), dv = Dot(d,v);
+      const double mv = sqrt(du*du+dv*dv);
+      if( mv > aMove[iedge] ){ aMove[iedge] = mv; }
+    }
+  }
+  for(int iedge=0;iedge<nedge;iedge++){
+    const int ino0 = aContour.array[(iedge0+iedge)*2+0];
+    const int ino1 = aContour.array[(iedge0+iedge)*2+1];
+    for(int jedge=iedge+1;jedge<nedge;jedge++){
+      const int jno0 = aContour.array[(iedge0+jedge)*2+0];
+      const int jno1 = aContour.array[(iedge0+jedge)*2+1];
+      if( ino0 == jno0 || ino0 == jno1 || ino1 == jno0 || ino1 == jno1 ) continue; // 隣り合う辺
+      const double dist = DistanceSegSeg2D(aPos[iedge][0],aPos[iedge][1], aPos[jedge][0],aPos[jedge][1]);
+      if( dist <= delta + aMove[iedge] + aMove[jedge] ) return false;
+    }
+  }
+  return true;
+}
+
+/* ---------------------------------------------------------------------------------- */
+// 速度が変わった頂点を含むノードの印
+
+void CDirtyBVH::Initialize
+(int nno,
+ const std::vector<CNodeBVH>& aNodeBVH,
+ const CJaggedArray& aLevel,
+ const std::vector<int>& aTri)
+{
+  const int nnode = (int)aNodeBVH.size();
+  aHeight.assign(nnode,-1);
+  for(int ilev=0;ilev<aLevel.Size();ilev++){
+    for(int ind=aLevel.index[ilev];ind<aLevel.index[ilev+1];ind++){ aHeight[ aLevel.array[ind] ] = ilev; }
+  }
+  // 頂点を含む葉ノード(一つの葉で同じ頂点は一度だけ数える)
+  std::vector<int> aLeafTri(aTri.size()/3,-1);
+  for(int ibvh=0;ibvh<nnode;ibvh++){
+    if( aHeight[ibvh] != 0 ) continue;
+    const int itri0 = aNodeBVH[ibvh].ichild[0];
+    const int ntri = -aNodeBVH[ibvh].ichild[1];
+    for(int itri=itri0;itri<itri0+ntri;itri++){ aLeafTri[itri] = ibvh; }
+  }
+  std::vector<int> aLeafLast(nno,-1);
+  aVtxLeaf.InitializeSize(nno);
+  for(int itri=0;itri<(int)aLeafTri.size();itri++){
+    if( aLeafTri[itri] == -1 ) continue;
+    for(int inotri=0;inotri<3;inotri++){
+      const int ino = aTri[itri*3+inotri];
+      if( aLeafLast[ino] == aLeafTri[itri] ) continue;
+      aLeafLast[ino] = aLeafTri[itri];
+      aVtxLeaf.index[ino+1]++;
+    }
+  }
+  for(int ino=0;ino<nno;ino++){ aVtxLeaf.index[ino+1] += aVtxLeaf.index[ino]; }
+  aVtxLeaf.array.resize( aVtxLeaf.index[nno] );
+  aLeafLast.assign(nno,-1);
+  for(int itri=0;itri<(int)aLeafTri.size();itri++){
+    if( aLeafTri[itri] == -1 ) continue;
+    for(int inotri=0;inotri<3;inotri++){
+      const int ino = aTri[itri*3+inotri];
+      if( aLeafLast[ino] == aLeafTri[itri] ) continue;
+      aLeafLast[ino] = aLeafTri[itri];
+      aVtxLeaf.array[ aVtxLeaf.index[ino] ] = aLeafTri[itri];
+      aVtxLeaf.index[ino]++;
+    }
+  }
+  for(int ino=nno;ino>0;ino--){ aVtxLeaf.index[ino] = aVtxLeaf.index[ino-1]; }
+  aVtxLeaf.index[0] = 0;
+  aIsDirty.assign(nnode,0);
+  aLevelDirty.InitializeSize(aLevel.Size());
+}
+
+void CDirtyBVH::SetDirtyVertex
+(const std::vector<int>& aIno,
+ const std::vector<CNodeBVH>& aNodeBVH)
+{
+  // 前の印を消す
+  for(int ind=0;ind<(int)aLevelDirty.array.size();ind++){ aIsDirty[ aLevelDirty.array[ind] ] = 0; }
+  // 葉から根に向かって,印のついたノードに着くまで印をつける
+  aDirty.clear();
+  for(int iino=0;iino<(int)aIno.size();iino++){
+    const int ino = aIno[iino];
+    for(int ind=aVtxLeaf.index[ino];ind<aVtxLeaf.index[ino+1];ind++){
+      int ibvh = aVtxLeaf.array[ind];
+      while( ibvh >= 0 && aIsDirty[ibvh] == 0 ){
+        aIsDirty[ibvh] = 1;
+        aDirty.push_back(ibvh);
+        ibvh = aNodeBVH[ibvh].iroot;
+      }
+    }
+  }
+  // 高さごとに並べる
+  const int nlevel = aLevelDirty.Size();
+  aLevelDirty.index.assign(nlevel+1,0);
+  for(int i=0;i<(int)aDirty.size();i++){ aLevelDirty.index[ aHeight[aDirty[i]]+1 ]++; }
+  for(int ilev=0;ilev<nlevel;ilev++){ aLevelDirty.index[ilev+1] += aLevelDirty.index[ilev]; }
+  aLevelDirty.array.resize( aDirty.size() );
+  for(int i=0;i<(int)aDirty.size();i++){
+    const int ilev = aHeight[aDirty[i]];
+    aLevelDirty.array[ aLevelDirty.index[ilev] ] = aDirty[i];
+    aLevelDirty.index[ilev]++;
+  }
+  for(int ilev=nlevel;ilev>0;ilev--){ aLevelDirty.index[ilev] = aLevelDirty.index[ilev-1]; }
+  aLevelDirty.index[0] = 0;
+}
+
+/* ---------------------------------------------------------------------------------- */
+
+
+// VFの距離
+double DistanceFaceVertex
+(const CVector3D& p0, const CVector3D& p1, const CVector3D& p2,
+ const CVector3D& p3,
+ double& w0, double& w1)
+{
+  CVector3D v20 =p0-p2;
+  CVector3D v21 =p1-p2;
+  double t0 = Dot(v20,v20);
+  double t1 = Dot(v21,v21);
+  double t2 = Dot(v20,v21);
+  double t3 = Dot(v20,p3-p2);
+  double t4 = Dot(v21,p3-p2);
+  double det = t0*t1-t2*t2;
+  double invdet = 1.0/det;
+  w0 = (+t1*t3-t2*t4)*invdet;
+  w1 = (-t2*t3+t0*t4)*invdet;
+  const double w2 = 1-w0-w1;
+  CVector3D pw = w0*p0 + w1*p1 + w2*p2;
+  return (pw-p3).Length();
+}
+
+//　EEの距離
+double DistanceEdgeEdge
+(const CVector3D& p0, const CVector3D& p1,
+ const CVector3D& q0, const CVector3D& q1,
+ double& ratio_p, double& ratio_q)
+{
+  const CVector3D& vp =p1-p0;
+  const CVector3D& vq =q1-q0;
+  if( Cross(vp,vq).Length() < 1.0e-10 ){ // handling parallel edge
+    CVector3D pq0 = p0-q0;
+    CVector3D nvp = vp; nvp.SetNormalizedVector();
+    CVector3D vert = pq0 - Dot(pq0,nvp)*nvp;
+    double dist = vert.Length();
+    double lp0 = Dot(p0,nvp);
+    double lp1 = Dot(p1,nvp);
+    double lq0 = Dot(q0,nvp);
+    double lq1 = Dot(q1,nvp);
+    double p_min  = ( lp0 < lp1 ) ? lp0 : lp1;
+    double p_max  = ( lp0 > lp1 ) ? lp0 : lp1;
+    double q_min  = ( lq0 < lq1 ) ? lq0 : lq1;
+    double q_max  = ( lq0 > lq1 ) ? lq0 : lq1;
+    double lm;
+    if(      p_max < q_min ){ lm = (p_max+q_min)*0.5; }
+    else if( q_max < p_min ){ lm = (q_max+p_min)*0.5; }
+    else if( p_max < q_max ){ lm = (p_max+q_min)*0.5; }
+    else{                     lm = (q_max+p_min)*0.5; }
+    ratio_p = (lm-lp0)/(lp1-lp0);
+    ratio_q = (lm-lq0)/(lq1-lq0);
+    return dist;
+  }
+  double t0 = Dot(vp,vp);
+  double t1 = Dot(vq,vq);
+  double t2 = Dot(vp,vq);
+  double t3 = Dot(vp,q0-p0);
+  double t4 = Dot(vq,q0-p0);
+  double det = t0*t1-t2*t2;
+  double invdet = 1.0/det;
+  ratio_p = (+t1*t3-t2*t4)*invdet;
+  ratio_q = (+t2*t3-t0*t4)*invdet;
+  CVector3D pc = p0 + ratio_p*vp;
+  CVector3D qc = q0 + ratio_q*vq;
+  return (pc-qc).Length();
 }
 
-// 二分法における三次関数の根を探す範囲を狭める関数
-static void BisectRangeCubicRoot
-(int& icnt,                  // (in out)何回幅を狭めたかというカウンタ
- double& r0, double& r1, // (in,out)入力の範囲から階を探して、狭められた後の範囲を返す
- double v0, double v1, // (in)入力の範囲の両端における値
+
+
+/////////////////////////////////////////////////////////////////////
+
+
+// VFの距離が所定の距離以下にあるかどうか
+bool IsContact_FV_Proximity
+(int ino0, int ino1, int ino2, int ino3,
+ const CVector3D& p0, const CVector3D& p1, const CVector3D& p2, const CVector3D& p3,
+ const CAABB3D& bb,
+ const double delta)
+{
+  if( ino3 == ino0 || ino3 == ino1 || ino3 == ino2 ){ return false; }
+  if( !bb.IsInside(p3.x,p3.y,p3.z) ) return false;
+  double height = fabs( Height(p0,p1,p2,p3) );
+  if( height > delta ) return false;
+  double w0,w1;
+  const double dist = DistanceFaceVertex(p0,p1,p2,p3,w0,w1);
+  const double w2 = 1-w0-w1;
+  if( dist > delta ) return false;
+  double mgn = ( Distance(p0, p1) + Distance(p1, p2) + Distance(p2, p3) ) / 3.0;
+  mgn = 0;
+  if( w0 < -mgn || w0 > 1+mgn ) return false;
+  if( w1 < -mgn || w1 > 1+mgn ) return false;
+  if( w2 < -mgn || w2 > 1+mgn ) return false;
+  return true;
+}
+
+// EEの距離が所定の距離以下にあるかどうか
+bool IsContact_EE_Proximity
+(int ino0,        int ino1,        int jno0,        int jno1,
+ const CVector3D& p0, const CVector3D& p1, const CVector3D& q0, const CVector3D& q1,
+ const double delta)
+{
+  if( ino0 == jno0 || ino0 == jno1 || ino1 == jno0 || ino1 == jno1 ) return false;
+  if( q0.x+delta < p0.x && q0.x+delta < p1.x && q1.x+delta < p0.x && q1.x+delta < p1.x ) return false;
+  if( q0.x-delta > p0.x && q0.x-delta > p1.x && q1.x-delta > p0.x && q1.x-delta > p1.x ) return false;
+  if( q0.y+delta < p0.y && q0.y+delta < p1.y && q1.y+delta < p0.y && q1.y+delta < p1.y ) return false;
+  if( q0.y-delta > p0.y && q0.y-delta > p1.y && q1.y-delta > p0.y && q1.y-delta > p1.y ) return false;
+  if( q0.z+delta < p0.z && q0.z+delta < p1.z && q1.z+delta < p0.z && q1.z+delta < p1.z ) return false;
+  if( q0.z-delta > p0.z && q0.z-delta > p1.z && q1.z-delta > p0.z && q1.z-delta > p1.z ) return false;
+  double ratio_p, ratio_q;
+  double dist = DistanceEdgeEdge(p0, p1, q0, q1, ratio_p, ratio_q);
+  if( dist > delta ) return false;
+  if( ratio_p < 0 ) return false;
+  if( ratio_p > 1 ) return false;
+  if( ratio_q < 0 ) return false;
+  if( ratio_q > 1 ) return false;
+  const CVector3D& pm = (1-ratio_p)*p0 + ratio_p*p1;
+  const CVector3D& qm = (1-ratio_q)*q0 + ratio_q*q1;
+  if( (pm-qm).Length() > delta ) return false;
+  return true;
+}
+
+// 三角形itriと三角形jtriの間で接触する要素を抽出
+// bbi,bbjはそれぞれの三角形を囲むBounding Box
+// flgi,flgjはそれぞれの三角形が持つ頂点と辺(MakeFeatureOwnerTriを参照)．持っている頂点と辺だけを判定する
+static void GetContactElement_Proximity_TriTri
+(std::vector<CContactElement>& aContactElem,
+ ////
+ double delta,
+ const std::vector<double>& aXYZ,
+ const std::vector<int>& aTri,
+ int itri,
+ int jtri,
+ const CAABB3D& bbi,
+ const CAABB3D& bbj,
+ unsigned int flgi,
+ unsigned int flgj)
+{
+  const int in0 = aTri[itri*3+0];
+  const int in1 = aTri[itri*3+1];
+  const int in2 = aTri[itri*3+2];
+  const int jn0 = aTri[jtri*3+0];
+  const int jn1 = aTri[jtri*3+1];
+  const int jn2 = aTri[jtri*3+2];
+  const CVector3D p0(aXYZ[in0*3+0], aXYZ[in0*3+1], aXYZ[in0*3+2]);
+  const CVector3D p1(aXYZ[in1*3+0], aXYZ[in1*3+1], aXYZ[in1*3+2]);
+  const CVector3D p2(aXYZ[in2*3+0], aXYZ[in2*3+1], aXYZ[in2*3+2]);
+  const CVector3D q0(aXYZ[jn0*3+0], aXYZ[jn0*3+1], aXYZ[jn0*3+2]);
+  const CVector3D q1(aXYZ[jn1*3+0], aXYZ[jn1*3+1], aXYZ[jn1*3+2]);
+  const CVector3D q2(aXYZ[jn2*3+0], aXYZ[jn2*3+1], aXYZ[jn2*3+2]);
+  if( (flgj&0x01) && IsContact_FV_Proximity(   in0,in1,in2,jn0, p0,p1,p2,q0, bbi, delta) ){
+    aContactElem.push_back( CContactElement(true,    in0,in1,in2,jn0) );
+  }
+  if( (flgj&0x02) && IsContact_FV_Proximity(   in0,in1,in2,jn1, p0,p1,p2,q1, bbi, delta) ){
+    aContactElem.push_back( CContactElement(true,    in0,in1,in2,jn1) );
+  }
+  if( (flgj&0x04) && IsContact_FV_Proximity(   in0,in1,in2,jn2, p0,p1,p2,q2, bbi, delta) ){
+    aContactElem.push_back( CContactElement(true,    in0,in1,in2,jn2) );
+  }
+  if( (flgi&0x01) && IsContact_FV_Proximity(   jn0,jn1,jn2,in0, q0,q1,q2,p0, bbj, delta) ){
+    aContactElem.push_back( CContactElement(true,    jn0,jn1,jn2,in0) );
+  }
+  if( (flgi&0x02) && IsContact_FV_Proximity(   jn0,jn1,jn2,in1, q0,q1,q2,p1, bbj, delta) ){
+    aContactElem.push_back( CContactElement(true,    jn0,jn1,jn2,in1) );
+  }
+  if( (flgi&0x04) && IsContact_FV_Proximity(   jn0,jn1,jn2,in2, q0,q1,q2,p2, bbj, delta) ){
+    aContactElem.push_back( CContactElement(true,    jn0,jn1,jn2,in2) );
+  }
+  ////
+  if( (flgi&0x08) && (flgj&0x08) && IsContact_EE_Proximity(      in0,in1,jn0,jn1, p0,p1,q0,q1, delta) ){
+    aContactElem.push_back( CContactElement(false,    in0,in1,jn0,jn1) );
+  }
+  if( (flgi&0x08) && (flgj&0x10) && IsContact_EE_Proximity(      in0,in1,jn1,jn2, p0,p1,q1,q2, delta) ){
+    aContactElem.push_back( CContactElement(false,    in0,in1,jn1,jn2) );
+  }
+  if( (flgi&0x08) && (flgj&0x20) && IsContact_EE_Proximity(      in0,in1,jn2,jn0, p0,p1,q2,q0, delta) ){
+    aContactElem.push_back( CContactElement(false,    in0,in1,jn2,jn0) );
+  }
+  if( (flgi&0x10) && (flgj&0x08) && IsContact_EE_Proximity(      in1,in2,jn0,jn1, p1,p2,q0,q1, delta) ){
+    aContactElem.push_back( CContactElement(false,    in1,in2,jn0,jn1) );
+  }
+  if( (flgi&0x10) && (flgj&0x10) && IsContact_EE_Proximity(      in1,in2,jn1,jn2, p1,p2,q1,q2, delta) ){
+    aContactElem.push_back( CContactElement(false,    in1,in2,jn1,jn2) );
+  }
+  if( (flgi&0x10) && (flgj&0x20) && IsContact_EE_Proximity(      in1,in2,jn2,jn0, p1,p2,q2,q0, delta) ){
+    aContactElem.push_back( CContactElement(false,    in1,in2,jn2,jn0) );
+  }
+  if( (flgi&0x20) && (flgj&0x08) && IsContact_EE_Proximity(      in2,in0,jn0,jn1, p2,p0,q0,q1, delta) ){
+    aContactElem.push_back( CContactElement(false,    in2,in0,jn0,jn1) );
+  }
+  if( (flgi&0x20) && (flgj&0x10) && IsContact_EE_Proximity(      in2,in0,jn1,jn2, p2,p0,q1,q2, delta) ){
+    aContactElem.push_back( CContactElement(false,    in2,in0,jn1,jn2) );
+  }
+  if( (flgi&0x20) && (flgj&0x20) && IsContact_EE_Proximity(      in2,in0,jn2,jn0, p2,p0,q2,q0, delta) ){
+    aContactElem.push_back( CContactElement(false,    in2,in0,jn2,jn0) );
+  }
+}
+
+/* ------------------------------------------------------------------------------------- */
+
+// 三次関数を評価する関数
+inline double EvaluateCubic
+(double r2, // 入力の値
  double k0, double k1, double k2, double k3) // 三次関数の係数
 {
-  icnt--;
-  if( icnt <= 0 ) return;
-  double r2 = 0.5*(r0+r1); // r2はr0とr1の中点
-  double v2 = EvaluateCubic(r2, k0,k1,k2,k3); // v2はr2における値
-  if( v0*v2 < 0 ){ r1 = r2; } // r0とr2の間で符号が変化する
-  else{            r0 = r2; } // r1とr2の間で符号が変化する
-  BisectRangeCubicRoot(icnt,r0,r1,v0,v2,k0,k1,k2,k3); // r0とr1の間でさらに範囲を狭める
+  return k0 + k1*r2 + k2*r2*r2 + k3*r2*r2*r2;
+}
+
+// 三次関数の導関数
+static inline double EvaluateCubicDerivative
+(double r2,
+ double k1, double k2, double k3)
+{
+  return k1 + 2*k2*r2 + 3*k3*r2*r2;
 }
 
-// 三次関数の根を探す関数
+// 三次関数の根を探す関数．[r0,r1]の両端の値v0,v1の符号が異なること
+// ニュートン法で探し,更新が範囲を出るか十分に縮まない時は二分法にする．更新の幅がtol以下になったら止める
 static double FindRootCubic
 (double r0, double r1,
  double v0, double v1,
- double k0, double k1, double k2, double k3)
+ double k0, double k1, double k2, double k3,
+ double tol)
 {
-  int icnt=15; // １５回範囲を狭める
-  BisectRangeCubicRoot(icnt, r0,r1, v0,v1, k0,k1,k2,k3);
-  return 0.5*(r0+r1);
+  if( v0 == 0 ){ return r0; }
+  if( v1 == 0 ){ return r1; }
+  const int NITR_MAX = 64; // 二分法でも倍精度の桁がなくなる回数
+  double dr_old = r1-r0;
+  double dr = dr_old;
+  double r2 = 0.5*(r0+r1);
+  double v2 = EvaluateCubic(r2, k0,k1,k2,k3);
+  double d2 = EvaluateCubicDerivative(r2, k1,k2,k3);
+  for(int itr=0;itr<NITR_MAX;itr++){
+    if( ((r2-r1)*d2-v2)*((r2-r0)*d2-v2) > 0 || fabs(2*v2) > fabs(dr_old*d2) ){ // 範囲を出るか,収束が遅い
+      dr_old = dr;
+      dr = 0.5*(r1-r0);
+      r2 = r0+dr;
+    }
+    else{
+      dr_old = dr;
+      dr = v2/d2;
+      r2 -= dr;
+    }
+    if( fabs(dr) < tol ) return r2;
+    v2 = EvaluateCubic(r2, k0,k1,k2,k3);
+    d2 = EvaluateCubicDerivative(r2, k1,k2,k3);
+    if( v2 == 0 ) return r2;
+    if( v0*v2 < 0 ){ r1 = r2; } // r0とr2の間で符号が変化する
+    else{            r0 = r2; } // r1とr2の間で符号が変化する
+  }
+  return r2;
 }
 
+static double FindRootCubicCoplaner(double k0, double k1, double k2, double k3, double tol);
+
 // ４つの点が同一平面上にならぶような補間係数を探す
 double FindCoplanerInterp
 (const CVector3D& s0, const CVector3D& s1, const CVector3D& s2, const CVector3D& s3,
- const CVector3D& e0, const CVector3D& e1, const CVector3D& e2, const CVector3D& e3)
+ const CVector3D& e0, const CVector3D& e1, const CVector3D& e2, const CVector3D& e3,
+ double tol)
 {
   const CVector3D x1 = s1-s0;
   const CVector3D x2 = s2-s0;
@@ -610,6 +1602,29 @@ double FindCoplanerInterp
   const double k1 = ScalarTripleProduct(v3,x1,x2)+ScalarTripleProduct(x3,v1,x2)+ScalarTripleProduct(x3,x1,v2);
   const double k2 = ScalarTripleProduct(v3,v1,x2)+ScalarTripleProduct(v3,x1,v2)+ScalarTripleProduct(x3,v1,v2);
   const double k3 = ScalarTripleProduct(v3,v1,v2);
+  return FindRootCubicCoplaner(k0,k1,k2,k3, tol);
+}
+
+// 三次関数 k0+k1*r+k2*r^2+k3*r^3 が[0,1]で符号を変えないことがベルンシュタイン基底の係数から分かるかどうか
+// (三次関数はベルンシュタイン係数の凸結合なので,係数が全て同じ符号なら根はない)
+static inline bool IsSignFixedBernstein
+(double k0, double k1, double k2, double k3)
+{
+  const double b0 = k0;
+  const double b1 = k0 + k1/3.0;
+  const double b2 = k0 + (2.0*k1 + k2)/3.0;
+  const double b3 = k0 + k1 + k2 + k3;
+  if( b0 > 0 && b1 > 0 && b2 > 0 && b3 > 0 ) return true;
+  if( b0 < 0 && b1 < 0 && b2 < 0 && b3 < 0 ) return true;
+  return false;
+}
+
+// 三次関数 k0+k1*r+k2*r^2+k3*r^3 の[0,1]の中の最初の根(なければ-1)．tolは根の精度
+static double FindRootCubicCoplaner
+(double k0, double k1, double k2, double k3,
+ double tol)
+{
+  if( IsSignFixedBernstein(k0,k1,k2,k3) ) return -1;
   double r0=-0.0;
   double r1=+1.0;
   const double f0 = EvaluateCubic(r0,k0,k1,k2,k3);
@@ -620,68 +1635,71 @@ double FindCoplanerInterp
     const double f2 = EvaluateCubic(r2, k0,k1,k2,k3);
     if( r2 > 0 && r2 < 1 ){
       if(      f0*f2 < 0 ){
-        return FindRootCubic(r0,r2, f0,f2, k0,k1,k2,k3);
+        return FindRootCubic(r0,r2, f0,f2, k0,k1,k2,k3, tol);
 
       }
       else if( f2*f1 < 0 ){
-        return FindRootCubic(r2,r1, f2,f1, k0,k1,k2,k3);
+        return FindRootCubic(r2,r1, f2,f1, k0,k1,k2,k3, tol);
       }
     }
   }
   if( det > 0 && fabs(k3) > 1.0e-10 ) // cubic function with two extream value、三次関数で極値がある場合
   {
     double r3 = (-k2-sqrt(det))/(3*k3); // 極値をとる小さい方のr
+    double r4 = (-k2+sqrt(det))/(3*k3); // 極値をとる大きい方のr
+    if( r3 > r4 ){ const double r = r3;  r3 = r4;  r4 = r; } // k3が負の時は逆になる
     const double f3 = EvaluateCubic(r3, k0,k1,k2,k3);
     if( r3 > 0 && r3 < 1 ){
       if(      f0*f3 < 0 ){
-        return FindRootCubic(r0,r3, f0,f3, k0,k1,k2,k3);
+        return FindRootCubic(r0,r3, f0,f3, k0,k1,k2,k3, tol);
       }
       else if( f3*f1 < 0 ){
-        return FindRootCubic(r3,r1, f3,f1, k0,k1,k2,k3);
+        return FindRootCubic(r3,r1, f3,f1, k0,k1,k2,k3, tol);
       }
     }
-    double r4 = (-k2+sqrt(det))/(3*k3); // 極値をとる大きい方のr
     const double f4 = EvaluateCubic(r4, k0,k1,k2,k3);
     if( r3 > 0 && r3 < 1 && r4 > 0 && r4 < 1 ){
       if( f3*f4 < 0 ){
-        return FindRootCubic(r3,r4, f3,f4, k0,k1,k2,k3);
+        return FindRootCubic(r3,r4, f3,f4, k0,k1,k2,k3, tol);
       }
     }
     if( r4 > 0 && r4 < 1 ){
       if(      f0*f4 < 0 ){
-        return FindRootCubic(r0,r4, f0,f4, k0,k1,k2,k3);
+        return FindRootCubic(r0,r4, f0,f4, k0,k1,k2,k3, tol);
       }
       else if( f4*f1 < 0 ){
-        return FindRootCubic(r4,r1, f4,f1, k0,k1,k2,k3);
+        return FindRootCubic(r4,r1, f4,f1, k0,k1,k2,k3, tol);
       }
     }
   }
   // monotonus function、0と１の間で短調増加関数
   if( f0*f1 > 0 ){ return -1; } // 根がない場合
-  return FindRootCubic(r0,r1, f0,f1, k0,k1,k2,k3);
+  return FindRootCubic(r0,r1, f0,f1, k0,k1,k2,k3, tol);
 }
 
 
-// CCDのFVで接触する要素を検出
-bool IsContact_FV_CCD
-(int ino0,        int ino1,        int ino2,        int ino3,
+// CCDのFVで同一平面になる時刻を調べる必要があるかどうか(根を求めない簡単な判定)
+static bool IsCandidate_FV_CCD
+(int& ifilter, // 偽の時に候補を除いた段階(FILTER_CCD_SHAREなど)
+ ////
+ int ino0,        int ino1,        int ino2,        int ino3,
  const CVector3D& p0, const CVector3D& p1, const CVector3D& p2, const CVector3D& p3,
  const CVector3D& q0, const CVector3D& q1, const CVector3D& q2, const CVector3D& q3,
  const CAABB3D& bb)
 {
   double eps = 1.0e-10;
-  if( ino3 == ino0 || ino3 == ino1 || ino3 == ino2 ){ return false; }
+  if( ino3 == ino0 || ino3 == ino1 || ino3 == ino2 ){ ifilter = FILTER_CCD_SHARE; return false; }
   CAABB3D bbp;
   AddPoint(bbp,p3, eps);
   AddPoint(bbp,q3, eps);
-  if( !bb.IsIntersect(bbp) ) return false;
+  if( !bb.IsIntersect(bbp) ){ ifilter = FILTER_CCD_BOX; return false; }
   { // CSAT
     CVector3D n = Cross(p1-p0,p2-p0);
     double t0 = Dot(p0-p3,n);
     double t1 = Dot(q0-q3,n);
     double t2 = Dot(q1-q3,n);
     double t3 = Dot(q2-q3,n);
-    if( t0*t1 > 0 && t0*t2 > 0 && t0*t3 > 0 ){ return false; }
+    if( t0*t1 > 0 && t0*t2 > 0 && t0*t3 > 0 ){ ifilter = FILTER_CCD_CSAT; return false; }
   }
   double r0,r1;
   double dist = DistanceFaceVertex(p0, p1, p2, p3, r0,r1);
@@ -695,15 +1713,23 @@ bool IsContact_FV_CCD
     double max_app = (vnt+vn3);
     ////
     const double r2 = 1-r0-r1;
-    if( dist > max_app ) return false;
+    if( dist > max_app ){ ifilter = FILTER_CCD_DIST; return false; }
     if( r0 < 0 || r0 > 1 || r1 < 0 || r1 > 1 || r2 < 0 || r2 > 1 ){
       double dist01 = (GetMinDist_LineSegPoint(p3, p0, p1)-p3).Length();
       double dist12 = (GetMinDist_LineSegPoint(p3, p1, p2)-p3).Length();
       double dist20 = (GetMinDist_LineSegPoint(p3, p2, p0)-p3).Length();
-      if( dist01 > max_app && dist12 > max_app && dist20 > max_app ){ return false; }
+      if( dist01 > max_app && dist12 > max_app && dist20 > max_app ){ ifilter = FILTER_CCD_DIST; return false; }
     }
   }
-  double t = FindCoplanerInterp(p0,p1,p2,p3, q0,q1,q2,q3);
+  return true;
+}
+
+// CCDのFVで同一平面になる時刻tに面と点が接触しているかどうか
+static bool IsContact_FV_CCD_Time
+(double t,
+ const CVector3D& p0, const CVector3D& p1, const CVector3D& p2, const CVector3D& p3,
+ const CVector3D& q0, const CVector3D& q1, const CVector3D& q2, const CVector3D& q3)
+{
   if( t < 0 || t > 1 ) return false;
   CVector3D p0m = (1-t)*p0 + t*q0;
   CVector3D p1m = (1-t)*p1 + t*q1;
@@ -718,15 +1744,32 @@ bool IsContact_FV_CCD
   return true;
 }
 
+// CCDのFVで接触する要素を検出
+bool IsContact_FV_CCD
+(int ino0,        int ino1,        int ino2,        int ino3,
+ const CVector3D& p0, const CVector3D& p1, const CVector3D& p2, const CVector3D& p3,
+ const CVector3D& q0, const CVector3D& q1, const CVector3D& q2, const CVector3D& q3,
+ const CAABB3D& bb)
+{
+  int ifilter;
+  if( !IsCandidate_FV_CCD(ifilter, ino0,ino1,ino2,ino3, p0,p1,p2,p3, q0,q1,q2,q3, bb) ) return false;
+  const double t = FindCoplanerInterp(p0,p1,p2,p3, q0,q1,q2,q3);
+  return IsContact_FV_CCD_Time(t, p0,p1,p2,p3, q0,q1,q2,q3);
+}
+
 
-// CCDのEEで接触する要素を検出
-bool IsContact_EE_CCD
-(int ino0,         int ino1,         int jno0,         int jno1,
+static const double DIST_CONTACT_EE_CCD = 1.0e-2; // CCDのEEで同一平面になった時に接触とみなす辺の距離
+
+// CCDのEEで同一平面になる時刻を調べる必要があるかどうか(根を求めない簡単な判定)
+static bool IsCandidate_EE_CCD
+(int& ifilter, // 偽の時に候補を除いた段階(FILTER_CCD_SHAREなど)
+ ////
+ int ino0,         int ino1,         int jno0,         int jno1,
  const CVector3D& p0s, const CVector3D& p1s, const CVector3D& q0s, const CVector3D& q1s,
  const CVector3D& p0e, const CVector3D& p1e, const CVector3D& q0e, const CVector3D& q1e)
 {
   double eps = 1.0e-10;
-  if( ino0 == jno0 || ino0 == jno1 || ino1 == jno0 || ino1 == jno1 ) return false;
+  if( ino0 == jno0 || ino0 == jno1 || ino1 == jno0 || ino1 == jno1 ){ ifilter = FILTER_CCD_SHARE; return false; }
   CAABB3D bbq;
   AddPoint(bbq,q0s, eps);
   AddPoint(bbq,q1s, eps);
@@ -738,47 +1781,39 @@ bool IsContact_EE_CCD
   AddPoint(bbp,p1s, eps);
   AddPoint(bbp,p0e, eps);
   AddPoint(bbp,p1e, eps);
-  if( !bbp.IsIntersect(bbq) ) return false;
-  /*
-   ////
-   { // CSAT
-   CVector3D n = Cross(p1s-p0s,q1s-q0s);
-   double t0 = Dot(q0s-p0s,n);
-   double t1 = Dot(q0e-p0e,n);
-   double t2 = Dot(q1e-p0e,n);
-   double t3 = Dot(q0e-p1e,n);
-   double t4 = Dot(q1e-p1e,n);
-   if( t0*t1 > 0 && t0*t2 > 0 && t0*t3 > 0 && t0*t4 > 0 ){ return false; }
-   }
-   double app_max;
-   {
-   double vnp0 = (p0e-p0s).Length();
-   double vnp1 = (p1e-p1s).Length();
-   double vnq0 = (q0e-q0s).Length();
-   double vnq1 = (q1e-q1s).Length();
-   double vnp = ( vnp0 > vnp1 ) ? vnp0 : vnp1;
-   double vnq = ( vnq0 > vnq1 ) ? vnq0 : vnq1;
-   app_max =(vnp+vnq);
-   }
-   ////
-   double r0,r1;
-   double dist = DistanceEdgeEdge(p0s, p1s, q0s, q1s, r0,r1);
-   {
-   if( dist > app_max ) return false;
-   if( r0 < 0 || r0 > 1 || r1 < 0 || r1 > 1 ){
-   CVector3D prj_p0s = GetMinDist_LineSegPoint(p0s, q0s, q1s);
-   double dist0 = (prj_p0s-p0s).Length();
-   CVector3D prj_p1s = GetMinDist_LineSegPoint(p1s, q0s, q1s);
-   double dist1 = (prj_p1s-p1s).Length();
-   CVector3D prj_q0s = GetMinDist_LineSegPoint(q0s, p0s, p1s);
-   double dist2 = (prj_q0s-q0s).Length();
-   CVector3D prj_q1s = GetMinDist_LineSegPoint(q1s, p0s, p1s);
-   double dist3 = (prj_q1s-q1s).Length();
-   if( dist0 > app_max && dist1 > app_max && dist2 > app_max && dist3 > app_max ) return false;
-   }
-   }
-   */
-  const double t = FindCoplanerInterp(p0s,p1s,q0s,q1s, p0e,p1e,q0e,q1e);
+  if( !bbp.IsIntersect(bbq) ){ ifilter = FILTER_CCD_BOX; return false; }
+  // 辺上の点は端点の変位の凸結合で動くので,辺同士の距離は最大でも二つの辺の端点の変位の最大値の和しか縮まない
+  // 同一平面になった時に距離がDIST_CONTACT_EE_CCD以下でないと接触しないので,それより離れていれば除いてよい
+  // (辺を延長した直線のCSATは根が二つある時に接触を見落とすので使わない)
+  double max_app;
+  {
+    const double vnp0 = (p0e-p0s).Length();
+    const double vnp1 = (p1e-p1s).Length();
+    const double vnq0 = (q0e-q0s).Length();
+    const double vnq1 = (q1e-q1s).Length();
+    const double vnp = ( vnp0 > vnp1 ) ? vnp0 : vnp1;
+    const double vnq = ( vnq0 > vnq1 ) ? vnq0 : vnq1;
+    max_app = vnp+vnq+DIST_CONTACT_EE_CCD;
+  }
+  double r0,r1;
+  const double dist = DistanceEdgeEdge(p0s, p1s, q0s, q1s, r0,r1); // 直線同士の距離(線分同士の距離以下)
+  if( dist > max_app ){ ifilter = FILTER_CCD_DIST; return false; }
+  if( r0 < 0 || r0 > 1 || r1 < 0 || r1 > 1 ){ // 最も近い点は端点のどれか
+    const double dist0 = (GetMinDist_LineSegPoint(p0s, q0s, q1s)-p0s).Length();
+    const double dist1 = (GetMinDist_LineSegPoint(p1s, q0s, q1s)-p1s).Length();
+    const double dist2 = (GetMinDist_LineSegPoint(q0s, p0s, p1s)-q0s).Length();
+    const double dist3 = (GetMinDist_LineSegPoint(q1s, p0s, p1s)-q1s).Length();
+    if( dist0 > max_app && dist1 > max_app && dist2 > max_app && dist3 > max_app ){ ifilter = FILTER_CCD_DIST; return false; }
+  }
+  return true;
+}
+
+// CCDのEEで同一平面になる時刻tに辺同士が接触しているかどうか
+static bool IsContact_EE_CCD_Time
+(double t,
+ const CVector3D& p0s, const CVector3D& p1s, const CVector3D& q0s, const CVector3D& q1s,
+ const CVector3D& p0e, const CVector3D& p1e, const CVector3D& q0e, const CVector3D& q1e)
+{
   if( t < 0 || t > 1 ) return false;
   CVector3D p0m = (1-t)*p0s + t*p0e;
   CVector3D p1m = (1-t)*p1s + t*p1e;
@@ -788,137 +1823,893 @@ bool IsContact_EE_CCD
   double dist = DistanceEdgeEdge(p0m, p1m, q0m, q1m, w0,w1);
   if( w0 < 0 || w0 > 1 ) return false;
   if( w1 < 0 || w1 > 1 ) return false;
-  if( dist > 1.0e-2 ) return false;
+  if( dist > DIST_CONTACT_EE_CCD ) return false;
   return true;
 }
 
+// CCDのEEで接触する要素を検出
+bool IsContact_EE_CCD
+(int ino0,         int ino1,         int jno0,         int jno1,
+ const CVector3D& p0s, const CVector3D& p1s, const CVector3D& q0s, const CVector3D& q1s,
+ const CVector3D& p0e, const CVector3D& p1e, const CVector3D& q0e, const CVector3D& q1e)
+{
+  int ifilter;
+  if( !IsCandidate_EE_CCD(ifilter, ino0,ino1,jno0,jno1, p0s,p1s,q0s,q1s, p0e,p1e,q0e,q1e) ) return false;
+  const double t = FindCoplanerInterp(p0s,p1s,q0s,q1s, p0e,p1e,q0e,q1e);
+  return IsContact_EE_CCD_Time(t, p0s,p1s,q0s,q1s, p0e,p1e,q0e,q1e);
+}
+
 
-// CCDで接触する要素を検出
-void GetContactElement_CCD
-(std::set<CContactElement>& aContactElem,
+/* ------------------------------------------------------------------------------------- */
+// CCDの候補をまとめて判定する
+
+// 三次関数の係数を一つの候補について計算する(FindCoplanerInterpと同じ演算の順番)
+static inline void CoeffCubicCoplaner
+(double& k0, double& k1, double& k2, double& k3,
+ ////
+ const CVector3D s[4], const CVector3D e[4])
+{
+  const CVector3D x1 = s[1]-s[0];
+  const CVector3D x2 = s[2]-s[0];
+  const CVector3D x3 = s[3]-s[0];
+  const CVector3D v1 = e[1]-e[0]-x1;
+  const CVector3D v2 = e[2]-e[0]-x2;
+  const CVector3D v3 = e[3]-e[0]-x3;
+  k0 = ScalarTripleProduct(x3,x1,x2);
+  k1 = ScalarTripleProduct(v3,x1,x2)+ScalarTripleProduct(x3,v1,x2)+ScalarTripleProduct(x3,x1,v2);
+  k2 = ScalarTripleProduct(v3,v1,x2)+ScalarTripleProduct(v3,x1,v2)+ScalarTripleProduct(x3,v1,v2);
+  k3 = ScalarTripleProduct(v3,v1,v2);
+}
+
+// ためた候補を一つずつ判定する(AVX2が使えない時)
+static unsigned long long JudgeBatchContactCCD_Scalar
+(CCounterFilterCCD& counter,
+ const CBatchContactCCD& b)
+{
+  int* aNum = b.is_fv ? counter.aNumFV : counter.aNumEE;
+  unsigned long long flg_hit = 0;
+  for(int i=0;i<b.n;i++){
+    CVector3D s[4], e[4];
+    for(int ip=0;ip<4;ip++){
+      s[ip] = CVector3D(b.aS[ip][0][i],b.aS[ip][1][i],b.aS[ip][2][i]);
+      e[ip] = CVector3D(b.aE[ip][0][i],b.aE[ip][1][i],b.aE[ip][2][i]);
+    }
+    double k0,k1,k2,k3;
+    CoeffCubicCoplaner(k0,k1,k2,k3, s,e);
+    if( IsSignFixedBernstein(k0,k1,k2,k3) ){ aNum[FILTER_CCD_BERNSTEIN]++; continue; }
+    const double t = FindRootCubicCoplaner(k0,k1,k2,k3, TOL_ROOT_CUBIC_CCD);
+    if( t < 0 || t > 1 ){ aNum[FILTER_CCD_ROOT]++; continue; }
+    bool is_hit;
+    if( b.is_fv ){ is_hit = IsContact_FV_CCD_Time(t, s[0],s[1],s[2],s[3], e[0],e[1],e[2],e[3]); }
+    else{          is_hit = IsContact_EE_CCD_Time(t, s[0],s[1],s[2],s[3], e[0],e[1],e[2],e[3]); }
+    aNum[ is_hit ? FILTER_CCD_HIT : FILTER_CCD_MISS ]++;
+    if( is_hit ){ flg_hit |= 1ULL << i; }
+  }
+  return flg_hit;
+}
+
+unsigned long long JudgeBatchContactCCD
+(CCounterFilterCCD& counter,
+ CBatchContactCCD& b)
+{
+  assert( b.n <= CBatchContactCCD::NBATCH );
+  if( GetBatchCCDKernel() == BATCH_CCD_KERNEL_AVX2 ){
+    return JudgeBatchContactCCD_AVX2(counter,b, TOL_ROOT_CUBIC_CCD,DIST_CONTACT_EE_CCD);
+  }
+  return JudgeBatchContactCCD_Scalar(counter,b);
+}
+
+// 候補を加える．s,eは4つの点の始めと終わりの位置
+static inline void AddBatchContactCCD
+(CBatchContactCCD& b,
+ int ino0, int ino1, int ino2, int ino3,
+ const CVector3D& s0, const CVector3D& s1, const CVector3D& s2, const CVector3D& s3,
+ const CVector3D& e0, const CVector3D& e1, const CVector3D& e2, const CVector3D& e3)
+{
+  assert( b.n < CBatchContactCCD::NBATCH );
+  const int i = b.n;
+  b.aIno[i][0] = ino0;  b.aIno[i][1] = ino1;  b.aIno[i][2] = ino2;  b.aIno[i][3] = ino3;
+  const CVector3D* aS[4] = { &s0, &s1, &s2, &s3 };
+  const CVector3D* aE[4] = { &e0, &e1, &e2, &e3 };
+  for(int ip=0;ip<4;ip++){
+    b.aS[ip][0][i] = aS[ip]->x;  b.aS[ip][1][i] = aS[ip]->y;  b.aS[ip][2][i] = aS[ip]->z;
+    b.aE[ip][0][i] = aE[ip]->x;  b.aE[ip][1][i] = aE[ip]->y;  b.aE[ip][2][i] = aE[ip]->z;
+  }
+  b.n++;
+}
+
+// ためた候補をまとめて判定し,接触している要素をaContactElemに加えて空にする
+static void FlushBatchContactCCD
+(std::vector<CContactElement>& aContactElem,
+ CCounterFilterCCD& counter,
+ CBatchContactCCD& b)
+{
+  if( b.n == 0 ) return;
+  const unsigned long long flg_hit = JudgeBatchContactCCD(counter,b);
+  for(int i=0;i<b.n;i++){
+    if( ((flg_hit>>i)&1) == 0 ) continue;
+    aContactElem.push_back( CContactElement(b.is_fv, b.aIno[i][0],b.aIno[i][1],b.aIno[i][2],b.aIno[i][3]) );
+  }
+  b.n = 0;
+}
+
+// 全てのスレッドのバッチに残った候補を判定する．探索の最後に呼ぶ
+static void FlushContactBufferCCD
+(CContactBuffer& buffer)
+{
+  for(int ith=0;ith<buffer.NumThread();ith++){
+    FlushBatchContactCCD(buffer.aaCE[ith],buffer.aCounter[ith],buffer.aBatchFV[ith]);
+    FlushBatchContactCCD(buffer.aaCE[ith],buffer.aCounter[ith],buffer.aBatchEE[ith]);
+  }
+}
+
+// 三角形itriと三角形jtriの間でCCDの候補をbatch_fv,batch_eeにためる．いっぱいになったらaContactElemに判定結果を加える
+// (引数はGetContactElement_Proximity_TriTriと同じ)
+static void GetContactElement_CCD_TriTri
+(std::vector<CContactElement>& aContactElem,
+ CCounterFilterCCD& counter,
+ CBatchContactCCD& batch_fv,
+ CBatchContactCCD& batch_ee,
  ////
  double dt,
- double delta,
  const std::vector<double>& aXYZ,
  const std::vector<double>& aUVW,
  const std::vector<int>& aTri,
+ int itri,
+ int jtri,
+ const CAABB3D& bbi,
+ const CAABB3D& bbj,
+ unsigned int flgi,
+ unsigned int flgj)
+{
+  // 一つの三角形の組の候補はFVが6個,EEが9個まで
+  if( batch_fv.n + 6 > CBatchContactCCD::NBATCH ){ FlushBatchContactCCD(aContactElem,counter,batch_fv); }
+  if( batch_ee.n + 9 > CBatchContactCCD::NBATCH ){ FlushBatchContactCCD(aContactElem,counter,batch_ee); }
+  int ifilter = -1; // 持ち主でない頂点と辺は数えない
+  int in0 = aTri[itri*3+0];
+  int in1 = aTri[itri*3+1];
+  int in2 = aTri[itri*3+2];
+  int jn0 = aTri[jtri*3+0];
+  int jn1 = aTri[jtri*3+1];
+  int jn2 = aTri[jtri*3+2];
+  const CVector3D p0s(aXYZ[in0*3+0],                  aXYZ[in0*3+1],                  aXYZ[in0*3+2]);
+  const CVector3D p1s(aXYZ[in1*3+0],                  aXYZ[in1*3+1],                  aXYZ[in1*3+2]);
+  const CVector3D p2s(aXYZ[in2*3+0],                  aXYZ[in2*3+1],                  aXYZ[in2*3+2]);
+  const CVector3D q0s(aXYZ[jn0*3+0],                  aXYZ[jn0*3+1],                  aXYZ[jn0*3+2]);
+  const CVector3D q1s(aXYZ[jn1*3+0],                  aXYZ[jn1*3+1],                  aXYZ[jn1*3+2]);
+  const CVector3D q2s(aXYZ[jn2*3+0],                  aXYZ[jn2*3+1],                  aXYZ[jn2*3+2]);
+  const CVector3D p0e(aXYZ[in0*3+0]+dt*aUVW[in0*3+0], aXYZ[in0*3+1]+dt*aUVW[in0*3+1], aXYZ[in0*3+2]+dt*aUVW[in0*3+2]);
+  const CVector3D p1e(aXYZ[in1*3+0]+dt*aUVW[in1*3+0], aXYZ[in1*3+1]+dt*aUVW[in1*3+1], aXYZ[in1*3+2]+dt*aUVW[in1*3+2]);
+  const CVector3D p2e(aXYZ[in2*3+0]+dt*aUVW[in2*3+0], aXYZ[in2*3+1]+dt*aUVW[in2*3+1], aXYZ[in2*3+2]+dt*aUVW[in2*3+2]);
+  const CVector3D q0e(aXYZ[jn0*3+0]+dt*aUVW[jn0*3+0], aXYZ[jn0*3+1]+dt*aUVW[jn0*3+1], aXYZ[jn0*3+2]+dt*aUVW[jn0*3+2]);
+  const CVector3D q1e(aXYZ[jn1*3+0]+dt*aUVW[jn1*3+0], aXYZ[jn1*3+1]+dt*aUVW[jn1*3+1], aXYZ[jn1*3+2]+dt*aUVW[jn1*3+2]);
+  const CVector3D q2e(aXYZ[jn2*3+0]+dt*aUVW[jn2*3+0], aXYZ[jn2*3+1]+dt*aUVW[jn2*3+1], aXYZ[jn2*3+2]+dt*aUVW[jn2*3+2]);
+  
+  if( (flgj&0x01) && IsCandidate_FV_CCD(ifilter, in0,in1,in2,jn0, p0s,p1s,p2s,q0s, p0e,p1e,p2e,q0e, bbi) ){
+    AddBatchContactCCD(batch_fv, in0,in1,in2,jn0, p0s,p1s,p2s,q0s, p0e,p1e,p2e,q0e);
+  }
+  else if( ifilter >= 0 ){ counter.aNumFV[ifilter]++;  ifilter = -1; }
+  if( (flgj&0x02) && IsCandidate_FV_CCD(ifilter, in0,in1,in2,jn1, p0s,p1s,p2s,q1s, p0e,p1e,p2e,q1e, bbi) ){
+    AddBatchContactCCD(batch_fv, in0,in1,in2,jn1, p0s,p1s,p2s,q1s, p0e,p1e,p2e,q1e);
+  }
+  else if( ifilter >= 0 ){ counter.aNumFV[ifilter]++;  ifilter = -1; }
+  if( (flgj&0x04) && IsCandidate_FV_CCD(ifilter, in0,in1,in2,jn2, p0s,p1s,p2s,q2s, p0e,p1e,p2e,q2e, bbi) ){
+    AddBatchContactCCD(batch_fv, in0,in1,in2,jn2, p0s,p1s,p2s,q2s, p0e,p1e,p2e,q2e);
+  }
+  else if( ifilter >= 0 ){ counter.aNumFV[ifilter]++;  ifilter = -1; }
+  if( (flgi&0x01) && IsCandidate_FV_CCD(ifilter, jn0,jn1,jn2,in0, q0s,q1s,q2s,p0s, q0e,q1e,q2e,p0e, bbj) ){
+    AddBatchContactCCD(batch_fv, jn0,jn1,jn2,in0, q0s,q1s,q2s,p0s, q0e,q1e,q2e,p0e);
+  }
+  else if( ifilter >= 0 ){ counter.aNumFV[ifilter]++;  ifilter = -1; }
+  if( (flgi&0x02) && IsCandidate_FV_CCD(ifilter, jn0,jn1,jn2,in1, q0s,q1s,q2s,p1s, q0e,q1e,q2e,p1e, bbj) ){
+    AddBatchContactCCD(batch_fv, jn0,jn1,jn2,in1, q0s,q1s,q2s,p1s, q0e,q1e,q2e,p1e);
+  }
+  else if( ifilter >= 0 ){ counter.aNumFV[ifilter]++;  ifilter = -1; }
+  if( (flgi&0x04) && IsCandidate_FV_CCD(ifilter, jn0,jn1,jn2,in2, q0s,q1s,q2s,p2s, q0e,q1e,q2e,p2e, bbj) ){
+    AddBatchContactCCD(batch_fv, jn0,jn1,jn2,in2, q0s,q1s,q2s,p2s, q0e,q1e,q2e,p2e);
+  }
+  else if( ifilter >= 0 ){ counter.aNumFV[ifilter]++;  ifilter = -1; }
+  ////
+  if( (flgi&0x08) && (flgj&0x08) && IsCandidate_EE_CCD(ifilter, in0,in1,jn0,jn1, p0s,p1s,q0s,q1s, p0e,p1e,q0e,q1e) ){
+    AddBatchContactCCD(batch_ee, in0,in1,jn0,jn1, p0s,p1s,q0s,q1s, p0e,p1e,q0e,q1e);
+  }
+  else if( ifilter >= 0 ){ counter.aNumEE[ifilter]++;  ifilter = -1; }
+  if( (flgi&0x08) && (flgj&0x10) && IsCandidate_EE_CCD(ifilter, in0,in1,jn1,jn2, p0s,p1s,q1s,q2s, p0e,p1e,q1e,q2e) ){
+    AddBatchContactCCD(batch_ee, in0,in1,jn1,jn2, p0s,p1s,q1s,q2s, p0e,p1e,q1e,q2e);
+  }
+  else if( ifilter >= 0 ){ counter.aNumEE[ifilter]++;  ifilter = -1; }
+  if( (flgi&0x08) && (flgj&0x20) && IsCandidate_EE_CCD(ifilter, in0,in1,jn2,jn0, p0s,p1s,q2s,q0s, p0e,p1e,q2e,q0e) ){
+    AddBatchContactCCD(batch_ee, in0,in1,jn2,jn0, p0s,p1s,q2s,q0s, p0e,p1e,q2e,q0e);
+  }
+  else if( ifilter >= 0 ){ counter.aNumEE[ifilter]++;  ifilter = -1; }
+  if( (flgi&0x10) && (flgj&0x08) && IsCandidate_EE_CCD(ifilter, in1,in2,jn0,jn1, p1s,p2s,q0s,q1s, p1e,p2e,q0e,q1e) ){
+    AddBatchContactCCD(batch_ee, in1,in2,jn0,jn1, p1s,p2s,q0s,q1s, p1e,p2e,q0e,q1e);
+  }
+  else if( ifilter >= 0 ){ counter.aNumEE[ifilter]++;  ifilter = -1; }
+  if( (flgi&0x10) && (flgj&0x10) && IsCandidate_EE_CCD(ifilter, in1,in2,jn1,jn2, p1s,p2s,q1s,q2s, p1e,p2e,q1e,q2e) ){
+    AddBatchContactCCD(batch_ee, in1,in2,jn1,jn2, p1s,p2s,q1s,q2s, p1e,p2e,q1e,q2e);
+  }
+  else if( ifilter >= 0 ){ counter.aNumEE[ifilter]++;  ifilter = -1; }
+  if( (flgi&0x10) && (flgj&0x20) && IsCandidate_EE_CCD(ifilter, in1,in2,jn2,jn0, p1s,p2s,q2s,q0s, p1e,p2e,q2e,q0e) ){
+    AddBatchContactCCD(batch_ee, in1,in2,jn2,jn0, p1s,p2s,q2s,q0s, p1e,p2e,q2e,q0e);
+  }
+  else if( ifilter >= 0 ){ counter.aNumEE[ifilter]++;  ifilter = -1; }
+  if( (flgi&0x20) && (flgj&0x08) && IsCandidate_EE_CCD(ifilter, in2,in0,jn0,jn1, p2s,p0s,q0s,q1s, p2e,p0e,q0e,q1e) ){
+    AddBatchContactCCD(batch_ee, in2,in0,jn0,jn1, p2s,p0s,q0s,q1s, p2e,p0e,q0e,q1e);
+  }
+  else if( ifilter >= 0 ){ counter.aNumEE[ifilter]++;  ifilter = -1; }
+  if( (flgi&0x20) && (flgj&0x10) && IsCandidate_EE_CCD(ifilter, in2,in0,jn1,jn2, p2s,p0s,q1s,q2s, p2e,p0e,q1e,q2e) ){
+    AddBatchContactCCD(batch_ee, in2,in0,jn1,jn2, p2s,p0s,q1s,q2s, p2e,p0e,q1e,q2e);
+  }
+  else if( ifilter >= 0 ){ counter.aNumEE[ifilter]++;  ifilter = -1; }
+  if( (flgi&0x20) && (flgj&0x20) && IsCandidate_EE_CCD(ifilter, in2,in0,jn2,jn0, p2s,p0s,q2s,q0s, p2e,p0e,q2e,q0e) ){
+    AddBatchContactCCD(batch_ee, in2,in0,jn2,jn0, p2s,p0s,q2s,q0s, p2e,p0e,q2e,q0e);
+  }
+  else if( ifilter >= 0 ){ counter.aNumEE[ifilter]++;  ifilter = -1; }
+}
+
+/* ------------------------------------------------------------------------------------- */
+
+// 探索の入力をまとめたもの．並列探索のタスクにはこのポインタとノードの番号だけを渡す
+class CQueryContactBVH
+{
+public:
+  bool is_ccd;
+  double dt;
+  double delta;
+  const std::vector<double>* pXYZ;
+  const std::vector<double>* pUVW;
+  const std::vector<int>* pTri;
+  const std::vector<unsigned char>* pFlgOwn;
+  const std::vector<CNodeBVH>* pBVH;
+  const std::vector<CAABB3D>* pBB;
+  const std::vector<CAABBChildBVH>* pBBC;
+  const CNormalConeBVH* pCone; // 0なら法線のコーンで判定を省略しない
+  const std::vector<unsigned char>* pIsDirty; // 0でなければ印のついたノードを含む組だけを探索する(CDirtyBVHを参照)
+  CContactBuffer* pBuffer;
+};
+
+// 二つの葉ノードの三角形の全ての組で接触する要素を抽出
+static void GetContactElement_LeafLeaf
+(std::vector<CContactElement>& aCE,
+ const CQueryContactBVH& q,
+ int ibvh0,
+ int ibvh1)
+{
+  const std::vector<double>& aXYZ = *q.pXYZ;
+  const std::vector<int>& aTri = *q.pTri;
+  const std::vector<unsigned char>& aFlg = *q.pFlgOwn;
+  const int itri0 = (*q.pBVH)[ibvh0].ichild[0],  ntri0 = -(*q.pBVH)[ibvh0].ichild[1];
+  const int jtri0 = (*q.pBVH)[ibvh1].ichild[0],  ntri1 = -(*q.pBVH)[ibvh1].ichild[1];
+  assert( ntri0 <= NTRI_BVH_LEAF_MAX && ntri1 <= NTRI_BVH_LEAF_MAX );
+  CAABB3D aBBTri0[NTRI_BVH_LEAF_MAX], aBBTri1[NTRI_BVH_LEAF_MAX];
+  if( !q.is_ccd ){
+    for(int i=0;i<ntri0;i++){ SetBoundingBoxLeaf_Prx(aBBTri0[i], itri0+i,1, q.delta, aXYZ,aTri); }
+    for(int i=0;i<ntri1;i++){ SetBoundingBoxLeaf_Prx(aBBTri1[i], jtri0+i,1, q.delta, aXYZ,aTri); }
+    for(int i=0;i<ntri0;i++){
+      for(int j=0;j<ntri1;j++){
+        GetContactElement_Proximity_TriTri(aCE, q.delta,aXYZ,aTri, itri0+i,jtri0+j, aBBTri0[i],aBBTri1[j], aFlg[itri0+i],aFlg[jtri0+j]);
+      }
+    }
+  }
+  else{
+    const std::vector<double>& aUVW = *q.pUVW;
+    CCounterFilterCCD& counter = q.pBuffer->LocalCounter();
+    CBatchContactCCD& batch_fv = q.pBuffer->LocalBatch(true); // 探索の間ずっと使い,いっぱいになった時と探索の最後に判定する
+    CBatchContactCCD& batch_ee = q.pBuffer->LocalBatch(false);
+    for(int i=0;i<ntri0;i++){ SetBoundingBoxLeaf_CCD(aBBTri0[i], itri0+i,1, q.dt, aXYZ,aUVW,aTri); }
+    for(int i=0;i<ntri1;i++){ SetBoundingBoxLeaf_CCD(aBBTri1[i], jtri0+i,1, q.dt, aXYZ,aUVW,aTri); }
+    for(int i=0;i<ntri0;i++){
+      for(int j=0;j<ntri1;j++){
+        GetContactElement_CCD_TriTri(aCE,counter,batch_fv,batch_ee, q.dt, aXYZ,aUVW,aTri, itri0+i,jtri0+j, aBBTri0[i],aBBTri1[j], aFlg[itri0+i],aFlg[jtri0+j]);
+      }
+    }
+  }
+}
+
+// 葉ノードの中の三角形同士で接触する要素を抽出
+static void GetContactElement_LeafSelf
+(std::vector<CContactElement>& aCE,
+ const CQueryContactBVH& q,
+ int ibvh)
+{
+  const std::vector<double>& aXYZ = *q.pXYZ;
+  const std::vector<int>& aTri = *q.pTri;
+  const std::vector<unsigned char>& aFlg = *q.pFlgOwn;
+  const int itri0 = (*q.pBVH)[ibvh].ichild[0],  ntri = -(*q.pBVH)[ibvh].ichild[1];
+  if( ntri == 1 ) return;
+  assert( ntri <= NTRI_BVH_LEAF_MAX );
+  CAABB3D aBBTri[NTRI_BVH_LEAF_MAX];
+  if( !q.is_ccd ){
+    for(int i=0;i<ntri;i++){ SetBoundingBoxLeaf_Prx(aBBTri[i], itri0+i,1, q.delta, aXYZ,aTri); }
+    for(int i=0;i<ntri;i++){
+      for(int j=i+1;j<ntri;j++){
+        GetContactElement_Proximity_TriTri(aCE, q.delta,aXYZ,aTri, itri0+i,itri0+j, aBBTri[i],aBBTri[j], aFlg[itri0+i],aFlg[itri0+j]);
+      }
+    }
+  }
+  else{
+    const std::vector<double>& aUVW = *q.pUVW;
+    CCounterFilterCCD& counter = q.pBuffer->LocalCounter();
+    CBatchContactCCD& batch_fv = q.pBuffer->LocalBatch(true);
+    CBatchContactCCD& batch_ee = q.pBuffer->LocalBatch(false);
+    for(int i=0;i<ntri;i++){ SetBoundingBoxLeaf_CCD(aBBTri[i], itri0+i,1, q.dt, aXYZ,aUVW,aTri); }
+    for(int i=0;i<ntri;i++){
+      for(int j=i+1;j<ntri;j++){
+        GetContactElement_CCD_TriTri(aCE,counter,batch_fv,batch_ee, q.dt, aXYZ,aUVW,aTri, itri0+i,itri0+j, aBBTri[i],aBBTri[j], aFlg[itri0+i],aFlg[itri0+j]);
+      }
+    }
+  }
+}
+
+// BVTTのノード(ibvh0,ibvh1)の子のうち,箱が交差している組をaPairに入れてその数を返す
+// 交差していない組はaCullに入れる(数はncull)
+// ibvh0==ibvh1の時はノードの中の自己接触．葉まで達して分割できない時は-1を返す
+static inline int MakeChildPairBVTT
+(int aPair[4][2],
+ int aCull[4][2],
+ int& ncull,
  int ibvh0,
  int ibvh1,
- const std::vector<CNodeBVH>& aBVH,
- const std::vector<CAABB3D>& aBB)
+ const CQueryContactBVH& q)
 {
-  assert( ibvh0 < aBB.size() );
-  assert( ibvh1 < aBB.size() );
-  if( !aBB[ibvh0].IsIntersect(aBB[ibvh1]) ) return;
+  const std::vector<CNodeBVH>& aBVH = *q.pBVH;
+  const std::vector<CAABB3D>& aBB = *q.pBB;
+  const std::vector<CAABBChildBVH>& aBBC = *q.pBBC;
   const int ichild0_0 = aBVH[ibvh0].ichild[0];
   const int ichild0_1 = aBVH[ibvh0].ichild[1];
   const int ichild1_0 = aBVH[ibvh1].ichild[0];
   const int ichild1_1 = aBVH[ibvh1].ichild[1];
-  const bool is_leaf0 = (ichild0_1 == -1);
-  const bool is_leaf1 = (ichild1_1 == -1);
-  if(      !is_leaf0 && !is_leaf1 ){
-    GetContactElement_CCD(aContactElem, dt,delta, aXYZ,aUVW,aTri, ichild0_0,ichild1_0, aBVH,aBB);
-    GetContactElement_CCD(aContactElem, dt,delta, aXYZ,aUVW,aTri, ichild0_1,ichild1_0, aBVH,aBB);
-    GetContactElement_CCD(aContactElem, dt,delta, aXYZ,aUVW,aTri, ichild0_0,ichild1_1, aBVH,aBB);
-    GetContactElement_CCD(aContactElem, dt,delta, aXYZ,aUVW,aTri, ichild0_1,ichild1_1, aBVH,aBB);
+  const bool is_leaf0 = (ichild0_1 < 0);
+  const bool is_leaf1 = (ichild1_1 < 0);
+  int npair = 0;
+  ncull = 0;
+  if( ibvh0 == ibvh1 ){ // 自己接触
+    if( is_leaf0 ) return -1;
+    if( IsIntersectChild(aBB[ichild0_0],aBBC[ibvh0]) & 2 ){
+      aPair[npair][0] = ichild0_0;  aPair[npair][1] = ichild0_1;  npair++;
+    }
+    else{
+      aCull[ncull][0] = ichild0_0;  aCull[ncull][1] = ichild0_1;  ncull++;
+    }
+    aPair[npair][0] = ichild0_0;  aPair[npair][1] = ichild0_0;  npair++;
+    aPair[npair][0] = ichild0_1;  aPair[npair][1] = ichild0_1;  npair++;
+  }
+  else if( !is_leaf0 && !is_leaf1 ){ // 子ノード一つと相手の二つの子ノードを一度に判定する
+    const int imask0 = IsIntersectChild(aBB[ichild0_0],aBBC[ibvh1]);
+    const int imask1 = IsIntersectChild(aBB[ichild0_1],aBBC[ibvh1]);
+    if( imask0 & 1 ){ aPair[npair][0] = ichild0_0;  aPair[npair][1] = ichild1_0;  npair++; }
+    else{ aCull[ncull][0] = ichild0_0;  aCull[ncull][1] = ichild1_0;  ncull++; }
+    if( imask1 & 1 ){ aPair[npair][0] = ichild0_1;  aPair[npair][1] = ichild1_0;  npair++; }
+    else{ aCull[ncull][0] = ichild0_1;  aCull[ncull][1] = ichild1_0;  ncull++; }
+    if( imask0 & 2 ){ aPair[npair][0] = ichild0_0;  aPair[npair][1] = ichild1_1;  npair++; }
+    else{ aCull[ncull][0] = ichild0_0;  aCull[ncull][1] = ichild1_1;  ncull++; }
+    if( imask1 & 2 ){ aPair[npair][0] = ichild0_1;  aPair[npair][1] = ichild1_1;  npair++; }
+    else{ aCull[ncull][0] = ichild0_1;  aCull[ncull][1] = ichild1_1;  ncull++; }
   }
   else if( !is_leaf0 &&  is_leaf1 ){
-    GetContactElement_CCD(aContactElem, dt,delta, aXYZ,aUVW,aTri, ichild0_0,ibvh1,     aBVH,aBB);
-    GetContactElement_CCD(aContactElem, dt,delta, aXYZ,aUVW,aTri, ichild0_1,ibvh1,     aBVH,aBB);
+    const int imask = IsIntersectChild(aBB[ibvh1],aBBC[ibvh0]);
+    if( imask & 1 ){ aPair[npair][0] = ichild0_0;  aPair[npair][1] = ibvh1;  npair++; }
+    else{ aCull[ncull][0] = ichild0_0;  aCull[ncull][1] = ibvh1;  ncull++; }
+    if( imask & 2 ){ aPair[npair][0] = ichild0_1;  aPair[npair][1] = ibvh1;  npair++; }
+    else{ aCull[ncull][0] = ichild0_1;  aCull[ncull][1] = ibvh1;  ncull++; }
   }
   else if(  is_leaf0 && !is_leaf1 ){
-    GetContactElement_CCD(aContactElem, dt,delta, aXYZ,aUVW,aTri, ibvh0,    ichild1_0, aBVH,aBB);
-    GetContactElement_CCD(aContactElem, dt,delta, aXYZ,aUVW,aTri, ibvh0,    ichild1_1, aBVH,aBB);
-  }
-  else if(  is_leaf0 &&  is_leaf1 ){
-    const int itri = ichild0_0;
-    const int jtri = ichild1_0;
-    int in0 = aTri[itri*3+0];
-    int in1 = aTri[itri*3+1];
-    int in2 = aTri[itri*3+2];
-    int jn0 = aTri[jtri*3+0];
-    int jn1 = aTri[jtri*3+1];
-    int jn2 = aTri[jtri*3+2];
-    const CVector3D p0s(aXYZ[in0*3+0],                  aXYZ[in0*3+1],                  aXYZ[in0*3+2]);
-    const CVector3D p1s(aXYZ[in1*3+0],                  aXYZ[in1*3+1],                  aXYZ[in1*3+2]);
-    const CVector3D p2s(aXYZ[in2*3+0],                  aXYZ[in2*3+1],                  aXYZ[in2*3+2]);
-    const CVector3D q0s(aXYZ[jn0*3+0],                  aXYZ[jn0*3+1],                  aXYZ[jn0*3+2]);
-    const CVector3D q1s(aXYZ[jn1*3+0],                  aXYZ[jn1*3+1],                  aXYZ[jn1*3+2]);
-    const CVector3D q2s(aXYZ[jn2*3+0],                  aXYZ[jn2*3+1],                  aXYZ[jn2*3+2]);
-    const CVector3D p0e(aXYZ[in0*3+0]+dt*aUVW[in0*3+0], aXYZ[in0*3+1]+dt*aUVW[in0*3+1], aXYZ[in0*3+2]+dt*aUVW[in0*3+2]);
-    const CVector3D p1e(aXYZ[in1*3+0]+dt*aUVW[in1*3+0], aXYZ[in1*3+1]+dt*aUVW[in1*3+1], aXYZ[in1*3+2]+dt*aUVW[in1*3+2]);
-    const CVector3D p2e(aXYZ[in2*3+0]+dt*aUVW[in2*3+0], aXYZ[in2*3+1]+dt*aUVW[in2*3+1], aXYZ[in2*3+2]+dt*aUVW[in2*3+2]);
-    const CVector3D q0e(aXYZ[jn0*3+0]+dt*aUVW[jn0*3+0], aXYZ[jn0*3+1]+dt*aUVW[jn0*3+1], aXYZ[jn0*3+2]+dt*aUVW[jn0*3+2]);
-    const CVector3D q1e(aXYZ[jn1*3+0]+dt*aUVW[jn1*3+0], aXYZ[jn1*3+1]+dt*aUVW[jn1*3+1], aXYZ[jn1*3+2]+dt*aUVW[jn1*3+2]);
-    const CVector3D q2e(aXYZ[jn2*3+0]+dt*aUVW[jn2*3+0], aXYZ[jn2*3+1]+dt*aUVW[jn2*3+1], aXYZ[jn2*3+2]+dt*aUVW[jn2*3+2]);
-    
-    if( IsContact_FV_CCD(      in0,in1,in2,jn0, p0s,p1s,p2s,q0s, p0e,p1e,p2e,q0e, aBB[ibvh0]) ){
-      aContactElem.insert( CContactElement(true, in0,in1,in2,jn0) );
-    }
-    if( IsContact_FV_CCD(      in0,in1,in2,jn1, p0s,p1s,p2s,q1s, p0e,p1e,p2e,q1e, aBB[ibvh0]) ){
-      aContactElem.insert( CContactElement(true, in0,in1,in2,jn1) );
-    }
-    if( IsContact_FV_CCD(      in0,in1,in2,jn2, p0s,p1s,p2s,q2s, p0e,p1e,p2e,q2e, aBB[ibvh0]) ){
-      aContactElem.insert( CContactElement(true, in0,in1,in2,jn2) );
-    }
-    if( IsContact_FV_CCD(      jn0,jn1,jn2,in0, q0s,q1s,q2s,p0s, q0e,q1e,q2e,p0e, aBB[ibvh1]) ){
-      aContactElem.insert( CContactElement(true, jn0,jn1,jn2,in0) );
-    }
-    if( IsContact_FV_CCD(      jn0,jn1,jn2,in1, q0s,q1s,q2s,p1s, q0e,q1e,q2e,p1e, aBB[ibvh1]) ){
-      aContactElem.insert( CContactElement(true, jn0,jn1,jn2,in1) );
-    }
-    if( IsContact_FV_CCD(      jn0,jn1,jn2,in2, q0s,q1s,q2s,p2s, q0e,q1e,q2e,p2e, aBB[ibvh1]) ){
-      aContactElem.insert( CContactElement(true, jn0,jn1,jn2,in2) );
-    }
-    ////
-    if( IsContact_EE_CCD(          in0,in1,jn0,jn1, p0s,p1s,q0s,q1s,  p0e,p1e,q0e,q1e) ){
-      aContactElem.insert( CContactElement(false,  in0,in1,jn0,jn1) );
+    const int imask = IsIntersectChild(aBB[ibvh0],aBBC[ibvh1]);
+    if( imask & 1 ){ aPair[npair][0] = ibvh0;  aPair[npair][1] = ichild1_0;  npair++; }
+    else{ aCull[ncull][0] = ibvh0;  aCull[ncull][1] = ichild1_0;  ncull++; }
+    if( imask & 2 ){ aPair[npair][0] = ibvh0;  aPair[npair][1] = ichild1_1;  npair++; }
+    else{ aCull[ncull][0] = ibvh0;  aCull[ncull][1] = ichild1_1;  ncull++; }
+  }
+  else{ // 葉同士
+    return -1;
+  }
+  return npair;
+}
+
+// ノードの中の自己接触の判定を省略できるかどうか
+static inline bool IsSelfContactFree
+(int ibvh,
+ const CQueryContactBVH& q)
+{
+  if( q.pCone == 0 ) return false;
+  return q.pCone->IsSelfContactFree(ibvh, q.dt,q.delta, *q.pXYZ, (q.is_ccd ? q.pUVW : 0) );
+}
+
+// BVTTのノードの組がどちらも印のないノードなら真
+static inline bool IsCleanPairBVTT
+(int ibvh0, int ibvh1,
+ const CQueryContactBVH& q)
+{
+  if( q.pIsDirty == 0 ) return false;
+  return (*q.pIsDirty)[ibvh0] == 0 && (*q.pIsDirty)[ibvh1] == 0;
+}
+
+// スタックの大きさ．BVTTを深さ優先で辿るので木の深さの3倍程度あれば足りる
+static const int NSTACK_BVTT = 192;
+
+// BVTTのノード(ibvh0,ibvh1)の下で接触する要素を明示的なスタックを使って抽出する(再帰呼び出しをしない)
+// ibvh0==ibvh1の時はノードの中の自己接触．ibvh0とibvh1の箱は交差していること
+// paFrontが0でなければ,探索を止めたBVTTのノード(箱が交差しない組と葉の組)をその後ろに加える
+static void GetContactElement_Stack
+(std::vector<CContactElement>& aCE,
+ std::vector< std::pair<int,int> >* paFront,
+ const CQueryContactBVH& q,
+ int ibvh0,
+ int ibvh1)
+{
+  int aStack[NSTACK_BVTT][2];
+  int nstack = 0;
+  aStack[nstack][0] = ibvh0;  aStack[nstack][1] = ibvh1;  nstack++;
+  while( nstack > 0 ){
+    nstack--;
+    const int jbvh0 = aStack[nstack][0];
+    const int jbvh1 = aStack[nstack][1];
+    if( IsCleanPairBVTT(jbvh0,jbvh1,q) ){ // 前回から変わらないので探索しない
+      if( paFront != 0 ){ paFront->push_back( std::make_pair(jbvh0,jbvh1) ); }
+      continue;
     }
-    if( IsContact_EE_CCD(          in0,in1,jn1,jn2, p0s,p1s,q1s,q2s,  p0e,p1e,q1e,q2e) ){
-      aContactElem.insert( CContactElement(false,  in0,in1,jn1,jn2) );
+    if( jbvh0 == jbvh1 && IsSelfContactFree(jbvh0,q) ){ // 平らな部分なので探索しない
+      if( paFront != 0 ){ paFront->push_back( std::make_pair(jbvh0,jbvh1) ); }
+      continue;
     }
-    if( IsContact_EE_CCD(          in0,in1,jn2,jn0, p0s,p1s,q2s,q0s,  p0e,p1e,q2e,q0e) ){
-      aContactElem.insert( CContactElement(false,  in0,in1,jn2,jn0) );
+    int aPair[4][2], aCull[4][2], ncull;
+    const int npair = MakeChildPairBVTT(aPair,aCull,ncull,jbvh0,jbvh1,q);
+    if( npair == -1 ){
+      if( jbvh0 == jbvh1 ){ GetContactElement_LeafSelf(aCE,q,jbvh0); }
+      else{                 GetContactElement_LeafLeaf(aCE,q,jbvh0,jbvh1); }
+      if( paFront != 0 ){ paFront->push_back( std::make_pair(jbvh0,jbvh1) ); }
+      continue;
     }
-    if( IsContact_EE_CCD(          in1,in2,jn0,jn1, p1s,p2s,q0s,q1s,  p1e,p2e,q0e,q1e) ){
-      aContactElem.insert( CContactElement(false,  in1,in2,jn0,jn1) );
+    if( paFront != 0 ){
+      for(int icull=0;icull<ncull;icull++){ paFront->push_back( std::make_pair(aCull[icull][0],aCull[icull][1]) ); }
     }
-    if( IsContact_EE_CCD(          in1,in2,jn1,jn2, p1s,p2s,q1s,q2s,  p1e,p2e,q1e,q2e) ){
-      aContactElem.insert( CContactElement(false,  in1,in2,jn1,jn2) );
+    for(int ipair=npair-1;ipair>=0;ipair--){ // 最初の組が先に取り出されるように逆順に積む
+      if( nstack == NSTACK_BVTT ){ // スタックが溢れる極端に深い木では別のスタックで探索する
+        GetContactElement_Stack(aCE,paFront,q,aPair[ipair][0],aPair[ipair][1]);
+        continue;
+      }
+      aStack[nstack][0] = aPair[ipair][0];
+      aStack[nstack][1] = aPair[ipair][1];
+      nstack++;
     }
-    if( IsContact_EE_CCD(          in1,in2,jn2,jn0, p1s,p2s,q2s,q0s,  p1e,p2e,q2e,q0e) ){
-      aContactElem.insert( CContactElement(false,  in1,in2,jn2,jn0) );
+  }
+}
+
+// BVTTのこの深さより下は一つのタスクの中で逐次的に探索する
+static const int NDEPTH_TASK_BVTT = 8;
+
+// BVTTのノード(ibvh0,ibvh1)の下で接触する要素を抽出する．ibvh0==ibvh1の時はノードの中の自己接触
+// 浅い階層では子ノードの組をタスクとして生成し,空いているスレッドに実行させる
+static void GetContactElement_Task
+(const CQueryContactBVH* pq,
+ int ibvh0,
+ int ibvh1,
+ int idepth)
+{
+  if( idepth >= NDEPTH_TASK_BVTT ){ // 逐次探索．出力は実行しているスレッドの配列
+    GetContactElement_Stack(pq->pBuffer->Local(),0,*pq,ibvh0,ibvh1);
+    return;
+  }
+  if( ibvh0 == ibvh1 && IsSelfContactFree(ibvh0,*pq) ) return;
+  int aPair[4][2], aCull[4][2], ncull; // 探索する子ノードの組
+  const int npair = MakeChildPairBVTT(aPair,aCull,ncull,ibvh0,ibvh1,*pq);
+  if( npair == -1 ){ // 葉は分割しない
+    GetContactElement_Task(pq,ibvh0,ibvh1,NDEPTH_TASK_BVTT);
+    return;
+  }
+  if( npair == 0 ) return;
+  for(int ipair=0;ipair<npair-1;ipair++){
+    const int jbvh0 = aPair[ipair][0];
+    const int jbvh1 = aPair[ipair][1];
+#pragma omp task firstprivate(pq,jbvh0,jbvh1,idepth)
+    GetContactElement_Task(pq,jbvh0,jbvh1,idepth+1);
+  }
+  // 最後の組はこのスレッドで続けて探索する
+  GetContactElement_Task(pq,aPair[npair-1][0],aPair[npair-1][1],idepth+1);
+}
+
+// バッファのスレッド数で並列に探索する
+static void GetContactElement_Parallel
+(const CQueryContactBVH& q,
+ int ibvh)
+{
+  const int nthread = q.pBuffer->NumThread();
+#ifdef _OPENMP
+  if( nthread > 1 ){
+#pragma omp parallel num_threads(nthread)
+    {
+#pragma omp single
+      GetContactElement_Task(&q,ibvh,ibvh,0);
+    } // タスクは全てここで完了する
+    if( q.is_ccd ){ FlushContactBufferCCD(*q.pBuffer); } // バッチに残った候補を判定する
+    return;
+  }
+#endif
+  GetContactElement_Task(&q,ibvh,ibvh,NDEPTH_TASK_BVTT);
+  if( q.is_ccd ){ FlushContactBufferCCD(*q.pBuffer); }
+}
+
+void GetContactElement_Proximity
+(CContactBuffer& buffer,
+ ////
+ double delta,
+ const std::vector<double>& aXYZ,
+ const std::vector<int>& aTri,
+ int ibvh,
+ const std::vector<CNodeBVH>& aBVH,
+ const std::vector<CAABB3D>& aBB,
+ const std::vector<CAABBChildBVH>& aBBC)
+{
+  std::vector<unsigned char> aFlgOwn; // フロントを使わない探索は頻繁には呼ばれないので毎回作る
+  MakeFeatureOwnerTri(aFlgOwn,aTri);
+  CQueryContactBVH q;
+  q.is_ccd = false;
+  q.dt = 0;
+  q.delta = delta;
+  q.pXYZ = &aXYZ;
+  q.pUVW = 0;
+  q.pTri = &aTri;
+  q.pFlgOwn = &aFlgOwn;
+  q.pBVH = &aBVH;
+  q.pBB = &aBB;
+  q.pBBC = &aBBC;
+  q.pCone = 0;
+  q.pIsDirty = 0;
+  q.pBuffer = &buffer;
+  GetContactElement_Parallel(q,ibvh);
+}
+
+void GetContactElement_CCD
+(CContactBuffer& buffer,
+ ////
+ double dt,
+ double delta,
+ const std::vector<double>& aXYZ,
+ const std::vector<double>& aUVW,
+ const std::vector<int>& aTri,
+ int ibvh,
+ const std::vector<CNodeBVH>& aBVH,
+ const std::vector<CAABB3D>& aBB,
+ const std::vector<CAABBChildBVH>& aBBC)
+{
+  std::vector<unsigned char> aFlgOwn; // フロントを使わない探索は頻繁には呼ばれないので毎回作る
+  MakeFeatureOwnerTri(aFlgOwn,aTri);
+  CQueryContactBVH q;
+  q.is_ccd = true;
+  q.dt = dt;
+  q.delta = delta;
+  q.pXYZ = &aXYZ;
+  q.pUVW = &aUVW;
+  q.pTri = &aTri;
+  q.pFlgOwn = &aFlgOwn;
+  q.pBVH = &aBVH;
+  q.pBB = &aBB;
+  q.pBBC = &aBBC;
+  q.pCone = 0;
+  q.pIsDirty = 0;
+  q.pBuffer = &buffer;
+  GetContactElement_Parallel(q,ibvh);
+}
+
+/* ------------------------------------------------------------------------------------- */
+// BVTTのフロント
+
+void CFrontBVTT::Clear()
+{
+  aFront.clear();
+  aDepth.clear();
+}
+
+// BVTTのノード(ibvh0,ibvh1)の親ノード(自己接触のノードなら偽を返す)
+// 両方が内部ノードなら同時に分割し,片方が葉ならもう片方だけを分割するので,深さを比べると親が分かる
+static inline bool GetParentBVTT
+(int& jbvh0, int& jbvh1,
+ int ibvh0, int ibvh1,
+ const std::vector<CNodeBVH>& aBVH,
+ const std::vector<int>& aDepth)
+{
+  const int idepth0 = aDepth[ibvh0];
+  const int idepth1 = aDepth[ibvh1];
+  jbvh0 = ( idepth0 >= idepth1 ) ? aBVH[ibvh0].iroot : ibvh0;
+  jbvh1 = ( idepth1 >= idepth0 ) ? aBVH[ibvh1].iroot : ibvh1;
+  return jbvh0 != jbvh1;
+}
+
+// フロントのノードから探索を再開する
+// 交差するノードからは下に向かって探索し,交差しないノードは交差しない最も上の祖先までフロントを持ち上げる
+static void GetContactElement_Front
+(CFrontBVTT& front,
+ const CQueryContactBVH& q,
+ int ibvh)
+{
+  const std::vector<CNodeBVH>& aBVH = *q.pBVH;
+  const std::vector<CAABB3D>& aBB = *q.pBB;
+  if( front.aDepth.size() != aBVH.size() ){ // トポロジーが新しくなったので根から探索する
+    front.aDepth.assign(aBVH.size(),0);
+    std::vector<int> stack(1,ibvh);
+    while( !stack.empty() ){
+      const int jbvh = stack.back();  stack.pop_back();
+      if( aBVH[jbvh].ichild[1] < 0 ) continue;
+      for(int ich=0;ich<2;ich++){
+        const int kbvh = aBVH[jbvh].ichild[ich];
+        front.aDepth[kbvh] = front.aDepth[jbvh]+1;
+        stack.push_back(kbvh);
+      }
     }
-    if( IsContact_EE_CCD(          in2,in0,jn0,jn1, p2s,p0s,q0s,q1s,  p2e,p0e,q0e,q1e) ){
-      aContactElem.insert( CContactElement(false,  in2,in0,jn0,jn1) );
+    front.aFront.assign(1, std::make_pair(ibvh,ibvh) );
+  }
+  // 一部だけ探索し直す時は,印のないノードの組をそのまま残して印のついた組だけを探索する
+  std::vector< std::pair<int,int> >& aFrontKeep = front.aFrontKeep; // そのまま残す組(整列済み)
+  std::vector<int>& aIndFront = front.aIndFront; // 探索するフロントの組の番号
+  aFrontKeep.clear();
+  aIndFront.clear();
+  if( q.pIsDirty != 0 ){
+    for(int ifront=0;ifront<(int)front.aFront.size();ifront++){
+      if( IsCleanPairBVTT(front.aFront[ifront].first,front.aFront[ifront].second,q) ){ aFrontKeep.push_back(front.aFront[ifront]); }
+      else{ aIndFront.push_back(ifront); }
     }
-    if( IsContact_EE_CCD(          in2,in0,jn1,jn2, p2s,p0s,q1s,q2s,  p2e,p0e,q1e,q2e) ){
-      aContactElem.insert( CContactElement(false,  in2,in0,jn1,jn2) );
+  }
+  const int nthread = q.pBuffer->NumThread();
+  front.aaFrontLocal.resize(nthread);
+  for(int ithread=0;ithread<nthread;ithread++){ front.aaFrontLocal[ithread].clear(); }
+  const int nfront = ( q.pIsDirty != 0 ) ? (int)aIndFront.size() : (int)front.aFront.size();
+#pragma omp parallel for schedule(dynamic,16) num_threads(nthread) if( nthread > 1 && nfront > 16 )
+  for(int jfront=0;jfront<nfront;jfront++){
+#ifdef _OPENMP
+    std::vector< std::pair<int,int> >& aFrontNew = front.aaFrontLocal[omp_get_thread_num()];
+#else
+    std::vector< std::pair<int,int> >& aFrontNew = front.aaFrontLocal[0];
+#endif
+    const int ifront = ( q.pIsDirty != 0 ) ? aIndFront[jfront] : jfront;
+    int ibvh0 = front.aFront[ifront].first;
+    int ibvh1 = front.aFront[ifront].second;
+    if( ibvh0 == ibvh1 || aBB[ibvh0].IsIntersect(aBB[ibvh1]) ){ // 下に向かって探索する
+      GetContactElement_Stack(q.pBuffer->Local(),&aFrontNew,q,ibvh0,ibvh1);
+      continue;
     }
-    if( IsContact_EE_CCD(          in2,in0,jn2,jn0, p2s,p0s,q2s,q0s,  p2e,p0e,q2e,q0e) ){
-      aContactElem.insert( CContactElement(false,  in2,in0,jn2,jn0) );
+    // 交差しない祖先まで持ち上げる．一部だけ探索し直す時は残した組と重なるので持ち上げない
+    while( q.pIsDirty == 0 ){
+      int jbvh0, jbvh1;
+      if( !GetParentBVTT(jbvh0,jbvh1, ibvh0,ibvh1, aBVH,front.aDepth) ) break;
+      if( aBB[jbvh0].IsIntersect(aBB[jbvh1]) ) break;
+      ibvh0 = jbvh0;
+      ibvh1 = jbvh1;
     }
+    aFrontNew.push_back( std::make_pair(ibvh0,ibvh1) );
+  }
+  if( q.is_ccd ){ FlushContactBufferCCD(*q.pBuffer); }
+  front.aFront.clear();
+  for(int ithread=0;ithread<nthread;ithread++){
+    front.aFront.insert(front.aFront.end(),front.aaFrontLocal[ithread].begin(),front.aaFrontLocal[ithread].end());
+  }
+  // 同じ祖先に持ち上げられたノードを一つにする
+  std::sort(front.aFront.begin(),front.aFront.end());
+  front.aFront.erase( std::unique(front.aFront.begin(),front.aFront.end()), front.aFront.end() );
+  if( q.pIsDirty != 0 ){ // 残した組と合わせる(std::inplace_mergeは作業領域を確保するので使わない)
+    front.aFrontTmp.resize(front.aFront.size()+aFrontKeep.size());
+    std::merge(front.aFront.begin(),front.aFront.end(),aFrontKeep.begin(),aFrontKeep.end(),front.aFrontTmp.begin());
+    front.aFront.swap(front.aFrontTmp);
   }
 }
 
+void GetContactElement_Proximity
+(CContactBuffer& buffer,
+ CFrontBVTT& front,
+ const CNormalConeBVH& cone,
+ ////
+ double delta,
+ const std::vector<double>& aXYZ,
+ const std::vector<int>& aTri,
+ const std::vector<unsigned char>& aFlgOwn,
+ int ibvh,
+ const std::vector<CNodeBVH>& aBVH,
+ const std::vector<CAABB3D>& aBB,
+ const std::vector<CAABBChildBVH>& aBBC)
+{
+  CQueryContactBVH q;
+  q.is_ccd = false;
+  q.dt = 0;
+  q.delta = delta;
+  q.pXYZ = &aXYZ;
+  q.pUVW = 0;
+  q.pTri = &aTri;
+  q.pFlgOwn = &aFlgOwn;
+  q.pBVH = &aBVH;
+  q.pBB = &aBB;
+  q.pBBC = &aBBC;
+  q.pCone = &cone;
+  q.pIsDirty = 0;
+  q.pBuffer = &buffer;
+  GetContactElement_Front(front,q,ibvh);
+}
+
 void GetContactElement_CCD
-(std::set<CContactElement>& aContactElem,
+(CContactBuffer& buffer,
+ CFrontBVTT& front,
+ const CNormalConeBVH& cone,
  ////
  double dt,
  double delta,
  const std::vector<double>& aXYZ,
  const std::vector<double>& aUVW,
  const std::vector<int>& aTri,
+ const std::vector<unsigned char>& aFlgOwn,
  int ibvh,
  const std::vector<CNodeBVH>& aBVH,
- const std::vector<CAABB3D>& aBB)
+ const std::vector<CAABB3D>& aBB,
+ const std::vector<CAABBChildBVH>& aBBC)
+{
+  CQueryContactBVH q;
+  q.is_ccd = true;
+  q.dt = dt;
+  q.delta = delta;
+  q.pXYZ = &aXYZ;
+  q.pUVW = &aUVW;
+  q.pTri = &aTri;
+  q.pFlgOwn = &aFlgOwn;
+  q.pBVH = &aBVH;
+  q.pBB = &aBB;
+  q.pBBC = &aBBC;
+  q.pCone = &cone;
+  q.pIsDirty = 0;
+  q.pBuffer = &buffer;
+  GetContactElement_Front(front,q,ibvh);
+}
+
+void GetContactElement_CCD
+(CContactBuffer& buffer,
+ CFrontBVTT& front,
+ const CNormalConeBVH& cone,
+ const CDirtyBVH& dirty,
+ ////
+ double dt,
+ double delta,
+ const std::vector<double>& aXYZ,
+ const std::vector<double>& aUVW,
+ const std::vector<int>& aTri,
+ const std::vector<unsigned char>& aFlgOwn,
+ int ibvh,
+ const std::vector<CNodeBVH>& aBVH,
+ const std::vector<CAABB3D>& aBB,
+ const std::vector<CAABBChildBVH>& aBBC)
+{
+  CQueryContactBVH q;
+  q.is_ccd = true;
+  q.dt = dt;
+  q.delta = delta;
+  q.pXYZ = &aXYZ;
+  q.pUVW = &aUVW;
+  q.pTri = &aTri;
+  q.pFlgOwn = &aFlgOwn;
+  q.pBVH = &aBVH;
+  q.pBB = &aBB;
+  q.pBBC = &aBBC;
+  q.pCone = &cone;
+  q.pIsDirty = &dirty.aIsDirty;
+  q.pBuffer = &buffer;
+  GetContactElement_Front(front,q,ibvh);
+}
+
+/* ------------------------------------------------------------------------------------- */
+
+CContactBuffer::CContactBuffer()
+{
+#ifdef _OPENMP
+  this->Initialize( omp_get_max_threads() );
+#else
+  this->Initialize(1);
+#endif
+}
+
+void CContactBuffer::Initialize(int nthread)
+{
+  if( nthread < 1 ){ nthread = 1; }
+  aaCE.resize(nthread);
+  aCounter.resize(nthread);
+  aBatchFV.resize(nthread);
+  aBatchEE.resize(nthread);
+  for(int ith=0;ith<nthread;ith++){ aBatchFV[ith].is_fv = true;  aBatchEE[ith].is_fv = false; }
+  this->Clear();
+}
+
+void CContactBuffer::Clear()
+{
+  for(int ith=0;ith<(int)aaCE.size();ith++){ aaCE[ith].clear(); }
+  for(int ith=0;ith<(int)aCounter.size();ith++){ aCounter[ith].Clear(); }
+  for(int ith=0;ith<(int)aBatchFV.size();ith++){ aBatchFV[ith].n = 0;  aBatchEE[ith].n = 0; }
+  counter.Clear();
+}
+
+std::vector<CContactElement>& CContactBuffer::Local()
+{
+#ifdef _OPENMP
+  const int ith = omp_get_thread_num();
+#else
+  const int ith = 0;
+#endif
+  assert( ith < (int)aaCE.size() );
+  return aaCE[ith];
+}
+
+CCounterFilterCCD& CContactBuffer::LocalCounter()
 {
-  const int ichild0 = aBVH[ibvh].ichild[0];
-  const int ichild1 = aBVH[ibvh].ichild[1];
-  const bool is_leaf = (ichild1 == -1);
-  if( is_leaf ) return;
-  GetContactElement_CCD(aContactElem, dt,delta, aXYZ,aUVW,aTri, ichild0,ichild1,aBVH,aBB);
-  GetContactElement_CCD(aContactElem, dt,delta, aXYZ,aUVW,aTri, ichild0,        aBVH,aBB);
-  GetContactElement_CCD(aContactElem, dt,delta, aXYZ,aUVW,aTri, ichild1,        aBVH,aBB);
+#ifdef _OPENMP
+  const int ith = omp_get_thread_num();
+#else
+  const int ith = 0;
+#endif
+  assert( ith < (int)aCounter.size() );
+  return aCounter[ith];
 }
 
+CBatchContactCCD& CContactBuffer::LocalBatch(bool is_fv)
+{
+#ifdef _OPENMP
+  const int ith = omp_get_thread_num();
+#else
+  const int ith = 0;
+#endif
+  assert( ith < (int)aBatchFV.size() );
+  return is_fv ? aBatchFV[ith] : aBatchEE[ith];
+}
+
+// 接触要素の整列に使うキーのibyte番目のバイト（下位から）
+static inline unsigned int KeyByteContactElement
+(const CContactElement& ce, int ibyte)
+{
+  if( ibyte == 0 ){ return ce.is_fv ? 1 : 0; }
+  const int ifield = (ibyte-1)/4; // 0:ino3 1:ino2 2:ino1 3:ino0
+  const int ishift = ((ibyte-1)%4)*8;
+  unsigned int val;
+  if(      ifield == 0 ){ val = (unsigned int)ce.ino3; }
+  else if( ifield == 1 ){ val = (unsigned int)ce.ino2; }
+  else if( ifield == 2 ){ val = (unsigned int)ce.ino1; }
+  else{                   val = (unsigned int)ce.ino0; }
+  return (val>>ishift)&0xff;
+}
+
+void CContactBuffer::Gather(std::vector<CContactElement>& aContactElem)
+{
+  counter.Clear();
+  for(int ith=0;ith<(int)aCounter.size();ith++){ counter.Add(aCounter[ith]); }
+  int nce = 0;
+  for(int ith=0;ith<(int)aaCE.size();ith++){ nce += (int)aaCE[ith].size(); }
+  aContactElem.resize(nce);
+  {
+    int ice = 0;
+    for(int ith=0;ith<(int)aaCE.size();ith++){
+      for(int jce=0;jce<(int)aaCE[ith].size();jce++){ aContactElem[ice] = aaCE[ith][jce]; ice++; }
+    }
+  }
+  if( nce < 2 ) return;
+  // LSD基数ソート. 全ての要素が同じバケツに入る桁は飛ばす
+  const int nbyte = 1+4*4;
+  aHist.assign(nbyte*256,0);
+  for(int ice=0;ice<nce;ice++){
+    for(int ibyte=0;ibyte<nbyte;ibyte++){
+      aHist[ibyte*256+KeyByteContactElement(aContactElem[ice],ibyte)]++;
+    }
+  }
+  tmp.resize(nce);
+  for(int ibyte=0;ibyte<nbyte;ibyte++){
+    int* hist = &aHist[ibyte*256];
+    if( hist[ KeyByteContactElement(aContactElem[0],ibyte) ] == nce ) continue;
+    int sum = 0;
+    for(int i=0;i<256;i++){ const int n = hist[i]; hist[i] = sum; sum += n; }
+    for(int ice=0;ice<nce;ice++){
+      const unsigned int ib = KeyByteContactElement(aContactElem[ice],ibyte);
+      tmp[ hist[ib] ] = aContactElem[ice];
+      hist[ib]++;
+    }
+    aContactElem.swap(tmp);
+  }
+#ifndef NDEBUG
+  for(int ice=1;ice<nce;ice++){ // 同じ要素は入っていないはず
+    const CContactElement& ce0 = aContactElem[ice-1];
+    const CContactElement& ce1 = aContactElem[ice];
+    assert( !( ce0.ino0 == ce1.ino0 && ce0.ino1 == ce1.ino1 && ce0.ino2 == ce1.ino2 && ce0.ino3 == ce1.ino3
+              && ce0.is_fv == ce1.is_fv ) );
+  }
+#endif
+}
@@ -11,10 +11,14 @@
 
 #include <stack>
 #include <vector>
+#include <utility>
 
 #include "aabb.h"
 #include "vector3d.h"
+#include "jagged_array.h"
 
+// ichild[1]が負の時は葉ノードで,aTriのichild[0]番目から-ichild[1]個の三角形を持つ
+// (三角形を一つだけ持つ葉はichild[0]==itri, ichild[1]==-1)
 class CNodeBVH
 {
 public:
@@ -22,11 +26,67 @@ public:
   int ichild[2];
 };
 
+const int NTRI_BVH_LEAF_MAX = 8; // 一つの葉が持てる三角形の数の上限
+
+// 内部ノードの二つの子ノードのBounding BoxをSoAで並べたもの(配列の添字は親ノード)
+// 一つの箱と二つの子ノードの箱との交差をSIMDで一度に判定するために使う
+class CAABBChildBVH
+{
+public:
+  double x_min[2], x_max[2];
+  double y_min[2], y_max[2];
+  double z_min[2], z_max[2];
+};
+
 int MakeBVHTopology_TopDown
 (const std::vector<int>& aTri,
  const std::vector<double>& aXYZ,
  std::vector<CNodeBVH>& aNodeBVH);
 
+// 三角形の重心のMorton符号の順に並べてBVHを作る(Linear BVH)．根ノードの番号を返す
+// 大きく変形した後にトポロジーを作り直すためのもので，MakeBVHTopology_TopDownより高速
+int MakeBVHTopology_Morton
+(const std::vector<int>& aTri,
+ const std::vector<double>& aXYZ,
+ std::vector<CNodeBVH>& aNodeBVH);
+
+// ビンに分けた表面積ヒューリスティクス(SAH)で分割してBVHを作る．根ノードの番号を返す
+// 時間はかかるが兄弟ノードの箱の重なりが少ない木になる
+int MakeBVHTopology_SAH
+(const std::vector<int>& aTri,
+ const std::vector<double>& aXYZ,
+ std::vector<CNodeBVH>& aNodeBVH);
+
+// 三角形がntri_leaf_max個以下の部分木を一つの葉にまとめる．根ノードの番号を返す
+// aTriLeafは葉の順に三角形の頂点番号を並べ替えたもので,以後はaTriの代わりにこれをBVHと共に使う
+int CollapseBVHLeaf
+(std::vector<int>& aTriLeaf,
+ std::vector<CNodeBVH>& aNodeBVH,
+ ////
+ int iroot,
+ const std::vector<int>& aTri,
+ int ntri_leaf_max);
+
+// 頂点と辺をそれを含む三角形のうち番号の最も小さいものに持たせる(aTriを並べ替えたら作り直す)
+// aFlgOwn[itri]のビット0-2は頂点0-2,ビット3-5は辺(0,1),(1,2),(2,0)を持つかどうか
+// 三角形の組ごとに持っている頂点と辺だけを判定すれば,同じ頂点と面,辺と辺の組はちょうど一回だけ判定される
+void MakeFeatureOwnerTri
+(std::vector<unsigned char>& aFlgOwn,
+ ////
+ const std::vector<int>& aTri);
+
+// BVHの品質を評価する(aBBは構築済みであること)
+// cost_sah: 根の表面積で割ったノードの表面積の和, ndepth_max: 葉の最大の深さ
+// ratio_overlap: 根の表面積で割った兄弟ノードの箱の重なりの表面積の和(自己衝突の探索の無駄の目安)
+void EvaluateQualityBVH
+(double& cost_sah,
+ int& ndepth_max,
+ double& ratio_overlap,
+ ////
+ int iroot,
+ const std::vector<CNodeBVH>& aNodeBVH,
+ const std::vector<CAABB3D>& aBB);
+
 // BVHのBounding Boxを構築
 void BuildBoundingBoxChild_Prx
 (int ibvh,
@@ -45,6 +105,34 @@ void BuildBoundingBoxChild_CCD
  const std::vector<CNodeBVH>& aNodeBVH,
  std::vector<CAABB3D>& aBB);
 
+// BVHのノードを葉からの高さごとに分類する(aLevel.index[ilev]からaLevel.index[ilev+1]までが高さilevのノード)
+// トポロジーを作った後に一度だけ呼べばよい
+void MakeBVHLevelOrder
+(CJaggedArray& aLevel,
+ int iroot,
+ const std::vector<CNodeBVH>& aNodeBVH);
+
+// BVHのBounding Boxを葉から根に向かって高さごとに並列に構築
+// 子ノードの箱はaBBCにも親ノードごとにまとめて格納する
+void BuildBoundingBoxLevel_Prx
+(double delta,
+ const std::vector<double>& aXYZ,
+ const std::vector<int>& aTri,
+ const std::vector<CNodeBVH>& aNodeBVH,
+ const CJaggedArray& aLevel,
+ std::vector<CAABB3D>& aBB,
+ std::vector<CAABBChildBVH>& aBBC);
+
+void BuildBoundingBoxLevel_CCD
+(double dt,
+ const std::vector<double>& aXYZ,
+ const std::vector<double>& aUVW,
+ const std::vector<int>& aTri,
+ const std::vector<CNodeBVH>& aNodeBVH,
+ const CJaggedArray& aLevel,
+ std::vector<CAABB3D>& aBB,
+ std::vector<CAABBChildBVH>& aBBC);
+
 
 double DistanceFaceVertex
 (const CVector3D& p0, const CVector3D& p1, const CVector3D& p2,
@@ -56,9 +144,15 @@ double DistanceEdgeEdge
  const CVector3D& q0, const CVector3D& q1,
  double& ratio_p, double& ratio_q);
 
+// CCDで同一平面になる時刻の根の精度の既定値
+const double TOL_ROOT_CUBIC_CCD = 1.0e-6;
+
+// 始めの位置s0-s3から終わりの位置e0-e3まで線形に動く4点が同一平面に並ぶ最初の補間係数(なければ-1)
+// tolは補間係数の精度
 double FindCoplanerInterp
 (const CVector3D& s0, const CVector3D& s1, const CVector3D& s2, const CVector3D& s3,
- const CVector3D& e0, const CVector3D& e1, const CVector3D& e2, const CVector3D& e3);
+ const CVector3D& e0, const CVector3D& e1, const CVector3D& e2, const CVector3D& e3,
+ double tol = TOL_ROOT_CUBIC_CCD);
 
 // smallest element of contact (vertex-face or edge-edge)
 // 接触要素のクラス（点と面，辺と辺）
@@ -93,12 +187,14 @@ public:
       else { assert(0); }
     }
   }
+  CContactElement() : is_fv(false), ino0(0), ino1(0), ino2(0), ino3(0){}
   bool operator < (const CContactElement& p2) const
   {
     if( ino0 != p2.ino0 ){ return ino0 < p2.ino0; }
     if( ino1 != p2.ino1 ){ return ino1 < p2.ino1; }
     if( ino2 != p2.ino2 ){ return ino2 < p2.ino2; }
-    return ino3 < p2.ino3;
+    if( ino3 != p2.ino3 ){ return ino3 < p2.ino3; }
+    return is_fv < p2.is_fv;
   }
   public:
     bool is_fv; // true: ee contact, false: vf contact, 真ならFV，偽ならEE
@@ -107,18 +203,175 @@ public:
 
 
 
+// CCDの候補を判定のどの段階で除いたか
+enum {
+  FILTER_CCD_SHARE = 0, // 頂点を共有している
+  FILTER_CCD_BOX,       // 動く範囲の箱が交差しない
+  FILTER_CCD_CSAT,      // 点が面の同じ側にあり続ける(FVのみ)
+  FILTER_CCD_DIST,      // 始めの距離が動く距離より大きい
+  FILTER_CCD_BERNSTEIN, // 同一平面の三次関数のベルンシュタイン係数が全て同じ符号
+  FILTER_CCD_ROOT,      // 同一平面になる時刻が[0,1]にない
+  FILTER_CCD_MISS,      // 同一平面になる時刻に接触していない
+  FILTER_CCD_HIT,       // 接触した
+  NFILTER_CCD
+};
+
+// CCDの候補の段階ごとの数(FVとEEの別)．フィルタがどれだけ候補を除いたかを見るのに使う
+class CCounterFilterCCD
+{
+public:
+  CCounterFilterCCD(){ this->Clear(); }
+  void Clear(){
+    for(int i=0;i<NFILTER_CCD;i++){ aNumFV[i] = 0;  aNumEE[i] = 0; }
+  }
+  void Add(const CCounterFilterCCD& c){
+    for(int i=0;i<NFILTER_CCD;i++){ aNumFV[i] += c.aNumFV[i];  aNumEE[i] += c.aNumEE[i]; }
+  }
+public:
+  int aNumFV[NFILTER_CCD];
+  int aNumEE[NFILTER_CCD];
+};
+
+// 簡単な判定を通ったCCDの候補をためておき,まとめて判定する(FVとEEは別のバッチにする)
+// 点の順番は FVなら面の3点と点, EEなら辺の2点ともう一つの辺の2点
+// 位置は[点][成分][候補]の順に並べて,SIMDのレーンに候補を続けて読み込めるようにする
+class CBatchContactCCD
+{
+public:
+  enum { NBATCH = 64 }; // レーンの数(4)の倍数．接触した候補をunsigned long longのビットで表すので64以下
+  CBatchContactCCD(){ n = 0;  is_fv = true; }
+public:
+  bool is_fv;
+  int n;
+  int aIno[NBATCH][4];
+  double aS[4][3][NBATCH]; // 始めの位置
+  double aE[4][3][NBATCH]; // 終わりの位置
+};
+
+// ためたCCDの候補を判定し,接触した候補のビットを立てて返す．判定を進めた段階ごとの数をcounterに加える
+// 実行時に選ばれた核(ccd_avx2.hのGetBatchCCDKernel)で判定する
+unsigned long long JudgeBatchContactCCD
+(CCounterFilterCCD& counter,
+ CBatchContactCCD& b);
+
+// 接触要素を集めるバッファ．スレッドごとに追加のみを行う配列を持ち，
+// Gatherで一つの配列にまとめて基数ソートで整列する(スレッド数によらず同じ順番になる)
+// 頂点と辺の持ち主の三角形だけを判定するので(MakeFeatureOwnerTriを参照)同じ要素は一度しか入らない
+class CContactBuffer
+{
+public:
+  CContactBuffer();
+  // nthread個のスレッドで探索する．1なら逐次探索
+  void Initialize(int nthread);
+  void Clear();
+  int NumThread() const { return (int)aaCE.size(); }
+  // 呼び出したスレッド用の配列
+  std::vector<CContactElement>& Local();
+  CCounterFilterCCD& LocalCounter();
+  CBatchContactCCD& LocalBatch(bool is_fv);
+  // 接触要素を一つの配列にまとめ,CCDの候補の数をcounterに集計する
+  void Gather(std::vector<CContactElement>& aContactElem);
+public:
+  std::vector< std::vector<CContactElement> > aaCE; // スレッドごとの接触要素の配列
+  std::vector<CCounterFilterCCD> aCounter; // スレッドごとのCCDの候補の数
+  CCounterFilterCCD counter; // Gatherで集計したCCDの候補の数
+  std::vector<CBatchContactCCD> aBatchFV, aBatchEE; // スレッドごとのCCDの候補のバッチ(探索の終わりには空になっている)
+private:
+  std::vector<CContactElement> tmp; // 基数ソート用の作業領域
+  std::vector<int> aHist; // 基数ソートのバケツの数
+};
+
+// BVHのノードごとの法線のコーン
+// ノードの三角形の法線が全て半球に収まり,輪郭をその軸に垂直な平面に投影して交差しなければ,
+// そのノードの中では自己接触は起きないので判定を省略できる(Volino & Magnenat-Thalmann 1994)
+// 近接の判定では要素の大きさが接触の距離より十分大きいことを仮定している
+class CNormalConeBVH
+{
+public:
+  // BVHのトポロジーを作った後に呼ぶ．aTriは葉の順に並べた三角形(CollapseBVHLeafを参照)
+  void Initialize(int iroot,
+                  const std::vector<CNodeBVH>& aNodeBVH,
+                  const std::vector<int>& aTri);
+  // 高さごとにコーンを更新する．CCDでは時間dtの間に法線が動く範囲を含める
+  void Update_Prx(const std::vector<double>& aXYZ,
+                  const std::vector<int>& aTri,
+                  const std::vector<CNodeBVH>& aNodeBVH,
+                  const CJaggedArray& aLevel);
+  void Update_CCD(double dt,
+                  const std::vector<double>& aXYZ,
+                  const std::vector<double>& aUVW,
+                  const std::vector<int>& aTri,
+                  const std::vector<CNodeBVH>& aNodeBVH,
+                  const CJaggedArray& aLevel);
+  // ノードibvhの中で自己接触が起きないことが示せれば真(pUVWが0でなければCCD)
+  bool IsSelfContactFree(int ibvh,
+                         double dt,
+                         double delta,
+                         const std::vector<double>& aXYZ,
+                         const std::vector<double>* pUVW) const;
+public:
+  std::vector<double> aAxis; // コーンの軸(ノードごとに3つ)
+  std::vector<double> aAngle; // コーンの半頂角
+  std::vector<int> aIsCullable; // 三角形がつながっていて輪郭の辺が少ないノードなら1
+  CJaggedArray aContour; // ノードの輪郭の辺(頂点の番号を2つずつ)
+};
+
+// 速度が変わった頂点を含むBVHのノード(祖先を含む)に印をつける
+// CCDの反復では撃力で速度が変わった頂点の周りだけが変わるので,印のついたノードだけ箱を更新して探索し直す
+class CDirtyBVH
+{
+public:
+  // BVHのトポロジーを作った後に呼ぶ．aTriは葉の順に並べた三角形(CollapseBVHLeafを参照)
+  void Initialize(int nno,
+                  const std::vector<CNodeBVH>& aNodeBVH,
+                  const CJaggedArray& aLevel,
+                  const std::vector<int>& aTri);
+  // 前の印を消して,頂点aInoを含むノードに印をつけ直す(aInoは重複してもよい)
+  void SetDirtyVertex(const std::vector<int>& aIno,
+                      const std::vector<CNodeBVH>& aNodeBVH);
+  int NumDirtyNode() const { return (int)aLevelDirty.array.size(); }
+public:
+  CJaggedArray aVtxLeaf; // 頂点を含む葉ノード
+  std::vector<int> aHeight; // ノードの葉からの高さ
+  std::vector<unsigned char> aIsDirty; // 印のついたノードなら1
+  CJaggedArray aLevelDirty; // 印のついたノードを高さごとに並べたもの(BuildBoundingBoxLevel_CCDのaLevelに渡せる)
+private:
+  std::vector<int> aDirty; // 印をつけたノードの作業領域
+};
+
+// BVTT(二つのノードの組の木)の探索を止めたノードの組(フロント)を保存しておき,次の探索をそこから始める
+// 布は一回の探索の間に少ししか動かないので,探索の手間が木の大きさでなく変化の大きさに比例する
+// ノードの組(ibvh0,ibvh1)は ibvh0==ibvh1 の時はノードの中の自己接触を表す
+class CFrontBVTT
+{
+public:
+  // BVHのトポロジーを作り直した時に呼ぶ(次の探索は根から始まる)
+  void Clear();
+public:
+  std::vector< std::pair<int,int> > aFront; // フロントのノードの組(整列済み)
+  std::vector<int> aDepth; // BVHのノードの深さ
+  std::vector< std::vector< std::pair<int,int> > > aaFrontLocal; // スレッドごとの新しいフロント
+  // 探索の作業領域(探索のたびに確保しないように保持する)
+  std::vector< std::pair<int,int> > aFrontKeep; // 一部だけ探索し直す時にそのまま残す組
+  std::vector< std::pair<int,int> > aFrontTmp; // フロントを合わせる時の作業領域
+  std::vector<int> aIndFront; // 探索するフロントの組の番号
+};
+
+// BVHの中で接触する要素を抽出する．バッファのスレッド数で並列に探索する
 void GetContactElement_Proximity
-(std::set<CContactElement>& aContactElem,
+(CContactBuffer& buffer,
  ////
  double delta,
  const std::vector<double>& aXYZ,
  const std::vector<int>& aTri,
  int ibvh,
  const std::vector<CNodeBVH>& aBVH,
- const std::vector<CAABB3D>& aBB);
+ const std::vector<CAABB3D>& aBB,
+ const std::vector<CAABBChildBVH>& aBBC);
       
+// BVHの中で接触する要素をCCDで抽出する．バッファのスレッド数で並列に探索する
 void GetContactElement_CCD
-(std::set<CContactElement>& aContactElem,
+(CContactBuffer& buffer,
  /////
  double dt,
  double delta,
@@ -127,6 +380,57 @@ void GetContactElement_CCD
  const std::vector<int>& aTri,
  int ibvh,
  const std::vector<CNodeBVH>& aBVH,
- const std::vector<CAABB3D>& aBB);
+ const std::vector<CAABB3D>& aBB,
+ const std::vector<CAABBChildBVH>& aBBC);
+
+// フロントから探索を再開して接触する要素を抽出する．フロントは更新される．フロントの単位で並列に探索する
+void GetContactElement_Proximity
+(CContactBuffer& buffer,
+ CFrontBVTT& front,
+ const CNormalConeBVH& cone,
+ ////
+ double delta,
+ const std::vector<double>& aXYZ,
+ const std::vector<int>& aTri,
+ const std::vector<unsigned char>& aFlgOwn, // 三角形が持つ頂点と辺(MakeFeatureOwnerTriを参照)
+ int ibvh,
+ const std::vector<CNodeBVH>& aBVH,
+ const std::vector<CAABB3D>& aBB,
+ const std::vector<CAABBChildBVH>& aBBC);
+
+void GetContactElement_CCD
+(CContactBuffer& buffer,
+ CFrontBVTT& front,
+ const CNormalConeBVH& cone,
+ ////
+ double dt,
+ double delta,
+ const std::vector<double>& aXYZ,
+ const std::vector<double>& aUVW,
+ const std::vector<int>& aTri,
+ const std::vector<unsigned char>& aFlgOwn,
+ int ibvh,
+ const std::vector<CNodeBVH>& aBVH,
+ const std::vector<CAABB3D>& aBB,
+ const std::vector<CAABBChildBVH>& aBBC);
+
+// 印のついたノードを含むフロントのノードの組だけを探索し直す
+// 印のないノード同士の組では前回の探索から箱も接触も変わらず,接触する要素の頂点には全て印がついていることを仮定している
+void GetContactElement_CCD
+(CContactBuffer& buffer,
+ CFrontBVTT& front,
+ const CNormalConeBVH& cone,
+ const CDirtyBVH& dirty,
+ ////
+ double dt,
+ double delta,
+ const std::vector<double>& aXYZ,
+ const std::vector<double>& aUVW,
+ const std::vector<int>& aTri,
+ const std::vector<unsigned char>& aFlgOwn,
+ int ibvh,
+ const std::vector<CNodeBVH>& aBVH,
+ const std::vector<CAABB3D>& aBB,
+ const std::vector<CAABBChildBVH>& aBBC);
 
 #endif
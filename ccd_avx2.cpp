@@ -0,0 +1,373 @@
+﻿//
+//  ccd_avx2.cpp
+//
+//  CCDの候補のバッチの判定のAVX2版．この関数だけをAVX2とFMAでコンパイルし，
+//  使うかどうかは実行時にCPUを調べて決める
+//
+
+#include <assert.h>
+#include <math.h>
+
+#include "ccd_avx2.h"
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define CCD_AVX2_ENABLED
+#include <immintrin.h>
+#define TARGET_AVX2 __attribute__((target("avx2,fma")))
+#endif
+
+static int SelectBatchCCDKernel()
+{
+#ifdef CCD_AVX2_ENABLED
+  __builtin_cpu_init();
+  if( __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") ){ return BATCH_CCD_KERNEL_AVX2; }
+#endif
+  return BATCH_CCD_KERNEL_SCALAR;
+}
+
+static int ikernel_batch_ccd = SelectBatchCCDKernel();
+
+int GetBatchCCDKernel()
+{
+  return ikernel_batch_ccd;
+}
+
+int SetBatchCCDKernel(int ikernel)
+{
+  ikernel_batch_ccd = BATCH_CCD_KERNEL_SCALAR;
+  if( ikernel == BATCH_CCD_KERNEL_AVX2 ){ ikernel_batch_ccd = SelectBatchCCDKernel(); }
+  return ikernel_batch_ccd;
+}
+
+/* ------------------------------------------------------------------------------------- */
+
+#ifdef CCD_AVX2_ENABLED
+
+static const int NITR_ROOT_AVX2 = 64; // 根の反復の最大の回数(二分法でも倍精度の桁がなくなる回数)
+
+// 候補iから4つの点ipの位置を読み込む
+TARGET_AVX2 static inline void Load3_AVX2
+(__m256d v[3],
+ ////
+ const double a[3][CBatchContactCCD::NBATCH], int i)
+{
+  v[0] = _mm256_loadu_pd(a[0]+i);
+  v[1] = _mm256_loadu_pd(a[1]+i);
+  v[2] = _mm256_loadu_pd(a[2]+i);
+}
+
+TARGET_AVX2 static inline void Sub3_AVX2
+(__m256d c[3],
+ ////
+ const __m256d a[3], const __m256d b[3])
+{
+  c[0] = _mm256_sub_pd(a[0],b[0]);
+  c[1] = _mm256_sub_pd(a[1],b[1]);
+  c[2] = _mm256_sub_pd(a[2],b[2]);
+}
+
+TARGET_AVX2 static inline __m256d Dot_AVX2
+(const __m256d a[3], const __m256d b[3])
+{
+  return _mm256_fmadd_pd(a[2],b[2], _mm256_fmadd_pd(a[1],b[1], _mm256_mul_pd(a[0],b[0])));
+}
+
+// a・(b×c) をScalarTripleProductと同じ順番で計算する
+TARGET_AVX2 static inline __m256d ScalarTripleProduct_AVX2
+(const __m256d a[3], const __m256d b[3], const __m256d c[3])
+{
+  const __m256d cx = _mm256_sub_pd( _mm256_mul_pd(b[1],c[2]), _mm256_mul_pd(b[2],c[1]) );
+  const __m256d cy = _mm256_sub_pd( _mm256_mul_pd(b[2],c[0]), _mm256_mul_pd(b[0],c[2]) );
+  const __m256d cz = _mm256_sub_pd( _mm256_mul_pd(b[0],c[1]), _mm256_mul_pd(b[1],c[0]) );
+  return _mm256_add_pd( _mm256_add_pd( _mm256_mul_pd(a[0],cx), _mm256_mul_pd(a[1],cy) ), _mm256_mul_pd(a[2],cz) );
+}
+
+// 時刻tの位置 (1-t)*s+t*e
+TARGET_AVX2 static inline void Interp_AVX2
+(__m256d pm[3],
+ ////
+ __m256d t, const __m256d s[3], const __m256d e[3])
+{
+  const __m256d t1 = _mm256_sub_pd(_mm256_set1_pd(1.0),t);
+  for(int idim=0;idim<3;idim++){ pm[idim] = _mm256_fmadd_pd(t,e[idim], _mm256_mul_pd(t1,s[idim])); }
+}
+
+TARGET_AVX2 static inline __m256d EvaluateCubic_AVX2
+(__m256d r, __m256d k0, __m256d k1, __m256d k2, __m256d k3)
+{
+  return _mm256_fmadd_pd(r, _mm256_fmadd_pd(r, _mm256_fmadd_pd(r,k3,k2), k1), k0);
+}
+
+TARGET_AVX2 static inline __m256d EvaluateCubicDerivative_AVX2
+(__m256d r, __m256d k1, __m256d k2, __m256d k3)
+{
+  const __m256d dk2 = _mm256_add_pd(k2,k2);
+  const __m256d dk3 = _mm256_mul_pd(_mm256_set1_pd(3.0),k3);
+  return _mm256_fmadd_pd(r, _mm256_fmadd_pd(r,dk3,dk2), k1);
+}
+
+TARGET_AVX2 static inline __m256d Abs_AVX2(__m256d a)
+{
+  return _mm256_andnot_pd(_mm256_set1_pd(-0.0),a);
+}
+
+// 三次関数 k0+k1*r+k2*r^2+k3*r^3 のベルンシュタイン係数が全て同じ符号のレーン(IsSignFixedBernsteinと同じ)
+TARGET_AVX2 static inline __m256d IsSignFixedBernstein_AVX2
+(__m256d k0, __m256d k1, __m256d k2, __m256d k3)
+{
+  const __m256d zero = _mm256_setzero_pd();
+  const __m256d three = _mm256_set1_pd(3.0);
+  const __m256d b0 = k0;
+  const __m256d b1 = _mm256_add_pd(k0, _mm256_div_pd(k1,three));
+  const __m256d b2 = _mm256_add_pd(k0, _mm256_div_pd(_mm256_add_pd(_mm256_add_pd(k1,k1),k2),three));
+  const __m256d b3 = _mm256_add_pd(_mm256_add_pd(_mm256_add_pd(k0,k1),k2),k3);
+  const __m256d pos = _mm256_and_pd( _mm256_and_pd(_mm256_cmp_pd(b0,zero,_CMP_GT_OQ), _mm256_cmp_pd(b1,zero,_CMP_GT_OQ)),
+                                     _mm256_and_pd(_mm256_cmp_pd(b2,zero,_CMP_GT_OQ), _mm256_cmp_pd(b3,zero,_CMP_GT_OQ)) );
+  const __m256d neg = _mm256_and_pd( _mm256_and_pd(_mm256_cmp_pd(b0,zero,_CMP_LT_OQ), _mm256_cmp_pd(b1,zero,_CMP_LT_OQ)),
+                                     _mm256_and_pd(_mm256_cmp_pd(b2,zero,_CMP_LT_OQ), _mm256_cmp_pd(b3,zero,_CMP_LT_OQ)) );
+  return _mm256_or_pd(pos,neg);
+}
+
+// 三次関数の[0,1]の中の最初の根(なければ-1)をis_activeのレーンについて求める
+// 極値で[0,1]を単調な区間に分け,符号が変わる最初の区間でニュートン法と二分法を全てのレーンが収束するまで繰り返す
+// (区間の選び方と反復はFindRootCubicCoplaner,FindRootCubicと同じ)
+TARGET_AVX2 static inline __m256d FindRootCubicCoplaner_AVX2
+(__m256d k0, __m256d k1, __m256d k2, __m256d k3,
+ __m256d is_active,
+ double tol)
+{
+  const __m256d zero = _mm256_setzero_pd();
+  const __m256d one = _mm256_set1_pd(1.0);
+  const __m256d half = _mm256_set1_pd(0.5);
+  const __m256d eps = _mm256_set1_pd(1.0e-10);
+  const __m256d f0 = k0;
+  const __m256d f1 = _mm256_add_pd(_mm256_add_pd(_mm256_add_pd(k0,k1),k2),k3);
+  // 極値をとるr．二次関数なら一つ,三次関数なら二つ．ないものと[0,1]の外のものは1にする
+  const __m256d det = _mm256_fmsub_pd(k2,k2, _mm256_mul_pd(_mm256_set1_pd(3.0),_mm256_mul_pd(k1,k3)));
+  const __m256d is_quad  = _mm256_and_pd( _mm256_cmp_pd(Abs_AVX2(k3),eps,_CMP_LT_OQ), _mm256_cmp_pd(Abs_AVX2(k2),eps,_CMP_GT_OQ) );
+  const __m256d is_cubic = _mm256_and_pd( _mm256_cmp_pd(det,zero,_CMP_GT_OQ),         _mm256_cmp_pd(Abs_AVX2(k3),eps,_CMP_GT_OQ) );
+  const __m256d sqrt_det = _mm256_sqrt_pd(_mm256_max_pd(det,zero));
+  const __m256d inv3k3 = _mm256_div_pd(one, _mm256_mul_pd(_mm256_set1_pd(3.0),k3));
+  const __m256d rq = _mm256_div_pd(_mm256_sub_pd(zero,k1), _mm256_add_pd(k2,k2));
+  __m256d ra = _mm256_mul_pd(_mm256_sub_pd(_mm256_sub_pd(zero,k2),sqrt_det),inv3k3);
+  __m256d rb = _mm256_mul_pd(_mm256_add_pd(_mm256_sub_pd(zero,k2),sqrt_det),inv3k3);
+  ra = _mm256_blendv_pd(one,ra,is_cubic);
+  rb = _mm256_blendv_pd(one,rb,is_cubic);
+  ra = _mm256_blendv_pd(ra,rq,is_quad);
+  ra = _mm256_blendv_pd(one,ra, _mm256_and_pd(_mm256_cmp_pd(ra,zero,_CMP_GT_OQ),_mm256_cmp_pd(ra,one,_CMP_LT_OQ)) );
+  rb = _mm256_blendv_pd(one,rb, _mm256_and_pd(_mm256_cmp_pd(rb,zero,_CMP_GT_OQ),_mm256_cmp_pd(rb,one,_CMP_LT_OQ)) );
+  const __m256d rlo = _mm256_min_pd(ra,rb);
+  const __m256d rhi = _mm256_max_pd(ra,rb);
+  const __m256d flo = EvaluateCubic_AVX2(rlo, k0,k1,k2,k3);
+  const __m256d fhi = EvaluateCubic_AVX2(rhi, k0,k1,k2,k3);
+  // 符号が変わる最初の区間 [0,rlo], [rlo,rhi], [rhi,1]
+  const __m256d is_sec0 = _mm256_cmp_pd(_mm256_mul_pd(f0,flo),zero,_CMP_LT_OQ);
+  const __m256d is_sec1 = _mm256_andnot_pd(is_sec0, _mm256_cmp_pd(_mm256_mul_pd(flo,fhi),zero,_CMP_LT_OQ));
+  const __m256d is_sec2 = _mm256_andnot_pd(_mm256_or_pd(is_sec0,is_sec1), _mm256_cmp_pd(_mm256_mul_pd(fhi,f1),zero,_CMP_LT_OQ));
+  const __m256d is_bracket = _mm256_and_pd(is_active, _mm256_or_pd(is_sec0,_mm256_or_pd(is_sec1,is_sec2)));
+  __m256d r0 = _mm256_blendv_pd(_mm256_blendv_pd(rhi,rlo,is_sec1),zero,is_sec0);
+  __m256d r1 = _mm256_blendv_pd(_mm256_blendv_pd(one,rhi,is_sec1),rlo,is_sec0);
+  const __m256d v0 = _mm256_blendv_pd(_mm256_blendv_pd(fhi,flo,is_sec1),f0,is_sec0);
+  // 符号が変わる区間がなければ端が根かどうか
+  __m256d t_end = _mm256_set1_pd(-1.0);
+  t_end = _mm256_blendv_pd(t_end,one, _mm256_cmp_pd(f1,zero,_CMP_EQ_OQ));
+  t_end = _mm256_blendv_pd(t_end,zero,_mm256_cmp_pd(f0,zero,_CMP_EQ_OQ));
+  ////
+  const __m256d vtol = _mm256_set1_pd(tol);
+  __m256d dr_old = _mm256_sub_pd(r1,r0);
+  __m256d dr = dr_old;
+  __m256d r = _mm256_mul_pd(half,_mm256_add_pd(r0,r1));
+  __m256d v = EvaluateCubic_AVX2(r, k0,k1,k2,k3);
+  __m256d d = EvaluateCubicDerivative_AVX2(r, k1,k2,k3);
+  __m256d is_conv = _mm256_xor_pd(is_bracket, _mm256_castsi256_pd(_mm256_set1_epi64x(-1))); // 反復しないレーン
+  for(int itr=0;itr<NITR_ROOT_AVX2;itr++){
+    if( _mm256_movemask_pd(is_conv) == 0xF ) break;
+    // 範囲を出るか,収束が遅い時は二分法
+    const __m256d a0 = _mm256_fmsub_pd(_mm256_sub_pd(r,r1),d,v);
+    const __m256d a1 = _mm256_fmsub_pd(_mm256_sub_pd(r,r0),d,v);
+    const __m256d is_bisect = _mm256_or_pd( _mm256_cmp_pd(_mm256_mul_pd(a0,a1),zero,_CMP_GT_OQ),
+                                            _mm256_cmp_pd(Abs_AVX2(_mm256_add_pd(v,v)),Abs_AVX2(_mm256_mul_pd(dr_old,d)),_CMP_GT_OQ) );
+    const __m256d dr_new = _mm256_blendv_pd(_mm256_div_pd(v,d), _mm256_mul_pd(half,_mm256_sub_pd(r1,r0)), is_bisect);
+    const __m256d r_new  = _mm256_blendv_pd(_mm256_sub_pd(r,dr_new), _mm256_add_pd(r0,dr_new), is_bisect);
+    dr_old = _mm256_blendv_pd(dr,dr_old,is_conv);
+    dr = _mm256_blendv_pd(dr_new,dr,is_conv);
+    r = _mm256_blendv_pd(r_new,r,is_conv);
+    is_conv = _mm256_or_pd(is_conv, _mm256_cmp_pd(Abs_AVX2(dr),vtol,_CMP_LT_OQ));
+    v = EvaluateCubic_AVX2(r, k0,k1,k2,k3);
+    d = EvaluateCubicDerivative_AVX2(r, k1,k2,k3);
+    is_conv = _mm256_or_pd(is_conv, _mm256_cmp_pd(v,zero,_CMP_EQ_OQ));
+    // 収束していないレーンの区間を縮める
+    const __m256d is_left = _mm256_cmp_pd(_mm256_mul_pd(v0,v),zero,_CMP_LT_OQ); // r0とrの間で符号が変化する
+    r1 = _mm256_blendv_pd(r1,r, _mm256_andnot_pd(is_conv,is_left));
+    r0 = _mm256_blendv_pd(r,r0, _mm256_or_pd(is_conv,is_left));
+  }
+  return _mm256_blendv_pd(t_end,r,is_bracket);
+}
+
+// FVで時刻tに点が面の上にあるレーンのビット(IsContact_FV_CCD_Timeと同じ判定)
+TARGET_AVX2 static inline int IsContact_FV_CCD_Time_AVX2
+(__m256d t,
+ const __m256d s[4][3], const __m256d e[4][3])
+{
+  __m256d p0[3], p1[3], p2[3], p3[3];
+  Interp_AVX2(p0, t,s[0],e[0]);
+  Interp_AVX2(p1, t,s[1],e[1]);
+  Interp_AVX2(p2, t,s[2],e[2]);
+  Interp_AVX2(p3, t,s[3],e[3]);
+  __m256d v20[3], v21[3], v23[3];
+  Sub3_AVX2(v20, p0,p2);
+  Sub3_AVX2(v21, p1,p2);
+  Sub3_AVX2(v23, p3,p2);
+  const __m256d t0 = Dot_AVX2(v20,v20);
+  const __m256d t1 = Dot_AVX2(v21,v21);
+  const __m256d t2 = Dot_AVX2(v20,v21);
+  const __m256d t3 = Dot_AVX2(v20,v23);
+  const __m256d t4 = Dot_AVX2(v21,v23);
+  const __m256d one = _mm256_set1_pd(1.0);
+  const __m256d zero = _mm256_setzero_pd();
+  const __m256d invdet = _mm256_div_pd(one, _mm256_fmsub_pd(t0,t1, _mm256_mul_pd(t2,t2)));
+  const __m256d w0 = _mm256_mul_pd(_mm256_fmsub_pd(t1,t3, _mm256_mul_pd(t2,t4)),invdet);
+  const __m256d w1 = _mm256_mul_pd(_mm256_fmsub_pd(t0,t4, _mm256_mul_pd(t2,t3)),invdet);
+  const __m256d w2 = _mm256_sub_pd(_mm256_sub_pd(one,w0),w1);
+  // 重心座標が[0,1]の外なら接触しない(NaNの時はスカラーと同じく接触とする)
+  __m256d is_out = _mm256_or_pd(_mm256_cmp_pd(w0,zero,_CMP_LT_OQ),_mm256_cmp_pd(w0,one,_CMP_GT_OQ));
+  is_out = _mm256_or_pd(is_out, _mm256_or_pd(_mm256_cmp_pd(w1,zero,_CMP_LT_OQ),_mm256_cmp_pd(w1,one,_CMP_GT_OQ)));
+  is_out = _mm256_or_pd(is_out, _mm256_or_pd(_mm256_cmp_pd(w2,zero,_CMP_LT_OQ),_mm256_cmp_pd(w2,one,_CMP_GT_OQ)));
+  return (~_mm256_movemask_pd(is_out))&0xF;
+}
+
+// EEで時刻tに辺同士が接触しているレーンのビット(IsContact_EE_CCD_Timeと同じ判定)
+// 平行な辺のレーンだけはDistanceEdgeEdgeで一つずつ判定する
+TARGET_AVX2 static inline int IsContact_EE_CCD_Time_AVX2
+(__m256d t,
+ const __m256d s[4][3], const __m256d e[4][3],
+ double dist_ee)
+{
+  __m256d p0[3], p1[3], q0[3], q1[3];
+  Interp_AVX2(p0, t,s[0],e[0]);
+  Interp_AVX2(p1, t,s[1],e[1]);
+  Interp_AVX2(q0, t,s[2],e[2]);
+  Interp_AVX2(q1, t,s[3],e[3]);
+  __m256d vp[3], vq[3], pq[3];
+  Sub3_AVX2(vp, p1,p0);
+  Sub3_AVX2(vq, q1,q0);
+  Sub3_AVX2(pq, q0,p0);
+  const __m256d one = _mm256_set1_pd(1.0);
+  const __m256d zero = _mm256_setzero_pd();
+  __m256d c[3];
+  c[0] = _mm256_fmsub_pd(vp[1],vq[2], _mm256_mul_pd(vp[2],vq[1]));
+  c[1] = _mm256_fmsub_pd(vp[2],vq[0], _mm256_mul_pd(vp[0],vq[2]));
+  c[2] = _mm256_fmsub_pd(vp[0],vq[1], _mm256_mul_pd(vp[1],vq[0]));
+  const int ipara = _mm256_movemask_pd( _mm256_cmp_pd(_mm256_sqrt_pd(Dot_AVX2(c,c)),_mm256_set1_pd(1.0e-10),_CMP_LT_OQ) );
+  const __m256d t0 = Dot_AVX2(vp,vp);
+  const __m256d t1 = Dot_AVX2(vq,vq);
+  const __m256d t2 = Dot_AVX2(vp,vq);
+  const __m256d t3 = Dot_AVX2(vp,pq);
+  const __m256d t4 = Dot_AVX2(vq,pq);
+  const __m256d invdet = _mm256_div_pd(one, _mm256_fmsub_pd(t0,t1, _mm256_mul_pd(t2,t2)));
+  const __m256d rp = _mm256_mul_pd(_mm256_fmsub_pd(t1,t3, _mm256_mul_pd(t2,t4)),invdet);
+  const __m256d rq = _mm256_mul_pd(_mm256_fmsub_pd(t2,t3, _mm256_mul_pd(t0,t4)),invdet);
+  __m256d dpq[3];
+  for(int idim=0;idim<3;idim++){
+    dpq[idim] = _mm256_sub_pd(_mm256_fmadd_pd(rp,vp[idim],p0[idim]), _mm256_fmadd_pd(rq,vq[idim],q0[idim]));
+  }
+  const __m256d dist = _mm256_sqrt_pd(Dot_AVX2(dpq,dpq));
+  __m256d is_out = _mm256_or_pd(_mm256_cmp_pd(rp,zero,_CMP_LT_OQ),_mm256_cmp_pd(rp,one,_CMP_GT_OQ));
+  is_out = _mm256_or_pd(is_out, _mm256_or_pd(_mm256_cmp_pd(rq,zero,_CMP_LT_OQ),_mm256_cmp_pd(rq,one,_CMP_GT_OQ)));
+  is_out = _mm256_or_pd(is_out, _mm256_cmp_pd(dist,_mm256_set1_pd(dist_ee),_CMP_GT_OQ));
+  int ihit = (~_mm256_movemask_pd(is_out))&0xF;
+  if( ipara == 0 ) return ihit;
+  double a[4][3][4]; // [点][成分][レーン]
+  for(int idim=0;idim<3;idim++){
+    _mm256_storeu_pd(a[0][idim],p0[idim]);
+    _mm256_storeu_pd(a[1][idim],p1[idim]);
+    _mm256_storeu_pd(a[2][idim],q0[idim]);
+    _mm256_storeu_pd(a[3][idim],q1[idim]);
+  }
+  for(int ilane=0;ilane<4;ilane++){
+    if( ((ipara>>ilane)&1) == 0 ) continue;
+    double w0, w1;
+    const double d = DistanceEdgeEdge(CVector3D(a[0][0][ilane],a[0][1][ilane],a[0][2][ilane]),
+                                      CVector3D(a[1][0][ilane],a[1][1][ilane],a[1][2][ilane]),
+                                      CVector3D(a[2][0][ilane],a[2][1][ilane],a[2][2][ilane]),
+                                      CVector3D(a[3][0][ilane],a[3][1][ilane],a[3][2][ilane]), w0,w1);
+    const bool is_hit = !( w0 < 0 || w0 > 1 || w1 < 0 || w1 > 1 || d > dist_ee );
+    ihit = is_hit ? (ihit|(1<<ilane)) : (ihit&~(1<<ilane));
+  }
+  return ihit;
+}
+
+TARGET_AVX2 unsigned long long JudgeBatchContactCCD_AVX2
+(CCounterFilterCCD& counter,
+ CBatchContactCCD& b,
+ ////
+ double tol,
+ double dist_ee)
+{
+  int* aNum = b.is_fv ? counter.aNumFV : counter.aNumEE;
+  const int n = b.n;
+  const int n4 = (n+3)/4*4;
+  for(int i=n;i<n4;i++){ // 4の倍数まで0で埋める(レーンのマスクで除く)
+    for(int ip=0;ip<4;ip++){
+      for(int idim=0;idim<3;idim++){ b.aS[ip][idim][i] = 0;  b.aE[ip][idim][i] = 0; }
+    }
+  }
+  const __m256d lane = _mm256_set_pd(3,2,1,0);
+  unsigned long long flg_hit = 0;
+  for(int i=0;i<n4;i+=4){
+    __m256d s[4][3], e[4][3];
+    for(int ip=0;ip<4;ip++){
+      Load3_AVX2(s[ip], b.aS[ip],i);
+      Load3_AVX2(e[ip], b.aE[ip],i);
+    }
+    // 同一平面になる時刻の三次関数の係数(FindCoplanerInterpと同じ)
+    __m256d x1[3], x2[3], x3[3], v1[3], v2[3], v3[3];
+    Sub3_AVX2(x1, s[1],s[0]);  Sub3_AVX2(v1, e[1],e[0]);  Sub3_AVX2(v1, v1,x1);
+    Sub3_AVX2(x2, s[2],s[0]);  Sub3_AVX2(v2, e[2],e[0]);  Sub3_AVX2(v2, v2,x2);
+    Sub3_AVX2(x3, s[3],s[0]);  Sub3_AVX2(v3, e[3],e[0]);  Sub3_AVX2(v3, v3,x3);
+    const __m256d k0 = ScalarTripleProduct_AVX2(x3,x1,x2);
+    const __m256d k1 = _mm256_add_pd( _mm256_add_pd( ScalarTripleProduct_AVX2(v3,x1,x2),
+                                                     ScalarTripleProduct_AVX2(x3,v1,x2) ),
+                                                     ScalarTripleProduct_AVX2(x3,x1,v2) );
+    const __m256d k2 = _mm256_add_pd( _mm256_add_pd( ScalarTripleProduct_AVX2(v3,v1,x2),
+                                                     ScalarTripleProduct_AVX2(v3,x1,v2) ),
+                                                     ScalarTripleProduct_AVX2(x3,v1,v2) );
+    const __m256d k3 = ScalarTripleProduct_AVX2(v3,v1,v2);
+    ////
+    const __m256d is_lane = _mm256_cmp_pd(lane,_mm256_set1_pd(n-i),_CMP_LT_OQ);
+    const __m256d is_fixed = IsSignFixedBernstein_AVX2(k0,k1,k2,k3);
+    const int ilane = _mm256_movemask_pd(is_lane);
+    const int ifixed = _mm256_movemask_pd(is_fixed) & ilane;
+    const int iactive = ilane & ~ifixed;
+    aNum[FILTER_CCD_BERNSTEIN] += __builtin_popcount(ifixed);
+    if( iactive == 0 ) continue;
+    const __m256d t = FindRootCubicCoplaner_AVX2(k0,k1,k2,k3, _mm256_andnot_pd(is_fixed,is_lane), tol);
+    const __m256d is_in = _mm256_and_pd(_mm256_cmp_pd(t,_mm256_setzero_pd(),_CMP_GE_OQ),
+                                        _mm256_cmp_pd(t,_mm256_set1_pd(1.0),_CMP_LE_OQ));
+    const int iroot = _mm256_movemask_pd(is_in) & iactive;
+    aNum[FILTER_CCD_ROOT] += __builtin_popcount(iactive & ~iroot);
+    if( iroot == 0 ) continue;
+    int ihit;
+    if( b.is_fv ){ ihit = IsContact_FV_CCD_Time_AVX2(t,s,e) & iroot; }
+    else{          ihit = IsContact_EE_CCD_Time_AVX2(t,s,e,dist_ee) & iroot; }
+    aNum[FILTER_CCD_MISS] += __builtin_popcount(iroot & ~ihit);
+    aNum[FILTER_CCD_HIT]  += __builtin_popcount(ihit);
+    flg_hit |= (unsigned long long)ihit << i;
+  }
+  return flg_hit;
+}
+
+#else // CCD_AVX2_ENABLED
+
+unsigned long long JudgeBatchContactCCD_AVX2
+(CCounterFilterCCD& counter,
+ CBatchContactCCD& b,
+ ////
+ double tol,
+ double dist_ee)
+{
+  assert(0); // GetBatchCCDKernelがAVX2を返さないので呼ばれない
+  return 0;
+}
+
+#endif // CCD_AVX2_ENABLED
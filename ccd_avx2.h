@@ -0,0 +1,32 @@
+﻿//
+//  ccd_avx2.h
+//
+//  CCDの候補のバッチ(CBatchContactCCD)の判定のAVX2版．
+//  CPUがAVX2とFMAを持つときだけ実行時に選ばれ，それ以外はスカラーのコードを使う
+//
+
+#if !defined(CCD_AVX2_H)
+#define CCD_AVX2_H
+
+#include "bvh_aabb.h"
+
+enum { BATCH_CCD_KERNEL_SCALAR=0, BATCH_CCD_KERNEL_AVX2=1 };
+
+// 実行時に選ばれたCCDのバッチの判定の核
+int GetBatchCCDKernel();
+
+// 核を指定する(計測用)．AVX2が使えなければSCALARになる．実際に選ばれた核を返す
+int SetBatchCCDKernel(int ikernel);
+
+// 候補を4つずつレーンに載せて,同一平面になる時刻の三次関数の係数,ベルンシュタイン係数の符号,
+// [0,1]の最初の根(決まった回数までのニュートン法と二分法),その時刻の重心座標(EEは辺の上の位置と距離)を判定する．
+// 接触した候補のビットを立てて返し,判定を進めた段階ごとの数をcounterに加える
+// tolは根の精度,dist_eeはEEで接触とみなす辺の距離
+unsigned long long JudgeBatchContactCCD_AVX2
+(CCounterFilterCCD& counter,
+ CBatchContactCCD& b,
+ ////
+ double tol,
+ double dist_ee);
+
+#endif // CCD_AVX2_H
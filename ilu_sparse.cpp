@@ -9,6 +9,7 @@
 #include <assert.h>
 #include <math.h>
 #include "ilu_sparse.h"
+#include "block3_avx2.h"
 
 
 static void CalcMatPr(double* out, const double* d, double* tmp,
@@ -101,7 +102,8 @@ static inline void CalcInvMat3(double a[], double t[] )
 
 CPreconditionerILU::CPreconditionerILU()
 {
-  
+  m_diaInd = 0;
+  m_is_float = false;
 }
 
 
@@ -114,8 +116,31 @@ CPreconditionerILU::~CPreconditionerILU()
 void CPreconditionerILU::Initialize_ILU0
 (const CMatrixSquareSparse& m)
 {
-  this->mat = m;
   const int nblk = m.m_nblk;
+  if( m.m_is_sym ){
+    // 上三角だけを持つ行列から下三角も含むパターンを作る．各行は下三角,上三角の順で列の昇順になる
+    std::vector<int> colind(nblk+1,0);
+    for(int icrs=0;icrs<m.m_ncrs;icrs++){ colind[m.m_rowPtr[icrs]+1]++; }
+    for(int iblk=0;iblk<nblk;iblk++){
+      colind[iblk+1] += colind[iblk] + m.m_colInd[iblk+1]-m.m_colInd[iblk];
+    }
+    std::vector<int> rowptr(colind[nblk]);
+    std::vector<int> aPos(colind.begin(),colind.end()-1);
+    for(int iblk=0;iblk<nblk;iblk++){
+      for(int icrs=m.m_colInd[iblk];icrs<m.m_colInd[iblk+1];icrs++){
+        const int jblk0 = m.m_rowPtr[icrs];
+        rowptr[aPos[jblk0]++] = iblk;
+        rowptr[aPos[iblk]++] = jblk0;
+      }
+    }
+    CMatrixSquareSparse m_full;
+    m_full.Initialize(nblk,m.m_len);
+    m_full.SetPattern(colind,rowptr);
+    this->mat = m_full;
+  }
+  else{
+    this->mat = m;
+  }
   
   if( m_diaInd != 0 ){ delete[] m_diaInd; m_diaInd = 0; }
   m_diaInd = new int [nblk];  
@@ -133,11 +158,82 @@ void CPreconditionerILU::Initialize_ILU0
   }
 }
 
+// floatの3x3ブロックの前進代入
+static void ForwardSubstitutionFloat_Block3
+(std::vector<double>& vec,
+ ////
+ const CMatrixSquareSparse& mat,
+ const int* diaInd)
+{
+  const int* colind = mat.m_colInd;
+  const int* rowptr = mat.m_rowPtr;
+  const float* vcrs = mat.m_aValCrsF.empty() ? 0 : &mat.m_aValCrsF[0];
+  const float* vdia = &mat.m_aValDiaF[0];
+  for(int iblk=0;iblk<mat.m_nblk;iblk++){
+    double t0 = vec[iblk*3+0];
+    double t1 = vec[iblk*3+1];
+    double t2 = vec[iblk*3+2];
+    for(int ijcrs=colind[iblk];ijcrs<diaInd[iblk];ijcrs++){
+      const int jblk0 = rowptr[ijcrs];
+      assert( jblk0<iblk );
+      const float* vij = &vcrs[ijcrs*9];
+      const double valj0 = vec[jblk0*3+0];
+      const double valj1 = vec[jblk0*3+1];
+      const double valj2 = vec[jblk0*3+2];
+      t0 -= vij[0]*valj0+vij[1]*valj1+vij[2]*valj2;
+      t1 -= vij[3]*valj0+vij[4]*valj1+vij[5]*valj2;
+      t2 -= vij[6]*valj0+vij[7]*valj1+vij[8]*valj2;
+    }
+    const float* vii = &vdia[iblk*9];
+    vec[iblk*3+0] = vii[0]*t0+vii[1]*t1+vii[2]*t2;
+    vec[iblk*3+1] = vii[3]*t0+vii[4]*t1+vii[5]*t2;
+    vec[iblk*3+2] = vii[6]*t0+vii[7]*t1+vii[8]*t2;
+  }
+}
+
+// floatの3x3ブロックの後退代入
+static void BackwardSubstitutionFloat_Block3
+(std::vector<double>& vec,
+ ////
+ const CMatrixSquareSparse& mat,
+ const int* diaInd)
+{
+  const int* colind = mat.m_colInd;
+  const int* rowptr = mat.m_rowPtr;
+  const float* vcrs = mat.m_aValCrsF.empty() ? 0 : &mat.m_aValCrsF[0];
+  for(int iblk=mat.m_nblk-1;iblk>=0;iblk--){
+    double t0 = vec[iblk*3+0];
+    double t1 = vec[iblk*3+1];
+    double t2 = vec[iblk*3+2];
+    for(int ijcrs=diaInd[iblk];ijcrs<colind[iblk+1];ijcrs++){
+      const int jblk0 = rowptr[ijcrs];
+      assert( jblk0>iblk );
+      const float* vij = &vcrs[ijcrs*9];
+      const double valj0 = vec[jblk0*3+0];
+      const double valj1 = vec[jblk0*3+1];
+      const double valj2 = vec[jblk0*3+2];
+      t0 -= vij[0]*valj0+vij[1]*valj1+vij[2]*valj2;
+      t1 -= vij[3]*valj0+vij[4]*valj1+vij[5]*valj2;
+      t2 -= vij[6]*valj0+vij[7]*valj1+vij[8]*valj2;
+    }
+    vec[iblk*3+0] = t0;
+    vec[iblk*3+1] = t1;
+    vec[iblk*3+2] = t2;
+  }
+}
+
 void CPreconditionerILU::ForwardSubstitution( std::vector<double>& vec ) const
 {
   const int len = mat.m_len;
   const int nblk = mat.m_nblk;
   
+  if( m_is_float ){
+    assert( len == 3 && mat.m_is_value_float );
+    if( GetBlock3Kernel() == BLOCK3_KERNEL_AVX2 ){ ForwardSubstitutionFloat_Block3_AVX2(vec, mat,m_diaInd); }
+    else{                                          ForwardSubstitutionFloat_Block3(     vec, mat,m_diaInd); }
+    return;
+  }
+  
 	if( len == 1 ){
 		const int* colind = mat.m_colInd;
 		const int* rowptr = mat.m_rowPtr;
@@ -183,6 +279,10 @@ void CPreconditionerILU::ForwardSubstitution( std::vector<double>& vec ) const
 		}
 	}
 	else if( len == 3 ){
+    if( GetBlock3Kernel() == BLOCK3_KERNEL_AVX2 ){
+      ForwardSubstitution_Block3_AVX2(vec, mat,m_diaInd);
+      return;
+    }
 		const int* colind = mat.m_colInd;
 		const int* rowptr = mat.m_rowPtr;
 		const double* vcrs = mat.m_valCrs;
@@ -248,6 +348,13 @@ void CPreconditionerILU::BackwardSubstitution( std::vector<double>& vec ) const
 {
   const int len = mat.m_len;
   const int nblk = mat.m_nblk;
+  
+  if( m_is_float ){
+    assert( len == 3 && mat.m_is_value_float );
+    if( GetBlock3Kernel() == BLOCK3_KERNEL_AVX2 ){ BackwardSubstitutionFloat_Block3_AVX2(vec, mat,m_diaInd); }
+    else{                                          BackwardSubstitutionFloat_Block3(     vec, mat,m_diaInd); }
+    return;
+  }
 
 	if( len == 1 ){
 		const int* colind = mat.m_colInd;
@@ -293,6 +400,10 @@ void CPreconditionerILU::BackwardSubstitution( std::vector<double>& vec ) const
 		}
 	}
 	else if( len == 3 ){
+    if( GetBlock3Kernel() == BLOCK3_KERNEL_AVX2 ){
+      BackwardSubstitution_Block3_AVX2(vec, mat,m_diaInd);
+      return;
+    }
     const int* colind = mat.m_colInd;
 		const int* rowptr = mat.m_rowPtr;
 		const double* vcrs = mat.m_valCrs;
@@ -380,11 +491,37 @@ void CPreconditionerILU::SetValueILU(const CMatrixSquareSparse& m)
       row2crs[jblk0] = -1;
     }
   }
+  if( m.m_is_sym ){
+    // 下三角のブロックは上三角のブロックの転置
+    for(int iblk=0;iblk<nblk;iblk++){
+      for(int ijcrs=m.m_colInd[iblk];ijcrs<m.m_colInd[iblk+1];ijcrs++){
+        const int jblk0 = m.m_rowPtr[ijcrs];
+        for(int jicrs=mat.m_colInd[jblk0];jicrs<m_diaInd[jblk0];jicrs++){
+          if( mat.m_rowPtr[jicrs] != iblk ) continue;
+          const double* pval_in = &m.m_valCrs[ijcrs*blksize];
+          double* pval_out = &mat.m_valCrs[jicrs*blksize];
+          for(int idof=0;idof<len;idof++){
+          for(int jdof=0;jdof<len;jdof++){
+            pval_out[jdof*len+idof] = pval_in[idof*len+jdof];
+          }
+          }
+          break;
+        }
+      }
+    }
+  }
   for(int i=0;i<nblk*blksize;i++){ mat.m_valDia[i] = m.m_valDia[i]; }
+  mat.m_is_value_float = false; // DoILUDecompで作り直す
 }
 
 // numerical factorization
 void CPreconditionerILU::DoILUDecomp()
+{
+  this->DoILUDecomp_Double();
+  if( m_is_float ){ mat.SetValueFloat(); }
+}
+
+void CPreconditionerILU::DoILUDecomp_Double()
 {
   const int nmax_sing = 10;
 	int icnt_sing = 0;
@@ -625,13 +762,15 @@ void CPreconditionerILU::DoILUDecomp()
 
 
 
-void Solve_PCG
+// is_float_matがtrueなら行列のfloatの複製でMatVecをする
+static void Solve_PCG_Precision
 (double& conv_ratio,
  int& iteration,
  const CMatrixSquareSparse& mat,
  const CPreconditionerILU& ilu,
  std::vector<double>& r_vec,
- std::vector<double>& x_vec)
+ std::vector<double>& x_vec,
+ bool is_float_mat)
 {
 	const double conv_ratio_tol = conv_ratio;
 	const int mx_iter = iteration;
@@ -669,7 +808,8 @@ void Solve_PCG
 		{
       std::vector<double>& Ap_vec = Pr_vec;      
       // {Ap} = [A]{p}
-			mat.MatVec(1.0,p_vec,0.0,Ap_vec);
+      if( is_float_mat ){ mat.MatVecFloat(1.0,p_vec,0.0,Ap_vec); }
+      else{               mat.MatVec(     1.0,p_vec,0.0,Ap_vec); }
       // alpha = ({r},{Pr})/({p},{Ap})
 			const double pAp = InnerProduct(p_vec,Ap_vec);
 			double alpha = rPr / pAp;
@@ -708,3 +848,57 @@ void Solve_PCG
   return;
 }
 
+void Solve_PCG
+(double& conv_ratio,
+ int& iteration,
+ const CMatrixSquareSparse& mat,
+ const CPreconditionerILU& ilu,
+ std::vector<double>& r_vec,
+ std::vector<double>& x_vec)
+{
+  Solve_PCG_Precision(conv_ratio,iteration, mat,ilu, r_vec,x_vec, false);
+}
+
+// floatの行列で一回に下げる残差の比の下限と,反復改良の最大の回数
+static const double CONV_RATIO_FLOAT_MIN = 1.0e-6;
+static const int NREFINE_MAX = 5;
+
+void Solve_PCG_Mixed
+(double& conv_ratio,
+ int& iteration,
+ const CMatrixSquareSparse& mat,
+ const CPreconditionerILU& ilu,
+ std::vector<double>& r_vec,
+ std::vector<double>& x_vec)
+{
+	const double conv_ratio_tol = conv_ratio;
+	const int mx_iter = iteration;
+  const int ndof = mat.m_nblk*mat.m_len;
+  assert( (int)r_vec.size() == ndof );
+  
+  x_vec.assign(ndof,0.0);
+  const double sqnorm_res0 = InnerProduct(r_vec,r_vec);
+  if( sqnorm_res0 < 1.0e-30 ){
+    conv_ratio = 0.0;
+    iteration = 0;
+    return;
+  }
+  const std::vector<double> b_vec = r_vec;
+  std::vector<double> dx_vec;
+  iteration = 0;
+  for(int iref=0;iref<NREFINE_MAX;iref++){
+    // 全体でconv_ratio_tolになるように今の残差を下げる
+    const double sqnorm_res = InnerProduct(r_vec,r_vec);
+    double conv_ratio_inner = conv_ratio_tol*sqrt(sqnorm_res0/sqnorm_res);
+    if( conv_ratio_inner < CONV_RATIO_FLOAT_MIN ){ conv_ratio_inner = CONV_RATIO_FLOAT_MIN; }
+    int iteration_inner = mx_iter-iteration;
+    Solve_PCG_Precision(conv_ratio_inner,iteration_inner, mat,ilu, r_vec,dx_vec, true);
+    iteration += iteration_inner;
+    AXPY(1.0,dx_vec,x_vec);
+    // {r} = {b} - [A]{x} をdoubleの行列で計算し直す
+    r_vec = b_vec;
+    mat.MatVec(-1.0,x_vec,1.0,r_vec);
+    conv_ratio = sqrt( InnerProduct(r_vec,r_vec) / sqnorm_res0 );
+    if( conv_ratio < conv_ratio_tol || iteration >= mx_iter ) return;
+  }
+}
@@ -25,12 +25,19 @@ public:
 		this->BackwardSubstitution(vec);
   }
   void DoILUDecomp();
+  // trueなら分解した値のfloatの複製で前進・後退代入をする(3x3ブロックのみ)．分解はdoubleで行う．
+  // doubleの分解の値も次のSetValueILUまで残すので,メモリはfloatの複製の分(doubleの約半分)だけ増える．
+  // 減るのは反復ごとに読む量だけ
+  void SetPrecisionFloat(bool is_float){ m_is_float = is_float; }
+  bool IsPrecisionFloat() const { return m_is_float; }
 private:
+  void DoILUDecomp_Double();
   void ForwardSubstitution(  std::vector<double>& vec ) const;
   void BackwardSubstitution( std::vector<double>& vec ) const;
 public:
   CMatrixSquareSparse mat;
   int* m_diaInd;
+  bool m_is_float;
 };
 
 
@@ -42,4 +49,14 @@ void Solve_PCG
  std::vector<double>& r_vec,
  std::vector<double>& u_vec);
 
+// 混合精度のPCG．反復は行列のfloatの複製(mat.SetValueFloat)で行い,残差と内積はdoubleでとる．
+// 収束したらdoubleの行列で残差を計算し直し,足りなければそこから反復し直す(反復改良)
+void Solve_PCG_Mixed
+(double& conv_ratio,
+ int& iteration,
+ const CMatrixSquareSparse& mat,
+ const CPreconditionerILU& ilu,
+ std::vector<double>& r_vec,
+ std::vector<double>& u_vec);
+
 #endif /* defined(__internal_cloth_sparse__ilu_sparse__) */
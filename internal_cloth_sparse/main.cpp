@@ -156,6 +156,7 @@ double mass_point; // mass for a point，頂点あたりの質量
 // 疎行列ソルバのための変数
 CMatrixSquareSparse mat_A; // 係数行列クラス
 CPreconditionerILU  ilu_A; // 係数行列をILU分解したデータを格納するクラス
+std::vector<int> aMapTri, aMapQuad; // 要素行列を係数行列に足し込む先の表
 
 std::vector<double> aNormal; // deformed vertex noamals，変形中の頂点の法線(可視化用)
 
@@ -219,6 +220,7 @@ void StepTime()
    StepTime_InternalDynamics(aXYZ, aUVW, mat_A,
    aXYZ0, aBCFlag,
    aTri, aQuad,
+   aMapTri, aMapQuad,
    time_step_size,
    lambda, myu, stiff_bend,
    gravity, mass_point,
@@ -229,6 +231,7 @@ void StepTime()
   StepTime_InternalDynamicsILU(aXYZ, aUVW, mat_A, ilu_A,
                                aXYZ0, aBCFlag,
                                aTri, aQuad,
+                               aMapTri, aMapQuad,
                                time_step_size,
                                lambda, myu, stiff_bend,
                                gravity, mass_point,
@@ -545,8 +548,11 @@ int main(int argc,char* argv[])
     CJaggedArray crs;
     crs.SetEdgeOfElem(aQuad, (int)aQuad.size()/4, 4, np, false);
     crs.Sort();
-    mat_A.SetPattern(crs.index, crs.array);  // 係数行列の非ゼロパターンを指定
+    mat_A.SetPatternSymmetric(crs.index, crs.array);  // 係数行列の非ゼロパターンを指定(対称なので上三角だけ)
+    mat_A.MakeMeargeMap(aMapTri, 3,aTri); // パターンが決まったので足し込む先を求めておく
+    mat_A.MakeMeargeMap(aMapQuad,4,aQuad);
     ilu_A.Initialize_ILU0(mat_A); // ILU前処理行列に，係数行列の非ゼロパターンを設定
+    ilu_A.SetPrecisionFloat(true); // 前進・後退代入と係数行列の積をfloatの複製で行う(混合精度のPCG)
   }
   
   
@@ -16,8 +16,15 @@
 #include <cassert>
 #include <math.h>
 #include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "matrix_square_sparse.h"
+#include "block3_avx2.h"
+
+// 並列MatVecの1区間あたりの最小のブロック数(非ゼロ+対角)
+static const int NBLK_PART_MIN = 4096;
 
 
 CMatrixSquareSparse::CMatrixSquareSparse()
@@ -31,6 +38,9 @@ CMatrixSquareSparse::CMatrixSquareSparse()
   
 	m_valCrs = 0;
 	m_valDia = 0;
+  
+  m_is_sym = false;
+  m_is_value_float = false;
 }
 
 CMatrixSquareSparse::~CMatrixSquareSparse()
@@ -55,6 +65,12 @@ void CMatrixSquareSparse::Initialize(int nblk, int len)
   ////  
 	if( m_rowPtr != 0 ){ delete[] m_rowPtr; m_rowPtr = 0; }
 	if( m_valCrs != 0 ){ delete[] m_valCrs; m_valCrs = 0; }  
+  m_is_sym = false;
+  m_aPartBlk.clear();
+  m_aPartSpill.clear();
+  m_aValCrsF.clear();
+  m_aValDiaF.clear();
+  m_is_value_float = false;
 }
 
 void CMatrixSquareSparse::operator = (const CMatrixSquareSparse& m)
@@ -75,13 +91,41 @@ void CMatrixSquareSparse::operator = (const CMatrixSquareSparse& m)
   for(int i=0;i<m_ncrs;        i++){ m_rowPtr[i] = m.m_rowPtr[i]; }
   for(int i=0;i<m_nblk*blksize;i++){ m_valDia[i] = m.m_valDia[i]; }
   for(int i=0;i<m_ncrs*blksize;i++){ m_valCrs[i] = m.m_valCrs[i]; }
+  m_is_sym = m.m_is_sym;
+  m_aPartBlk = m.m_aPartBlk;
+  m_aPartSpill = m.m_aPartSpill;
+  m_aSpill.resize(m.m_aSpill.size());
+  m_aValCrsF = m.m_aValCrsF;
+  m_aValDiaF = m.m_aValDiaF;
+  m_is_value_float = m.m_is_value_float;
 }
 
 
 bool CMatrixSquareSparse::SetZero()
 {
-	for(int i=0;i<m_len*m_len*m_nblk;i++){ m_valDia[i] = 0.0; }
-  for(int i=0;i<m_len*m_len*m_ncrs;i++){ m_valCrs[i] = 0.0; }
+  m_is_value_float = false;
+  const int blksize = m_len*m_len;
+  const int npart = (int)m_aPartBlk.size()-1;
+  if( npart <= 1 ){
+    for(int i=0;i<blksize*m_nblk;i++){ m_valDia[i] = 0.0; }
+    for(int i=0;i<blksize*m_ncrs;i++){ m_valCrs[i] = 0.0; }
+    return true;
+  }
+  // MatVecと同じ区間を同じスレッドが触る
+#pragma omp parallel num_threads(npart)
+  {
+    int ith = 0, nth = 1;
+#ifdef _OPENMP
+    ith = omp_get_thread_num();
+    nth = omp_get_num_threads();
+#endif
+    for(int ipart=ith;ipart<npart;ipart+=nth){
+      const int iblk0 = m_aPartBlk[ipart];
+      const int iblk1 = m_aPartBlk[ipart+1];
+      for(int i=iblk0*blksize;i<iblk1*blksize;i++){ m_valDia[i] = 0.0; }
+      for(int i=m_colInd[iblk0]*blksize;i<m_colInd[iblk1]*blksize;i++){ m_valCrs[i] = 0.0; }
+    }
+  }
 	return true;
 }
 
@@ -97,6 +141,8 @@ bool CMatrixSquareSparse::Mearge
 
 	assert( nblkel_col == nblkel_row );
   assert( blksize == m_len*m_len );
+  m_is_value_float = false;
+  // 対称のときは下三角のブロックがパターンに無いので,下のmarge_bufferが-1になり飛ばされる
 
 	const int* colind = m_colInd;
 	const int* rowptr = m_rowPtr;
@@ -137,6 +183,58 @@ bool CMatrixSquareSparse::Mearge
 	return true;
 }
 
+void CMatrixSquareSparse::MakeMeargeMap
+(std::vector<int>& aMap,
+ ////
+ int nnoel, const std::vector<int>& aElem) const
+{
+  assert( m_colInd != 0 );
+  const int nelem = (int)aElem.size()/nnoel;
+  aMap.assign(nelem*nnoel*nnoel,-1);
+  std::vector<int> marge_buffer(m_nblk,-1);
+  for(int ielem=0;ielem<nelem;ielem++){
+    const int* blkel = &aElem[ielem*nnoel];
+    int* map = &aMap[ielem*nnoel*nnoel];
+    for(int iblkel=0;iblkel<nnoel;iblkel++){
+      const int iblk1 = blkel[iblkel];
+      assert( iblk1 >= 0 && iblk1 < m_nblk );
+      for(int jpsup=m_colInd[iblk1];jpsup<m_colInd[iblk1+1];jpsup++){
+        marge_buffer[ m_rowPtr[jpsup] ] = jpsup;
+      }
+      for(int jblkel=0;jblkel<nnoel;jblkel++){
+        if( iblkel == jblkel ) continue;
+        map[iblkel*nnoel+jblkel] = marge_buffer[ blkel[jblkel] ];
+      }
+      for(int jpsup=m_colInd[iblk1];jpsup<m_colInd[iblk1+1];jpsup++){
+        marge_buffer[ m_rowPtr[jpsup] ] = -1;
+      }
+    }
+  }
+}
+
+void CMatrixSquareSparse::MeargeMap
+(int nblkel, const int* blkel, const int* map,
+ int blksize, const double* emat)
+{
+  assert( blksize == m_len*m_len );
+  m_is_value_float = false;
+  for(int iblkel=0;iblkel<nblkel;iblkel++){
+    for(int jblkel=0;jblkel<nblkel;jblkel++){
+      const double* pval_in = &emat[(iblkel*nblkel+jblkel)*blksize];
+      double* pval_out;
+      if( iblkel == jblkel ){ pval_out = &m_valDia[blkel[iblkel]*blksize]; }
+      else{
+        const int jpsup1 = map[iblkel*nblkel+jblkel];
+        if( jpsup1 == -1 ) continue;
+        assert( jpsup1 >= 0 && jpsup1 < m_ncrs );
+        assert( m_rowPtr[jpsup1] == blkel[jblkel] );
+        pval_out = &m_valCrs[jpsup1*blksize];
+      }
+      for(int i=0;i<blksize;i++){ pval_out[i] += pval_in[i]; }
+    }
+  }
+}
+
 void CMatrixSquareSparse::SetPattern
 (const std::vector<int>& colind,
  const std::vector<int>& rowptr)
@@ -160,6 +258,88 @@ void CMatrixSquareSparse::SetPattern
   
   const int blksize = m_len*m_len;
   m_valCrs = new double [m_ncrs*blksize];
+  
+  this->MakePartition();
+  this->SetZero(); // m_valCrsのページを使うスレッドで最初に触る
+}
+
+void CMatrixSquareSparse::SetPatternSymmetric
+(const std::vector<int>& colind,
+ const std::vector<int>& rowptr)
+{
+  assert( (int)colind.size() == m_nblk+1 );
+  std::vector<int> colind_u(m_nblk+1,0);
+  std::vector<int> rowptr_u;
+  rowptr_u.reserve(colind[m_nblk]/2);
+  for(int iblk=0;iblk<m_nblk;iblk++){
+    for(int icrs=colind[iblk];icrs<colind[iblk+1];icrs++){
+      if( rowptr[icrs] > iblk ){ rowptr_u.push_back(rowptr[icrs]); }
+    }
+    colind_u[iblk+1] = (int)rowptr_u.size();
+  }
+  m_is_sym = true;
+  this->SetPattern(colind_u,rowptr_u);
+}
+
+// 行ブロックを非ゼロブロック数(対角を含む)がほぼ均等になるようにスレッド数に分割する
+void CMatrixSquareSparse::MakePartition()
+{
+  const int nweight = m_ncrs+m_nblk;
+#ifdef _OPENMP
+  int npart = omp_get_max_threads();
+#else
+  int npart = 1;
+#endif
+  if( npart > nweight/NBLK_PART_MIN ){ npart = nweight/NBLK_PART_MIN; }
+  if( npart < 1 ){ npart = 1; }
+  m_aPartBlk.resize(npart+1);
+  m_aPartBlk[0] = 0;
+  int iblk = 0;
+  for(int ipart=1;ipart<npart;ipart++){
+    const long long iweight = (long long)nweight*ipart/npart;
+    while( iblk < m_nblk && m_colInd[iblk]+iblk < iweight ){ iblk++; }
+    m_aPartBlk[ipart] = iblk;
+  }
+  m_aPartBlk[npart] = m_nblk;
+  ////
+  // 対称のとき,区間の上三角ブロックの転置は区間の後ろの行にも足される．
+  // その行は別のスレッドのものなので,区間の終わりから最大の列までの寄与をm_aSpillにためる
+  m_aPartSpill.assign(npart+1,0);
+  if( m_is_sym ){
+    for(int ipart=0;ipart<npart;ipart++){
+      const int iblk1 = m_aPartBlk[ipart+1];
+      int jblk_max = iblk1;
+      for(int icrs=m_colInd[m_aPartBlk[ipart]];icrs<m_colInd[iblk1];icrs++){
+        if( m_rowPtr[icrs]+1 > jblk_max ){ jblk_max = m_rowPtr[icrs]+1; }
+      }
+      m_aPartSpill[ipart+1] = m_aPartSpill[ipart] + (jblk_max-iblk1)*m_len;
+    }
+  }
+  m_aSpill.resize(m_aPartSpill[npart]);
+}
+
+void CMatrixSquareSparse::SetValueFloat()
+{
+  assert( m_len == 3 );
+  const int blksize = m_len*m_len;
+  m_aValCrsF.resize(m_ncrs*blksize);
+  m_aValDiaF.resize(m_nblk*blksize);
+  const int npart = (int)m_aPartBlk.size()-1;
+#pragma omp parallel num_threads(npart) if( npart > 1 )
+  {
+    int ith = 0, nth = 1;
+#ifdef _OPENMP
+    ith = omp_get_thread_num();
+    nth = omp_get_num_threads();
+#endif
+    for(int ipart=ith;ipart<npart;ipart+=nth){
+      const int iblk0 = m_aPartBlk[ipart];
+      const int iblk1 = m_aPartBlk[ipart+1];
+      for(int i=iblk0*blksize;i<iblk1*blksize;i++){ m_aValDiaF[i] = (float)m_valDia[i]; }
+      for(int i=m_colInd[iblk0]*blksize;i<m_colInd[iblk1]*blksize;i++){ m_aValCrsF[i] = (float)m_valCrs[i]; }
+    }
+  }
+  m_is_value_float = true;
 }
 
 // Calc Matrix Vector Product
@@ -169,8 +349,133 @@ void CMatrixSquareSparse::MatVec
  const std::vector<double>& x,
  double beta,
  std::vector<double>& y) const
+{
+  this->MatVec_Precision(alpha,x,beta,y, false);
+}
+
+void CMatrixSquareSparse::MatVecFloat
+(double alpha,
+ const std::vector<double>& x,
+ double beta,
+ std::vector<double>& y) const
+{
+  assert( m_len == 3 && (int)m_aValDiaF.size() == m_nblk*9 );
+  assert( m_is_value_float ); // 値を変えた後にSetValueFloatを呼んでいない
+  this->MatVec_Precision(alpha,x,beta,y, true);
+}
+
+void CMatrixSquareSparse::MatVec_Precision
+(double alpha,
+ const std::vector<double>& x,
+ double beta,
+ std::vector<double>& y,
+ bool is_float) const
+{
+  const int npart = (int)m_aPartBlk.size()-1;
+  if( m_is_sym ){
+    if( npart <= 1 ){
+      this->MatVecSym_Part(alpha,x,beta,y, 0, is_float);
+      return;
+    }
+#pragma omp parallel num_threads(npart)
+    {
+      int ith = 0, nth = 1;
+#ifdef _OPENMP
+      ith = omp_get_thread_num();
+      nth = omp_get_num_threads();
+#endif
+      for(int ipart=ith;ipart<npart;ipart+=nth){
+        this->MatVecSym_Part(alpha,x,beta,y, ipart, is_float);
+      }
+#pragma omp barrier
+      // 前の区間がためた寄与を自分の区間の行に足す
+      for(int ipart=ith;ipart<npart;ipart+=nth){
+        const int iblk0 = m_aPartBlk[ipart];
+        const int iblk1 = m_aPartBlk[ipart+1];
+        for(int jpart=0;jpart<ipart;jpart++){
+          const int jblk1 = m_aPartBlk[jpart+1]; // ためた場所の先頭の行
+          const int jblk2 = jblk1 + (m_aPartSpill[jpart+1]-m_aPartSpill[jpart])/m_len;
+          const int kblk0 = ( iblk0 > jblk1 ) ? iblk0 : jblk1;
+          const int kblk1 = ( iblk1 < jblk2 ) ? iblk1 : jblk2;
+          if( kblk0 >= kblk1 ) continue;
+          const double* spill = &m_aSpill[m_aPartSpill[jpart]];
+          for(int i=kblk0*m_len;i<kblk1*m_len;i++){ y[i] += spill[i-jblk1*m_len]; }
+        }
+      }
+    }
+    return;
+  }
+  if( npart <= 1 ){
+    this->MatVec_Range(alpha,x,beta,y, 0,m_nblk, is_float);
+    return;
+  }
+  // 区間iはスレッドiが受け持つ (SetZeroでのfirst-touchと同じ割り当て)
+  // ("#define for"があるのでparallel forは使えない)
+#pragma omp parallel num_threads(npart)
+  {
+    int ith = 0, nth = 1;
+#ifdef _OPENMP
+    ith = omp_get_thread_num();
+    nth = omp_get_num_threads();
+#endif
+    for(int ipart=ith;ipart<npart;ipart+=nth){
+      this->MatVec_Range(alpha,x,beta,y, m_aPartBlk[ipart],m_aPartBlk[ipart+1], is_float);
+    }
+  }
+}
+
+// floatの3x3ブロックの行ブロック[iblk0,iblk1)についての {y} = alpha*[A]{x} + beta*{y}
+static void MatVecFloat_Block3
+(std::vector<double>& y,
+ ////
+ double alpha,
+ const std::vector<double>& x,
+ double beta,
+ const CMatrixSquareSparse& mat,
+ int iblk0, int iblk1)
+{
+  const int* colind = mat.m_colInd;
+  const int* rowptr = mat.m_rowPtr;
+  const float* vcrs = mat.m_aValCrsF.empty() ? 0 : &mat.m_aValCrsF[0];
+  const float* vdia = &mat.m_aValDiaF[0];
+  for(int iblk=iblk0;iblk<iblk1;iblk++){
+    const float* vii = &vdia[iblk*9];
+    double yi0 = vii[0]*x[iblk*3+0] + vii[1]*x[iblk*3+1] + vii[2]*x[iblk*3+2];
+    double yi1 = vii[3]*x[iblk*3+0] + vii[4]*x[iblk*3+1] + vii[5]*x[iblk*3+2];
+    double yi2 = vii[6]*x[iblk*3+0] + vii[7]*x[iblk*3+1] + vii[8]*x[iblk*3+2];
+    for(int icrs=colind[iblk];icrs<colind[iblk+1];icrs++){
+      const int jblk0 = rowptr[icrs];
+      const float* vij = &vcrs[icrs*9];
+      yi0 += vij[0]*x[jblk0*3+0] + vij[1]*x[jblk0*3+1] + vij[2]*x[jblk0*3+2];
+      yi1 += vij[3]*x[jblk0*3+0] + vij[4]*x[jblk0*3+1] + vij[5]*x[jblk0*3+2];
+      yi2 += vij[6]*x[jblk0*3+0] + vij[7]*x[jblk0*3+1] + vij[8]*x[jblk0*3+2];
+    }
+    y[iblk*3+0] = beta*y[iblk*3+0] + alpha*yi0;
+    y[iblk*3+1] = beta*y[iblk*3+1] + alpha*yi1;
+    y[iblk*3+2] = beta*y[iblk*3+2] + alpha*yi2;
+  }
+}
+
+// 行ブロック[iblk0,iblk1)についての {y} = alpha*[A]{x} + beta*{y}
+void CMatrixSquareSparse::MatVec_Range
+(double alpha,
+ const std::vector<double>& x,
+ double beta,
+ std::vector<double>& y,
+ int iblk0, int iblk1,
+ bool is_float) const
 {
 	const int blksize = m_len*m_len;
+  
+  if( is_float ){
+    if( GetBlock3Kernel() == BLOCK3_KERNEL_AVX2 ){
+      MatVecFloat_Block3_AVX2(y, alpha,x,beta, *this, iblk0,iblk1);
+    }
+    else{
+      MatVecFloat_Block3(y, alpha,x,beta, *this, iblk0,iblk1);
+    }
+    return;
+  }
 
 	if( m_len == 1 ){
 		const double* vcrs  = m_valCrs;
@@ -178,7 +483,7 @@ void CMatrixSquareSparse::MatVec
 		const int* colind = m_colInd;
 		const int* rowptr = m_rowPtr;
 		////////////////
-		for(int iblk=0;iblk<m_nblk;iblk++){
+		for(int iblk=iblk0;iblk<iblk1;iblk++){
 			double& vy = y[iblk];
 			vy *= beta;
 			const int colind0 = colind[iblk];
@@ -197,9 +502,8 @@ void CMatrixSquareSparse::MatVec
 		const double* vdia = m_valDia;
 		const int* colind = m_colInd;
 		const int* rowptr = m_rowPtr;
-    const int nblk = m_nblk;    
 		////////////////
-		for(int iblk=0;iblk<nblk;iblk++){
+		for(int iblk=iblk0;iblk<iblk1;iblk++){
 			y[iblk*2+0] *= beta;
 			y[iblk*2+1] *= beta;
 			const int icrs0 = colind[iblk];
@@ -207,21 +511,25 @@ void CMatrixSquareSparse::MatVec
 			for(int icrs=icrs0;icrs<icrs1;icrs++){
 				assert( icrs < m_ncrs );
 				const int jblk0 = rowptr[icrs];
-				assert( jblk0 < nblk );
+				assert( jblk0 < m_nblk );
 				y[iblk*2+0] += alpha * ( vcrs[icrs*4  ]*x[jblk0*2+0] + vcrs[icrs*4+1]*x[jblk0*2+1] );
 				y[iblk*2+1] += alpha * ( vcrs[icrs*4+2]*x[jblk0*2+0] + vcrs[icrs*4+3]*x[jblk0*2+1] );
 			}
 			y[iblk*2+0] += alpha * ( vdia[iblk*4  ]*x[iblk*2+0] + vdia[iblk*4+1]*x[iblk*2+1] );
-			y[iblk+2*1] += alpha * ( vdia[iblk*4+2]*x[iblk*2+0] + vdia[iblk*4+3]*x[iblk*2+1] );
+			y[iblk*2+1] += alpha * ( vdia[iblk*4+2]*x[iblk*2+0] + vdia[iblk*4+3]*x[iblk*2+1] );
 		}
 	}
 	else if( m_len == 3 ){
+    if( GetBlock3Kernel() == BLOCK3_KERNEL_AVX2 ){
+      MatVec_Block3_AVX2(y, alpha,x,beta, *this, iblk0,iblk1);
+      return;
+    }
 		const double* vcrs  = m_valCrs;
 		const double* vdia = m_valDia;
 		const int* colind = m_colInd;
 		const int* rowptr = m_rowPtr;
 		////////////////
-		for(int iblk=0;iblk<m_nblk;iblk++){
+		for(int iblk=iblk0;iblk<iblk1;iblk++){
 			y[iblk*3+0] *= beta;
 			y[iblk*3+1] *= beta;
 			y[iblk*3+2] *= beta;
@@ -246,7 +554,7 @@ void CMatrixSquareSparse::MatVec
 		const int* colind = m_colInd;
 		const int* rowptr = m_rowPtr;
 		////////////////
-		for(int iblk=0;iblk<m_nblk;iblk++){
+		for(int iblk=iblk0;iblk<iblk1;iblk++){
 			for(int idof=0;idof<m_len;idof++){ y[iblk*m_len+idof] *= beta; }
 			const int colind0 = colind[iblk];
 			const int colind1 = colind[iblk+1];
@@ -269,10 +577,139 @@ void CMatrixSquareSparse::MatVec
 	}
 }
 
+// floatの3x3ブロックの対称な行列の行ブロック[iblk0,iblk1)についての {y} += alpha*[A]{x}
+static void MatVecSymFloat_Block3
+(std::vector<double>& y,
+ double* spill,
+ ////
+ double alpha,
+ const std::vector<double>& x,
+ const CMatrixSquareSparse& mat,
+ int iblk0, int iblk1)
+{
+  const int* colind = mat.m_colInd;
+  const int* rowptr = mat.m_rowPtr;
+  const float* vcrs = mat.m_aValCrsF.empty() ? 0 : &mat.m_aValCrsF[0];
+  const float* vdia = &mat.m_aValDiaF[0];
+  for(int iblk=iblk0;iblk<iblk1;iblk++){
+    const double xi0 = x[iblk*3+0];
+    const double xi1 = x[iblk*3+1];
+    const double xi2 = x[iblk*3+2];
+    const float* vii = &vdia[iblk*9];
+    double yi0 = vii[0]*xi0 + vii[1]*xi1 + vii[2]*xi2;
+    double yi1 = vii[3]*xi0 + vii[4]*xi1 + vii[5]*xi2;
+    double yi2 = vii[6]*xi0 + vii[7]*xi1 + vii[8]*xi2;
+    for(int icrs=colind[iblk];icrs<colind[iblk+1];icrs++){
+      const int jblk0 = rowptr[icrs];
+      const float* vij = &vcrs[icrs*9];
+      yi0 += vij[0]*x[jblk0*3+0] + vij[1]*x[jblk0*3+1] + vij[2]*x[jblk0*3+2];
+      yi1 += vij[3]*x[jblk0*3+0] + vij[4]*x[jblk0*3+1] + vij[5]*x[jblk0*3+2];
+      yi2 += vij[6]*x[jblk0*3+0] + vij[7]*x[jblk0*3+1] + vij[8]*x[jblk0*3+2];
+      double* yj = ( jblk0 < iblk1 ) ? &y[jblk0*3] : spill+(jblk0-iblk1)*3;
+      yj[0] += alpha * ( vij[0]*xi0 + vij[3]*xi1 + vij[6]*xi2 );
+      yj[1] += alpha * ( vij[1]*xi0 + vij[4]*xi1 + vij[7]*xi2 );
+      yj[2] += alpha * ( vij[2]*xi0 + vij[5]*xi1 + vij[8]*xi2 );
+    }
+    y[iblk*3+0] += alpha*yi0;
+    y[iblk*3+1] += alpha*yi1;
+    y[iblk*3+2] += alpha*yi2;
+  }
+}
+
+// 対称な行列の区間ipartの行ブロック[iblk0,iblk1)についての {y} = alpha*[A]{x} + beta*{y}．
+// 上三角ブロックの転置の寄与のうちiblk1以降の行へのものはspill(先頭がiblk1行目)にためる
+void CMatrixSquareSparse::MatVecSym_Part
+(double alpha,
+ const std::vector<double>& x,
+ double beta,
+ std::vector<double>& y,
+ int ipart,
+ bool is_float) const
+{
+  assert( m_is_sym );
+  const int iblk0 = m_aPartBlk[ipart];
+  const int iblk1 = m_aPartBlk[ipart+1];
+  double* spill = 0;
+  if( m_aPartSpill[ipart+1] > m_aPartSpill[ipart] ){
+    spill = &m_aSpill[m_aPartSpill[ipart]];
+    for(int i=m_aPartSpill[ipart];i<m_aPartSpill[ipart+1];i++){ m_aSpill[i] = 0.0; }
+  }
+  // 前の行からの転置の寄与が足される前にbetaを掛けておく
+  for(int i=iblk0*m_len;i<iblk1*m_len;i++){ y[i] *= beta; }
+  if( is_float ){
+    if( GetBlock3Kernel() == BLOCK3_KERNEL_AVX2 ){
+      MatVecSymFloat_Block3_AVX2(y,spill, alpha,x, *this, iblk0,iblk1);
+    }
+    else{
+      MatVecSymFloat_Block3(y,spill, alpha,x, *this, iblk0,iblk1);
+    }
+    return;
+  }
+  if( m_len == 3 ){
+    if( GetBlock3Kernel() == BLOCK3_KERNEL_AVX2 ){
+      MatVecSym_Block3_AVX2(y,spill, alpha,x, *this, iblk0,iblk1);
+      return;
+    }
+		const double* vcrs  = m_valCrs;
+		const double* vdia = m_valDia;
+		const int* colind = m_colInd;
+		const int* rowptr = m_rowPtr;
+		////////////////
+		for(int iblk=iblk0;iblk<iblk1;iblk++){
+      const double xi0 = x[iblk*3+0];
+      const double xi1 = x[iblk*3+1];
+      const double xi2 = x[iblk*3+2];
+      const double* vii = &vdia[iblk*9];
+      double yi0 = vii[0]*xi0 + vii[1]*xi1 + vii[2]*xi2;
+      double yi1 = vii[3]*xi0 + vii[4]*xi1 + vii[5]*xi2;
+      double yi2 = vii[6]*xi0 + vii[7]*xi1 + vii[8]*xi2;
+			for(int icrs=colind[iblk];icrs<colind[iblk+1];icrs++){
+				const int jblk0 = rowptr[icrs];
+				assert( jblk0 > iblk && jblk0 < m_nblk );
+        const double* vij = &vcrs[icrs*9];
+        yi0 += vij[0]*x[jblk0*3+0] + vij[1]*x[jblk0*3+1] + vij[2]*x[jblk0*3+2];
+        yi1 += vij[3]*x[jblk0*3+0] + vij[4]*x[jblk0*3+1] + vij[5]*x[jblk0*3+2];
+        yi2 += vij[6]*x[jblk0*3+0] + vij[7]*x[jblk0*3+1] + vij[8]*x[jblk0*3+2];
+        double* yj = ( jblk0 < iblk1 ) ? &y[jblk0*3] : spill+(jblk0-iblk1)*3;
+        yj[0] += alpha * ( vij[0]*xi0 + vij[3]*xi1 + vij[6]*xi2 );
+        yj[1] += alpha * ( vij[1]*xi0 + vij[4]*xi1 + vij[7]*xi2 );
+        yj[2] += alpha * ( vij[2]*xi0 + vij[5]*xi1 + vij[8]*xi2 );
+			}
+      y[iblk*3+0] += alpha*yi0;
+      y[iblk*3+1] += alpha*yi1;
+      y[iblk*3+2] += alpha*yi2;
+    }
+  }
+  else{
+    const int blksize = m_len*m_len;
+		for(int iblk=iblk0;iblk<iblk1;iblk++){
+			for(int idof=0;idof<m_len;idof++){
+			for(int jdof=0;jdof<m_len;jdof++){
+				y[iblk*m_len+idof] += alpha * m_valDia[iblk*blksize+idof*m_len+jdof] * x[iblk*m_len+jdof];
+			}
+			}
+			for(int icrs=m_colInd[iblk];icrs<m_colInd[iblk+1];icrs++){
+				const int jblk0 = m_rowPtr[icrs];
+				assert( jblk0 > iblk && jblk0 < m_nblk );
+        const double* vij = &m_valCrs[icrs*blksize];
+        double* yj = ( jblk0 < iblk1 ) ? &y[jblk0*m_len] : spill+(jblk0-iblk1)*m_len;
+				for(int idof=0;idof<m_len;idof++){
+				for(int jdof=0;jdof<m_len;jdof++){
+					y[iblk*m_len+idof] += alpha * vij[idof*m_len+jdof] * x[jblk0*m_len+jdof];
+          yj[jdof] += alpha * vij[idof*m_len+jdof] * x[iblk*m_len+idof];
+				}
+				}
+			}
+		}
+  }
+}
+
+// 対称のときも,上三角のブロックのうち行か列が固定されたものを0にすれば両側を0にしたことになる
 void CMatrixSquareSparse::SetBoundaryCondition
 (const std::vector<int>& bc_flag)
 {  
 	const int blksize = m_len*m_len;
+  m_is_value_float = false;
 	
 	for(int iblk=0;iblk<m_nblk;iblk++){
     if( bc_flag[iblk] == 0 ) continue;
@@ -22,19 +22,55 @@ public:
   void Initialize(int nblk, int len);
   void operator = (const CMatrixSquareSparse& m);
   void SetPattern(const std::vector<int>& colind, const std::vector<int>& rowptr);
+  // 対称な行列として上三角(列>行)の非対角ブロックだけを持つ．colind,rowptrは両側を含むパターンでよい
+  void SetPatternSymmetric(const std::vector<int>& colind, const std::vector<int>& rowptr);
 
 	bool SetZero();
 	bool Mearge(int nblkel_col, const int* blkel_col,
               int nblkel_row, const int* blkel_row,
               int blksize, const double* emat,
               std::vector<int>& m_marge_tmp_buffer);
+  // 要素のブロック(i,j)を足し込むm_valCrsのブロック番号の表を全要素について作る(パターンを決めた後に一度だけ)．
+  // 一要素あたりnnoel*nnoel個で，対角とパターンに無いブロック(対称の下三角)は-1
+  void MakeMeargeMap(std::vector<int>& aMap,
+                     ////
+                     int nnoel, const std::vector<int>& aElem) const;
+  // MakeMeargeMapの表(一要素分)を使って探索なしで足し込む
+  void MeargeMap(int nblkel, const int* blkel, const int* map,
+                 int blksize, const double* emat);
   // Calc Matrix Vector Product
   // {y} = alpha * [A]{x} + beta * {y}  
 	void MatVec(double alpha,
               const std::vector<double>& x,
               double beta,
               std::vector<double>& y) const;
+  // 値のfloatの複製を今の値で作り直す(3x3ブロックのみ)．値を変える関数(SetZero,Mearge,MeargeMap,SetBoundaryCondition)の後には呼び直す
+  void SetValueFloat();
+  // floatの複製を使ったMatVec．和はdoubleでとる．複製が古いとassertで止まる
+  void MatVecFloat(double alpha,
+                   const std::vector<double>& x,
+                   double beta,
+                   std::vector<double>& y) const;
   void SetBoundaryCondition(const std::vector<int>& bc_flag);
+private:
+  void MakePartition();
+  void MatVec_Precision(double alpha,
+                        const std::vector<double>& x,
+                        double beta,
+                        std::vector<double>& y,
+                        bool is_float) const;
+  void MatVec_Range(double alpha,
+                    const std::vector<double>& x,
+                    double beta,
+                    std::vector<double>& y,
+                    int iblk0, int iblk1,
+                    bool is_float) const;
+  void MatVecSym_Part(double alpha,
+                      const std::vector<double>& x,
+                      double beta,
+                      std::vector<double>& y,
+                      int ipart,
+                      bool is_float) const;
 public:
 	int m_nblk;
 	int m_len;
@@ -45,6 +81,16 @@ public:
   
 	double* m_valCrs;
 	double* m_valDia;
+  
+  bool m_is_sym; // trueなら上三角の非対角ブロックだけを持つ
+  
+  std::vector<int> m_aPartBlk; // 並列MatVecの行ブロックの区切り (非ゼロ数がほぼ均等)
+  std::vector<int> m_aPartSpill; // 対称のとき,区間の外の行への寄与をためる場所の区切り
+  mutable std::vector<double> m_aSpill;
+  
+  std::vector<float> m_aValCrsF; // m_valCrsのfloatの複製 (SetValueFloatで作る．doubleの値に加えて持つ)
+  std::vector<float> m_aValDiaF; // m_valDiaのfloatの複製
+  bool m_is_value_float; // floatの複製が今の値と同じか (m_valCrs,m_valDiaを直接書き換えたときは自分でfalseにする)
 };
 
 double InnerProduct
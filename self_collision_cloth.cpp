@@ -9,6 +9,7 @@
 
 #include <stack>
 #include <map>
+#include <algorithm>
 
 #include "self_collision_cloth.h"
 #include "vector3d.h"
@@ -16,106 +17,371 @@
 #include "bvh_aabb.h"
 
 
-// 撃力を計算
-void SelfCollisionImpulse_Proximity
-(std::vector<double>& aUVWm, // (in,out)velocity
+// 近接している接触要素の撃力による速度の変化を求める．撃力がなければ偽を返す
+static bool ImpulseContact_Proximity
+(double dv[4][3], // (out)接触要素の4点の速度の変化
+ CContactState& state, // (out)撃力の大きさ,向き,重心座標(撃力がなければ大きさは0)
  ////
+ const CContactElement& ce,
  double delta,
  double stiffness,
  double dt,
  double mass,
  const std::vector<double>& aXYZ,
- const std::vector<int>& aTri,
- const std::vector<CContactElement>& aContactElem)
+ const std::vector<double>& aUVWm)
 {
-  for(int ice=0;ice<aContactElem.size();ice++){
+  state.ce = ce;
+  state.imp = 0;
+  const int ino0 = ce.ino0;
+  const int ino1 = ce.ino1;
+  const int ino2 = ce.ino2;
+  const int ino3 = ce.ino3;
+  CVector3D p0( aXYZ[ ino0*3+0], aXYZ[ ino0*3+1], aXYZ[ ino0*3+2] );
+  CVector3D p1( aXYZ[ ino1*3+0], aXYZ[ ino1*3+1], aXYZ[ ino1*3+2] );
+  CVector3D p2( aXYZ[ ino2*3+0], aXYZ[ ino2*3+1], aXYZ[ ino2*3+2] );
+  CVector3D p3( aXYZ[ ino3*3+0], aXYZ[ ino3*3+1], aXYZ[ ino3*3+2] );
+  CVector3D v0( aUVWm[ino0*3+0], aUVWm[ino0*3+1], aUVWm[ino0*3+2] );
+  CVector3D v1( aUVWm[ino1*3+0], aUVWm[ino1*3+1], aUVWm[ino1*3+2] );
+  CVector3D v2( aUVWm[ino2*3+0], aUVWm[ino2*3+1], aUVWm[ino2*3+2] );
+  CVector3D v3( aUVWm[ino3*3+0], aUVWm[ino3*3+1], aUVWm[ino3*3+2] );
+  if( ce.is_fv ){ // face-vtx      
+    double w0,w1;
+    {
+      double dist = DistanceFaceVertex(p0, p1, p2, p3, w0,w1);
+      if( w0 < 0 || w0 > 1 ) return false;
+      if( w1 < 0 || w1 > 1 ) return false;
+      if( dist > delta ) return false;
+    }
+    double w2 = 1.0 - w0 - w1;
+    CVector3D pc = w0*p0 + w1*p1 + w2*p2;
+    CVector3D norm = p3-pc; norm.SetNormalizedVector();
+    double p_depth = delta - Dot(p3-pc,norm); // penetration depth 
+    double rel_v = Dot(v3-w0*v0-w1*v1-w2*v2,norm);
+    if( rel_v > 0.1*p_depth/dt ) return false;
+    double imp_el = dt*stiffness*p_depth;
+    double imp_ie = mass*(0.1*p_depth/dt-rel_v);
+    double imp_min = ( imp_el < imp_ie ) ? imp_el : imp_ie;
+    double imp_mod = 2*imp_min / (1+w0*w0+w1*w1+w2*w2);
+    imp_mod /= mass;
+    imp_mod *= 0.25;
+    dv[0][0] = -norm.x*imp_mod*w0;
+    dv[0][1] = -norm.y*imp_mod*w0;
+    dv[0][2] = -norm.z*imp_mod*w0;
+    dv[1][0] = -norm.x*imp_mod*w1;
+    dv[1][1] = -norm.y*imp_mod*w1;
+    dv[1][2] = -norm.z*imp_mod*w1;
+    dv[2][0] = -norm.x*imp_mod*w2;
+    dv[2][1] = -norm.y*imp_mod*w2;
+    dv[2][2] = -norm.z*imp_mod*w2;
+    dv[3][0] = +norm.x*imp_mod;
+    dv[3][1] = +norm.y*imp_mod;
+    dv[3][2] = +norm.z*imp_mod;
+    state.imp = imp_mod;
+    state.norm[0] = norm.x;  state.norm[1] = norm.y;  state.norm[2] = norm.z;
+    state.w[0] = w0;  state.w[1] = w1;
+    return true;
+  }
+  else{ // edge-edge
+    double w01,w23;
+    {
+      double dist = DistanceEdgeEdge(p0, p1, p2, p3, w01,w23);
+      if( w01 < 0 || w01 > 1 ) return false;
+      if( w23 < 0 || w23 > 1 ) return false;
+      if( dist > delta ) return false;
+    }
+    CVector3D c01 = (1-w01)*p0 + w01*p1;
+    CVector3D c23 = (1-w23)*p2 + w23*p3;
+    CVector3D norm = (c23-c01); norm.SetNormalizedVector();
+    double p_depth = delta - (c23-c01).Length();
+    double rel_v = Dot((1-w23)*v2+w23*v3-(1-w01)*v0-w01*v1,norm);
+    if( rel_v > 0.1*p_depth/dt ) return false;
+    double imp_el = dt*stiffness*p_depth;
+    double imp_ie = mass*(0.1*p_depth/dt-rel_v);
+    double imp_min = ( imp_el < imp_ie ) ? imp_el : imp_ie;
+    double imp_mod = 2*imp_min / ( w01*w01+(1-w01)*(1-w01) + w23*w23+(1-w23)*(1-w23) );
+    imp_mod /= mass;
+    imp_mod *= 0.25;      
+    dv[0][0] = -norm.x*imp_mod*(1-w01);
+    dv[0][1] = -norm.y*imp_mod*(1-w01);
+    dv[0][2] = -norm.z*imp_mod*(1-w01);
+    dv[1][0] = -norm.x*imp_mod*w01;
+    dv[1][1] = -norm.y*imp_mod*w01;
+    dv[1][2] = -norm.z*imp_mod*w01;
+    dv[2][0] = +norm.x*imp_mod*(1-w23);
+    dv[2][1] = +norm.y*imp_mod*(1-w23);
+    dv[2][2] = +norm.z*imp_mod*(1-w23);
+    dv[3][0] = +norm.x*imp_mod*w23;
+    dv[3][1] = +norm.y*imp_mod*w23;
+    dv[3][2] = +norm.z*imp_mod*w23;
+    state.imp = imp_mod;
+    state.norm[0] = norm.x;  state.norm[1] = norm.y;  state.norm[2] = norm.z;
+    state.w[0] = w01;  state.w[1] = w23;
+    return true;
+  }
+}
+
+
+// CCDで衝突する接触要素の撃力による速度の変化を求める．撃力がなければ偽を返す
+static bool ImpulseContact_CCD
+(double dv[4][3], // (out)接触要素の4点の速度の変化
+ CContactState& state, // (out)撃力の大きさ,向き,重心座標(撃力がなければ大きさは0)
+ ////
+ const CContactElement& ce,
+ double delta,
+ double stiffness,
+ double dt,
+ double mass,
+ const std::vector<double>& aXYZ,
+ const std::vector<double>& aUVWm)
+{
+  state.ce = ce;
+  state.imp = 0;
+  const int ino0 = ce.ino0;
+  const int ino1 = ce.ino1;
+  const int ino2 = ce.ino2;
+  const int ino3 = ce.ino3;
+  CVector3D p0( aXYZ[ ino0*3+0], aXYZ[ ino0*3+1], aXYZ[ ino0*3+2] );
+  CVector3D p1( aXYZ[ ino1*3+0], aXYZ[ ino1*3+1], aXYZ[ ino1*3+2] );
+  CVector3D p2( aXYZ[ ino2*3+0], aXYZ[ ino2*3+1], aXYZ[ ino2*3+2] );
+  CVector3D p3( aXYZ[ ino3*3+0], aXYZ[ ino3*3+1], aXYZ[ ino3*3+2] );
+  CVector3D v0( aUVWm[ino0*3+0], aUVWm[ino0*3+1], aUVWm[ino0*3+2] );
+  CVector3D v1( aUVWm[ino1*3+0], aUVWm[ino1*3+1], aUVWm[ino1*3+2] );
+  CVector3D v2( aUVWm[ino2*3+0], aUVWm[ino2*3+1], aUVWm[ino2*3+2] );
+  CVector3D v3( aUVWm[ino3*3+0], aUVWm[ino3*3+1], aUVWm[ino3*3+2] );    
+  double t = FindCoplanerInterp(p0,p1,p2,p3, p0+v0,p1+v1,p2+v2,p3+v3);
+  if( t < 0 || t > 1 ) return false;
+  if( ce.is_fv ){ // face-vtx
+    double w0,w1;
+    {        
+      CVector3D p0m = p0 + t*v0;
+      CVector3D p1m = p1 + t*v1;
+      CVector3D p2m = p2 + t*v2;
+      CVector3D p3m = p3 + t*v3;
+      double dist = DistanceFaceVertex(p0m, p1m, p2m, p3m, w0,w1);
+      if( w0 < 0 || w0 > 1 ) return false;
+      if( w1 < 0 || w1 > 1 ) return false;
+      if( dist > delta ) return false;
+    }
+    double w2 = 1.0 - w0 - w1;
+    CVector3D pc = w0*p0 + w1*p1 + w2*p2;
+    CVector3D norm = p3 - pc; norm.SetNormalizedVector();
+    double rel_v = Dot(v3-w0*v0-w1*v1-w2*v2,norm); // relative velocity (positive if separating)
+    if( rel_v > 0.1*delta/dt ) return false; // separating
+    double imp = mass*(0.1*delta/dt-rel_v);
+    double imp_mod = 2*imp/(1.0+w0*w0+w1*w1+w2*w2);
+    imp_mod /= mass;
+    imp_mod *= 0.1;
+    dv[0][0] = -norm.x*imp_mod*w0;
+    dv[0][1] = -norm.y*imp_mod*w0;
+    dv[0][2] = -norm.z*imp_mod*w0;
+    dv[1][0] = -norm.x*imp_mod*w1;
+    dv[1][1] = -norm.y*imp_mod*w1;
+    dv[1][2] = -norm.z*imp_mod*w1;
+    dv[2][0] = -norm.x*imp_mod*w2;
+    dv[2][1] = -norm.y*imp_mod*w2;
+    dv[2][2] = -norm.z*imp_mod*w2;
+    dv[3][0] = +norm.x*imp_mod;
+    dv[3][1] = +norm.y*imp_mod;
+    dv[3][2] = +norm.z*imp_mod;
+    state.imp = imp_mod;
+    state.norm[0] = norm.x;  state.norm[1] = norm.y;  state.norm[2] = norm.z;
+    state.w[0] = w0;  state.w[1] = w1;
+    return true;
+  }
+  else{ // edge-edge
+    double w01,w23;
+    {
+      CVector3D p0m = p0 + t*v0;
+      CVector3D p1m = p1 + t*v1;
+      CVector3D p2m = p2 + t*v2;
+      CVector3D p3m = p3 + t*v3;
+      double dist = DistanceEdgeEdge(p0m, p1m, p2m, p3m, w01,w23);
+      if( w01 < 0 || w01 > 1 ) return false;
+      if( w23 < 0 || w23 > 1 ) return false;
+      if( dist > delta ) return false;
+    }      
+    CVector3D c01 = (1-w01)*p0 + w01*p1;
+    CVector3D c23 = (1-w23)*p2 + w23*p3;
+    CVector3D norm = (c23-c01); norm.SetNormalizedVector();
+    double rel_v = Dot((1-w23)*v2+w23*v3-(1-w01)*v0-w01*v1,norm);
+    if( rel_v > 0.1*delta/dt ) return false; // separating
+    double imp = mass*(0.1*delta/dt-rel_v); // reasonable
+    double imp_mod = 2*imp/( w01*w01+(1-w01)*(1-w01) + w23*w23+(1-w23)*(1-w23) );
+    imp_mod /= mass;
+    imp_mod *= 0.1;
+    dv[0][0] = -norm.x*imp_mod*(1-w01);
+    dv[0][1] = -norm.y*imp_mod*(1-w01);
+    dv[0][2] = -norm.z*imp_mod*(1-w01);
+    dv[1][0] = -norm.x*imp_mod*w01;
+    dv[1][1] = -norm.y*imp_mod*w01;
+    dv[1][2] = -norm.z*imp_mod*w01;
+    dv[2][0] = +norm.x*imp_mod*(1-w23);
+    dv[2][1] = +norm.y*imp_mod*(1-w23);
+    dv[2][2] = +norm.z*imp_mod*(1-w23);
+    dv[3][0] = +norm.x*imp_mod*w23;
+    dv[3][1] = +norm.y*imp_mod*w23;
+    dv[3][2] = +norm.z*imp_mod*w23;
+    state.imp = imp_mod;
+    state.norm[0] = norm.x;  state.norm[1] = norm.y;  state.norm[2] = norm.z;
+    state.w[0] = w01;  state.w[1] = w23;
+    return true;
+  }
+}
+
+
+// 接触要素の撃力による速度の変化を求める関数
+typedef bool (*IMPULSE_CONTACT_FUNC)
+(double dv[4][3],
+ CContactState& state,
+ const CContactElement& ce,
+ double delta, double stiffness, double dt, double mass,
+ const std::vector<double>& aXYZ,
+ const std::vector<double>& aUVWm);
+
+// 速度の変化を加える
+static inline void AddImpulseContact
+(std::vector<double>& aUVWm,
+ ////
+ const CContactElement& ce,
+ const double dv[4][3])
+{
+  const int aIno[4] = { ce.ino0, ce.ino1, ce.ino2, ce.ino3 };
+  for(int i=0;i<4;i++){
+    aUVWm[aIno[i]*3+0] += dv[i][0];
+    aUVWm[aIno[i]*3+1] += dv[i][1];
+    aUVWm[aIno[i]*3+2] += dv[i][2];
+  }
+}
+
+const int NCOLOR_IMPULSE_MAX = 64; // 塗り分ける色の数の上限
+
+// 頂点を共有しない接触要素が同じ色になるように貪欲に塗り分ける．aColorは色ごとの接触要素の番号(番号の順)
+// 頂点ごとに使った色をビットで覚えるので,64色目以降は最後の色にまとめて逐次に処理する
+static void ColorContactElement
+(CJaggedArray& aColor,
+ std::vector<unsigned long long>& aFlgColor, // (作業領域)頂点に接する接触要素の色.全て0で返す
+ std::vector<int>& aColorCE, // (作業領域)接触要素の色
+ ////
+ const std::vector<CContactElement>& aContactElem,
+ int nno)
+{
+  const int nce = (int)aContactElem.size();
+  if( (int)aFlgColor.size() != nno ){ aFlgColor.assign(nno,0); }
+  aColorCE.resize(nce);
+  int ncolor = 0;
+  for(int ice=0;ice<nce;ice++){
     const CContactElement& ce = aContactElem[ice];
-    const int ino0 = ce.ino0;
-    const int ino1 = ce.ino1;
-    const int ino2 = ce.ino2;
-    const int ino3 = ce.ino3;
-    CVector3D p0( aXYZ[ ino0*3+0], aXYZ[ ino0*3+1], aXYZ[ ino0*3+2] );
-    CVector3D p1( aXYZ[ ino1*3+0], aXYZ[ ino1*3+1], aXYZ[ ino1*3+2] );
-    CVector3D p2( aXYZ[ ino2*3+0], aXYZ[ ino2*3+1], aXYZ[ ino2*3+2] );
-    CVector3D p3( aXYZ[ ino3*3+0], aXYZ[ ino3*3+1], aXYZ[ ino3*3+2] );
-    CVector3D v0( aUVWm[ino0*3+0], aUVWm[ino0*3+1], aUVWm[ino0*3+2] );
-    CVector3D v1( aUVWm[ino1*3+0], aUVWm[ino1*3+1], aUVWm[ino1*3+2] );
-    CVector3D v2( aUVWm[ino2*3+0], aUVWm[ino2*3+1], aUVWm[ino2*3+2] );
-    CVector3D v3( aUVWm[ino3*3+0], aUVWm[ino3*3+1], aUVWm[ino3*3+2] );
-    if( ce.is_fv ){ // face-vtx      
-      double w0,w1;
-      {
-        double dist = DistanceFaceVertex(p0, p1, p2, p3, w0,w1);
-        if( w0 < 0 || w0 > 1 ) continue;
-        if( w1 < 0 || w1 > 1 ) continue;
-        if( dist > delta ) continue;
-      }
-      double w2 = 1.0 - w0 - w1;
-      CVector3D pc = w0*p0 + w1*p1 + w2*p2;
-      CVector3D norm = p3-pc; norm.SetNormalizedVector();
-      double p_depth = delta - Dot(p3-pc,norm); // penetration depth 
-      double rel_v = Dot(v3-w0*v0-w1*v1-w2*v2,norm);
-      if( rel_v > 0.1*p_depth/dt ) continue;
-      double imp_el = dt*stiffness*p_depth;
-      double imp_ie = mass*(0.1*p_depth/dt-rel_v);
-      double imp_min = ( imp_el < imp_ie ) ? imp_el : imp_ie;
-      double imp_mod = 2*imp_min / (1+w0*w0+w1*w1+w2*w2);
-      imp_mod /= mass;
-      imp_mod *= 0.25;
-      aUVWm[ino0*3+0] += -norm.x*imp_mod*w0;
-      aUVWm[ino0*3+1] += -norm.y*imp_mod*w0;
-      aUVWm[ino0*3+2] += -norm.z*imp_mod*w0;
-      aUVWm[ino1*3+0] += -norm.x*imp_mod*w1;
-      aUVWm[ino1*3+1] += -norm.y*imp_mod*w1;
-      aUVWm[ino1*3+2] += -norm.z*imp_mod*w1;
-      aUVWm[ino2*3+0] += -norm.x*imp_mod*w2;
-      aUVWm[ino2*3+1] += -norm.y*imp_mod*w2;
-      aUVWm[ino2*3+2] += -norm.z*imp_mod*w2;
-      aUVWm[ino3*3+0] += +norm.x*imp_mod;
-      aUVWm[ino3*3+1] += +norm.y*imp_mod;
-      aUVWm[ino3*3+2] += +norm.z*imp_mod;
+    const int aIno[4] = { ce.ino0, ce.ino1, ce.ino2, ce.ino3 };
+    const unsigned long long flg = aFlgColor[aIno[0]] | aFlgColor[aIno[1]] | aFlgColor[aIno[2]] | aFlgColor[aIno[3]];
+    int icolor = 0;
+    while( icolor < NCOLOR_IMPULSE_MAX && (flg>>icolor)&1 ){ icolor++; }
+    aColorCE[ice] = icolor;
+    if( icolor+1 > ncolor ){ ncolor = icolor+1; }
+    if( icolor == NCOLOR_IMPULSE_MAX ) continue;
+    for(int i=0;i<4;i++){ aFlgColor[aIno[i]] |= (1ULL<<icolor); }
+  }
+  for(int ice=0;ice<nce;ice++){ // 次に使う時のために0に戻す
+    const CContactElement& ce = aContactElem[ice];
+    aFlgColor[ce.ino0] = 0;  aFlgColor[ce.ino1] = 0;  aFlgColor[ce.ino2] = 0;  aFlgColor[ce.ino3] = 0;
+  }
+  aColor.InitializeSize(ncolor);
+  for(int ice=0;ice<nce;ice++){ aColor.index[aColorCE[ice]+1]++; }
+  for(int icolor=0;icolor<ncolor;icolor++){ aColor.index[icolor+1] += aColor.index[icolor]; }
+  aColor.array.resize(nce);
+  for(int ice=0;ice<nce;ice++){
+    aColor.array[ aColor.index[aColorCE[ice]] ] = ice;
+    aColor.index[aColorCE[ice]]++;
+  }
+  for(int icolor=ncolor;icolor>0;icolor--){ aColor.index[icolor] = aColor.index[icolor-1]; }
+  aColor.index[0] = 0;
+}
+
+// 接触要素の撃力を加える．imode_impulseで加え方を選ぶ(IMPULSE_GAUSS_SEIDELなど)
+static void ApplyImpulseContact
+(std::vector<double>& aUVWm,
+ CContextSelfCollision& ctx, // (out)ctx.aStateに接触要素ごとの撃力.他は作業領域
+ ////
+ int imode_impulse,
+ IMPULSE_CONTACT_FUNC func,
+ double delta, double stiffness, double dt, double mass,
+ const std::vector<double>& aXYZ,
+ const std::vector<CContactElement>& aContactElem)
+{
+  const int nce = (int)aContactElem.size();
+  std::vector<CContactState>& aState = ctx.aState;
+  aState.resize(nce);
+  if( imode_impulse == IMPULSE_GAUSS_SEIDEL ){
+    for(int ice=0;ice<nce;ice++){
+      double dv[4][3];
+      if( !func(dv,aState[ice], aContactElem[ice], delta,stiffness,dt,mass, aXYZ,aUVWm) ) continue;
+      AddImpulseContact(aUVWm, aContactElem[ice],dv);
     }
-    else{ // edge-edge
-      double w01,w23;
-      {
-        double dist = DistanceEdgeEdge(p0, p1, p2, p3, w01,w23);
-        if( w01 < 0 || w01 > 1 ) continue;
-        if( w23 < 0 || w23 > 1 ) continue;
-        if( dist > delta ) continue;
+    return;
+  }
+  const CJaggedArray& aColor = ctx.aColor;
+  ColorContactElement(ctx.aColor,ctx.aFlgColor,ctx.aColorCE, aContactElem,(int)aUVWm.size()/3);
+  const int ncolor = aColor.Size();
+  if( imode_impulse == IMPULSE_GAUSS_SEIDEL_COLOR ){
+    for(int icolor=0;icolor<ncolor;icolor++){
+      const int ind0 = aColor.index[icolor];
+      const int ind1 = aColor.index[icolor+1];
+      const bool is_last = ( icolor == NCOLOR_IMPULSE_MAX ); // 塗り分けられなかった接触要素は逐次に処理する
+#pragma omp parallel for if( !is_last && ind1-ind0 > 64 )
+      for(int ind=ind0;ind<ind1;ind++){
+        const int ice = aColor.array[ind];
+        double dv[4][3];
+        if( !func(dv,aState[ice], aContactElem[ice], delta,stiffness,dt,mass, aXYZ,aUVWm) ) continue;
+        AddImpulseContact(aUVWm, aContactElem[ice],dv);
       }
-      CVector3D c01 = (1-w01)*p0 + w01*p1;
-      CVector3D c23 = (1-w23)*p2 + w23*p3;
-      CVector3D norm = (c23-c01); norm.SetNormalizedVector();
-      double p_depth = delta - (c23-c01).Length();
-      double rel_v = Dot((1-w23)*v2+w23*v3-(1-w01)*v0-w01*v1,norm);
-      if( rel_v > 0.1*p_depth/dt ) continue;
-      double imp_el = dt*stiffness*p_depth;
-      double imp_ie = mass*(0.1*p_depth/dt-rel_v);
-      double imp_min = ( imp_el < imp_ie ) ? imp_el : imp_ie;
-      double imp_mod = 2*imp_min / ( w01*w01+(1-w01)*(1-w01) + w23*w23+(1-w23)*(1-w23) );
-      imp_mod /= mass;
-      imp_mod *= 0.25;      
-      aUVWm[ino0*3+0] += -norm.x*imp_mod*(1-w01);
-      aUVWm[ino0*3+1] += -norm.y*imp_mod*(1-w01);
-      aUVWm[ino0*3+2] += -norm.z*imp_mod*(1-w01);
-      aUVWm[ino1*3+0] += -norm.x*imp_mod*w01;
-      aUVWm[ino1*3+1] += -norm.y*imp_mod*w01;
-      aUVWm[ino1*3+2] += -norm.z*imp_mod*w01;
-      aUVWm[ino2*3+0] += +norm.x*imp_mod*(1-w23);
-      aUVWm[ino2*3+1] += +norm.y*imp_mod*(1-w23);
-      aUVWm[ino2*3+2] += +norm.z*imp_mod*(1-w23);
-      aUVWm[ino3*3+0] += +norm.x*imp_mod*w23;
-      aUVWm[ino3*3+1] += +norm.y*imp_mod*w23;
-      aUVWm[ino3*3+2] += +norm.z*imp_mod*w23;
     }
+    return;
+  }
+  assert( imode_impulse == IMPULSE_JACOBI );
+  std::vector<double>& aDV = ctx.aDV; // 接触要素ごとの速度の変化
+  std::vector<unsigned char>& aIsImpulse = ctx.aIsImpulse;
+  aDV.resize(nce*12);
+  aIsImpulse.resize(nce);
+#pragma omp parallel for if( nce > 64 )
+  for(int ice=0;ice<nce;ice++){
+    aIsImpulse[ice] = func((double (*)[3])(aDV.data()+ice*12),aState[ice], aContactElem[ice], delta,stiffness,dt,mass, aXYZ,aUVWm);
   }
+  for(int icolor=0;icolor<ncolor;icolor++){
+    const int ind0 = aColor.index[icolor];
+    const int ind1 = aColor.index[icolor+1];
+    const bool is_last = ( icolor == NCOLOR_IMPULSE_MAX );
+#pragma omp parallel for if( !is_last && ind1-ind0 > 64 )
+    for(int ind=ind0;ind<ind1;ind++){
+      const int ice = aColor.array[ind];
+      if( !aIsImpulse[ice] ) continue;
+      AddImpulseContact(aUVWm, aContactElem[ice],(const double (*)[3])(aDV.data()+ice*12));
+    }
+  }
+}
+
+// 撃力を計算
+void SelfCollisionImpulse_Proximity
+(std::vector<double>& aUVWm, // (in,out)velocity
+ CContextSelfCollision& ctx, // (out)ctx.aStateに接触要素ごとの撃力.他は作業領域
+ ////
+ int imode_impulse,
+ double delta,
+ double stiffness,
+ double dt,
+ double mass,
+ const std::vector<double>& aXYZ,
+ const std::vector<int>& aTri,
+ const std::vector<CContactElement>& aContactElem)
+{
+  ApplyImpulseContact(aUVWm,ctx, imode_impulse,ImpulseContact_Proximity, delta,stiffness,dt,mass, aXYZ,aContactElem);
 }
 
 
 // Impulseの計算
 void SelfCollisionImpulse_CCD
 (std::vector<double>& aUVWm, // (in,out)velocity
+ CContextSelfCollision& ctx, // (out)ctx.aStateに接触要素ごとの撃力.他は作業領域
  ////
+ int imode_impulse,
  double delta,
  double stiffness,
  double dt,
@@ -124,91 +390,7 @@ void SelfCollisionImpulse_CCD
  const std::vector<int>& aTri,
  const std::vector<CContactElement>& aContactElem)
 {
-  for(int ice=0;ice<aContactElem.size();ice++){
-    const CContactElement& ce = aContactElem[ice];
-    const int ino0 = ce.ino0;
-    const int ino1 = ce.ino1;
-    const int ino2 = ce.ino2;
-    const int ino3 = ce.ino3;
-    CVector3D p0( aXYZ[ ino0*3+0], aXYZ[ ino0*3+1], aXYZ[ ino0*3+2] );
-    CVector3D p1( aXYZ[ ino1*3+0], aXYZ[ ino1*3+1], aXYZ[ ino1*3+2] );
-    CVector3D p2( aXYZ[ ino2*3+0], aXYZ[ ino2*3+1], aXYZ[ ino2*3+2] );
-    CVector3D p3( aXYZ[ ino3*3+0], aXYZ[ ino3*3+1], aXYZ[ ino3*3+2] );
-    CVector3D v0( aUVWm[ino0*3+0], aUVWm[ino0*3+1], aUVWm[ino0*3+2] );
-    CVector3D v1( aUVWm[ino1*3+0], aUVWm[ino1*3+1], aUVWm[ino1*3+2] );
-    CVector3D v2( aUVWm[ino2*3+0], aUVWm[ino2*3+1], aUVWm[ino2*3+2] );
-    CVector3D v3( aUVWm[ino3*3+0], aUVWm[ino3*3+1], aUVWm[ino3*3+2] );    
-    double t = FindCoplanerInterp(p0,p1,p2,p3, p0+v0,p1+v1,p2+v2,p3+v3);
-    if( t < 0 || t > 1 ) continue;
-    if( ce.is_fv ){ // face-vtx
-      double w0,w1;
-      {        
-        CVector3D p0m = p0 + t*v0;
-        CVector3D p1m = p1 + t*v1;
-        CVector3D p2m = p2 + t*v2;
-        CVector3D p3m = p3 + t*v3;
-        double dist = DistanceFaceVertex(p0m, p1m, p2m, p3m, w0,w1);
-        if( w0 < 0 || w0 > 1 ) continue;
-        if( w1 < 0 || w1 > 1 ) continue;
-        if( dist > delta ) continue;
-      }
-      double w2 = 1.0 - w0 - w1;
-      CVector3D pc = w0*p0 + w1*p1 + w2*p2;
-      CVector3D norm = p3 - pc; norm.SetNormalizedVector();
-      double rel_v = Dot(v3-w0*v0-w1*v1-w2*v2,norm); // relative velocity (positive if separating)
-      if( rel_v > 0.1*delta/dt ) continue; // separating
-      double imp = mass*(0.1*delta/dt-rel_v);
-      double imp_mod = 2*imp/(1.0+w0*w0+w1*w1+w2*w2);
-      imp_mod /= mass;
-      imp_mod *= 0.1;
-      aUVWm[ino0*3+0] += -norm.x*imp_mod*w0;
-      aUVWm[ino0*3+1] += -norm.y*imp_mod*w0;
-      aUVWm[ino0*3+2] += -norm.z*imp_mod*w0;
-      aUVWm[ino1*3+0] += -norm.x*imp_mod*w1;
-      aUVWm[ino1*3+1] += -norm.y*imp_mod*w1;
-      aUVWm[ino1*3+2] += -norm.z*imp_mod*w1;
-      aUVWm[ino2*3+0] += -norm.x*imp_mod*w2;
-      aUVWm[ino2*3+1] += -norm.y*imp_mod*w2;
-      aUVWm[ino2*3+2] += -norm.z*imp_mod*w2;
-      aUVWm[ino3*3+0] += +norm.x*imp_mod;
-      aUVWm[ino3*3+1] += +norm.y*imp_mod;
-      aUVWm[ino3*3+2] += +norm.z*imp_mod;
-    }
-    else{ // edge-edge
-      double w01,w23;
-      {
-        CVector3D p0m = p0 + t*v0;
-        CVector3D p1m = p1 + t*v1;
-        CVector3D p2m = p2 + t*v2;
-        CVector3D p3m = p3 + t*v3;
-        double dist = DistanceEdgeEdge(p0m, p1m, p2m, p3m, w01,w23);
-        if( w01 < 0 || w01 > 1 ) continue;
-        if( w23 < 0 || w23 > 1 ) continue;
-        if( dist > delta ) continue;
-      }      
-      CVector3D c01 = (1-w01)*p0 + w01*p1;
-      CVector3D c23 = (1-w23)*p2 + w23*p3;
-      CVector3D norm = (c23-c01); norm.SetNormalizedVector();
-      double rel_v = Dot((1-w23)*v2+w23*v3-(1-w01)*v0-w01*v1,norm);
-      if( rel_v > 0.1*delta/dt ) continue; // separating
-      double imp = mass*(0.1*delta/dt-rel_v); // reasonable
-      double imp_mod = 2*imp/( w01*w01+(1-w01)*(1-w01) + w23*w23+(1-w23)*(1-w23) );
-      imp_mod /= mass;
-      imp_mod *= 0.1;
-      aUVWm[ino0*3+0] += -norm.x*imp_mod*(1-w01);
-      aUVWm[ino0*3+1] += -norm.y*imp_mod*(1-w01);
-      aUVWm[ino0*3+2] += -norm.z*imp_mod*(1-w01);
-      aUVWm[ino1*3+0] += -norm.x*imp_mod*w01;
-      aUVWm[ino1*3+1] += -norm.y*imp_mod*w01;
-      aUVWm[ino1*3+2] += -norm.z*imp_mod*w01;
-      aUVWm[ino2*3+0] += +norm.x*imp_mod*(1-w23);
-      aUVWm[ino2*3+1] += +norm.y*imp_mod*(1-w23);
-      aUVWm[ino2*3+2] += +norm.z*imp_mod*(1-w23);
-      aUVWm[ino3*3+0] += +norm.x*imp_mod*w23;
-      aUVWm[ino3*3+1] += +norm.y*imp_mod*w23;
-      aUVWm[ino3*3+2] += +norm.z*imp_mod*w23;
-    }
-  }
+  ApplyImpulseContact(aUVWm,ctx, imode_impulse,ImpulseContact_CCD, delta,stiffness,dt,mass, aXYZ,aContactElem);
 }
 
 
@@ -216,63 +398,91 @@ void SelfCollisionImpulse_CCD
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-// RIZを更新する
+// 頂点ino0が属するRIZの代表の頂点(経路を半分に縮める)
+static inline int FindRootRIZ
+(std::vector<int>& aRootRIZ,
+ int ino0)
+{
+  assert( aRootRIZ[ino0] >= 0 );
+  int ino = ino0;
+  while( aRootRIZ[ino] != ino ){
+    aRootRIZ[ino] = aRootRIZ[aRootRIZ[ino]];
+    ino = aRootRIZ[ino];
+  }
+  return ino;
+}
+
+// 頂点ino0と頂点ino1のRIZをつなげる．番号の小さい代表を残す
+static inline void UnionRIZ
+(std::vector<int>& aRootRIZ,
+ int ino0, int ino1)
+{
+  const int ir0 = FindRootRIZ(aRootRIZ,ino0);
+  const int ir1 = FindRootRIZ(aRootRIZ,ino1);
+  if( ir0 == ir1 ) return;
+  if( ir0 < ir1 ){ aRootRIZ[ir1] = ir0; }
+  else{            aRootRIZ[ir0] = ir1; }
+}
+
+// RIZを更新する．接触要素の4点は一つのRIZにまとめ,その点と辺でつながっているRIZもつなげる
+// RIZは頂点の互いに素な集合で表し,aRootRIZ[ino]はRIZの中で一つ上の頂点(RIZに属さなければ-1)
 void MakeRigidImpactZone
-(std::vector< std::set<int> >& aRIZ, // (in,ou)RIZに属する節点のインデックスの集合の配列
+(std::vector<int>& aRootRIZ, // (in,out)RIZの互いに素な集合．空なら全ての頂点がRIZに属さないとして作る
  const std::vector<CContactElement>& aContactElem, // 自己交差する接触要素の配列
  const CJaggedArray& aEdge) // 三角形メッシュの辺の配列
 {
-  for(int ice=0;ice<aContactElem.size();ice++){
+  if( (int)aRootRIZ.size() != aEdge.Size() ){ aRootRIZ.assign(aEdge.Size(),-1); }
+  for(int ice=0;ice<(int)aContactElem.size();ice++){
     const CContactElement& ce = aContactElem[ice];
     const int n[4] = {ce.ino0, ce.ino1, ce.ino2, ce.ino3};
-    std::set<int> ind_inc; // 接触要素が接するRIZの集合
     for(int i=0;i<4;i++){
       const int ino = n[i];
-      for(int iriz=0;iriz<aRIZ.size();iriz++){
-        if( aRIZ[iriz].find(ino) != aRIZ[iriz].end() ){
-          ind_inc.insert(iriz);
-        }
-        else{
-          for(int iedge=aEdge.index[ino];iedge<aEdge.index[ino+1];iedge++){
-            int jno = aEdge.array[iedge];
-            if( aRIZ[iriz].find(jno) != aRIZ[iriz].end() ){
-              ind_inc.insert(iriz);  break;
-            }
-          }
-        }
-      }
-    }
-    if( ind_inc.size() == 0 ){ // 接触要素はどのRIZにも属していない
-      int ind0 = (int)aRIZ.size();
-      aRIZ.resize(ind0+1);
-      aRIZ[ind0].insert(n[0]); aRIZ[ind0].insert(n[1]); aRIZ[ind0].insert(n[2]); aRIZ[ind0].insert(n[3]);
+      if( aRootRIZ[ino] < 0 ){ aRootRIZ[ino] = ino; }
+      if( i > 0 ){ UnionRIZ(aRootRIZ,n[0],ino); }
     }
-    else if( ind_inc.size() == 1 ){ // 接触要素は一つのRIZに接する
-      int ind0 = *(ind_inc.begin());
-      aRIZ[ind0].insert(n[0]); aRIZ[ind0].insert(n[1]); aRIZ[ind0].insert(n[2]); aRIZ[ind0].insert(n[3]);
-    }
-    else{ // overlapping two reagion，接触要素が複数のRIZに接するー＞接する複数のRIZをマージする
-      std::vector< std::set<int> > aRIZ1; // マージされた後のRIZの配列
-      for(int iriz=0;iriz<aRIZ.size();iriz++){ // 接さないRIZをコピー
-        if( ind_inc.find(iriz) != ind_inc.end() ) continue;
-        aRIZ1.push_back( aRIZ[iriz] );
-      }
-      // マージしたRIZを，aRIZ1の最後に追加
-      int ind0 = (int)aRIZ1.size();
-      aRIZ1.resize(ind0+1);
-      for(std::set<int>::iterator itr=ind_inc.begin();itr!=ind_inc.end();itr++){
-        int ind1 = *itr;
-        assert( ind1 < aRIZ.size() );
-        for(std::set<int>::iterator jtr=aRIZ[ind1].begin();jtr!=aRIZ[ind1].end();jtr++){
-          aRIZ1[ind0].insert(*jtr);
-        }
+    for(int i=0;i<4;i++){ // 辺でつながっているRIZとつなげる
+      const int ino = n[i];
+      for(int iedge=aEdge.index[ino];iedge<aEdge.index[ino+1];iedge++){
+        const int jno = aEdge.array[iedge];
+        if( aRootRIZ[jno] < 0 ) continue;
+        UnionRIZ(aRootRIZ,ino,jno);
       }
-      aRIZ1[ind0].insert(n[0]); aRIZ1[ind0].insert(n[1]); aRIZ1[ind0].insert(n[2]); aRIZ1[ind0].insert(n[3]);
-      aRIZ = aRIZ1;
     }
   }
 }
 
+// RIZごとに属する頂点を並べる．RIZは最小の頂点の番号の順,RIZの中の頂点は番号の順に並ぶ
+void MakeRigidImpactZoneCSR
+(CJaggedArray& aRIZ, // (out)RIZに属する頂点の配列
+ std::vector<int>& aZone, // (作業領域)代表の頂点のRIZの番号
+ ////
+ std::vector<int>& aRootRIZ) // (in,out)RIZの互いに素な集合(経路が縮められる)
+{
+  const int nno = (int)aRootRIZ.size();
+  aZone.resize(nno); // 代表の頂点だけに書き込んで使う
+  int nriz = 0;
+  for(int ino=0;ino<nno;ino++){
+    if( aRootRIZ[ino] < 0 ) continue;
+    const int ir = FindRootRIZ(aRootRIZ,ino);
+    if( ir == ino ){ aZone[ino] = nriz;  nriz++; } // 代表は最小の頂点なので最初に現れる
+  }
+  aRIZ.InitializeSize(nriz);
+  for(int ino=0;ino<nno;ino++){
+    if( aRootRIZ[ino] < 0 ) continue;
+    aRIZ.index[ aZone[aRootRIZ[ino]]+1 ]++;
+  }
+  for(int iriz=0;iriz<nriz;iriz++){ aRIZ.index[iriz+1] += aRIZ.index[iriz]; }
+  aRIZ.array.resize(aRIZ.index[nriz]);
+  for(int ino=0;ino<nno;ino++){
+    if( aRootRIZ[ino] < 0 ) continue;
+    const int iriz = aZone[aRootRIZ[ino]];
+    aRIZ.array[ aRIZ.index[iriz] ] = ino;
+    aRIZ.index[iriz]++;
+  }
+  for(int iriz=nriz;iriz>0;iriz--){ aRIZ.index[iriz] = aRIZ.index[iriz-1]; }
+  aRIZ.index[0] = 0;
+}
+
 
 // t is a tmporary buffer size of 9
 static inline void CalcInvMat3(double ainv[], const double a[])
@@ -295,55 +505,128 @@ static inline void CalcInvMat3(double ainv[], const double a[])
 	ainv[8] = inv_det*(a[0]*a[4]-a[1]*a[3]);
 }
 
+const int NNODE_RIZ_CHUNK = 1024; // 大きいRIZはこの頂点数ごとに分けて並列に和をとる(分け方はスレッド数によらない)
+const int NCHUNK_RIZ_MAX = 64; // 区間の数の上限．これより多くなるRIZは区間を長くする(区間ごとの和を固定長の配列に置くため)
+
+// RIZの頂点aInd[iv0]からaInd[iv1-1]の位置と速度の和
+static void SumPositionVelocityRIZ
+(CVector3D& gc, CVector3D& av,
+ ////
+ const int* aInd, int iv0, int iv1,
+ const std::vector<double>& aXYZ,
+ const std::vector<double>& aUVWm0)
+{
+  for(int iv=iv0;iv<iv1;iv++){
+    int ino = aInd[iv];
+    gc += CVector3D(aXYZ[  ino*3+0],aXYZ[  ino*3+1],aXYZ[  ino*3+2]);
+    av += CVector3D(aUVWm0[ino*3+0],aUVWm0[ino*3+1],aUVWm0[ino*3+2]);
+  }
+}
+
+// RIZの頂点aInd[iv0]からaInd[iv1-1]の重心まわりの角運動量と慣性テンソルの和
+static void SumMomentInertiaRIZ
+(CVector3D& L, double I[9],
+ ////
+ const CVector3D& gc, const CVector3D& av,
+ const int* aInd, int iv0, int iv1,
+ const std::vector<double>& aXYZ,
+ const std::vector<double>& aUVWm0)
+{
+  for(int iv=iv0;iv<iv1;iv++){
+    int ino = aInd[iv];
+    CVector3D p(aXYZ[  ino*3+0],aXYZ[  ino*3+1],aXYZ[  ino*3+2]);
+    CVector3D v(aUVWm0[ino*3+0],aUVWm0[ino*3+1],aUVWm0[ino*3+2]);
+    L += Cross(p-gc,v-av);
+    CVector3D q = p-gc;
+    I[0] += v*v - q[0]*q[0];  I[1] +=     - q[0]*q[1];  I[2] +=     - q[0]*q[2];
+    I[3] +=     - q[1]*q[0];  I[4] += v*v - q[1]*q[1];  I[5] +=     - q[1]*q[2];
+    I[6] +=     - q[2]*q[0];  I[7] +=     - q[2]*q[1];  I[8] += v*v - q[2]*q[2];
+  }
+}
+
+// 一つのRIZの頂点を剛体運動させる．頂点がNNODE_RIZ_CHUNKより多ければRIZの中で並列に計算する
+static void ApplyRigidImpactZone_Zone
+(std::vector<double>& aUVWm,
+ ////
+ const int* aInd, int nInd,
+ const std::vector<double>& aXYZ,
+ const std::vector<double>& aUVWm0)
+{
+  int nnode_chunk = NNODE_RIZ_CHUNK; // 区間の頂点数
+  if( nInd > NNODE_RIZ_CHUNK*NCHUNK_RIZ_MAX ){ nnode_chunk = (nInd+NCHUNK_RIZ_MAX-1)/NCHUNK_RIZ_MAX; }
+  const int nchunk = (nInd+nnode_chunk-1)/nnode_chunk;
+  CVector3D gc(0,0,0); // 重心位置
+  CVector3D av(0,0,0); // 平均速度
+  CVector3D L(0,0,0); // 角運動量
+  double I[9] = {0,0,0, 0,0,0, 0,0,0}; // 慣性テンソル
+  if( nchunk == 1 ){
+    SumPositionVelocityRIZ(gc,av, aInd,0,nInd, aXYZ,aUVWm0);
+    gc /= (double)nInd;
+    av /= (double)nInd;
+    SumMomentInertiaRIZ(L,I, gc,av, aInd,0,nInd, aXYZ,aUVWm0);
+  }
+  else{ // 区間ごとの和を並列に求めて,区間の順に足す
+    CVector3D aGC[NCHUNK_RIZ_MAX], aAV[NCHUNK_RIZ_MAX], aL[NCHUNK_RIZ_MAX];
+    double aI[NCHUNK_RIZ_MAX*9];
+    for(int i=0;i<nchunk*9;i++){ aI[i] = 0.0; }
+#pragma omp parallel for
+    for(int ichunk=0;ichunk<nchunk;ichunk++){
+      const int iv0 = ichunk*nnode_chunk;
+      const int iv1 = ( iv0+nnode_chunk < nInd ) ? iv0+nnode_chunk : nInd;
+      SumPositionVelocityRIZ(aGC[ichunk],aAV[ichunk], aInd,iv0,iv1, aXYZ,aUVWm0);
+    }
+    for(int ichunk=0;ichunk<nchunk;ichunk++){ gc += aGC[ichunk];  av += aAV[ichunk]; }
+    gc /= (double)nInd;
+    av /= (double)nInd;
+#pragma omp parallel for
+    for(int ichunk=0;ichunk<nchunk;ichunk++){
+      const int iv0 = ichunk*nnode_chunk;
+      const int iv1 = ( iv0+nnode_chunk < nInd ) ? iv0+nnode_chunk : nInd;
+      SumMomentInertiaRIZ(aL[ichunk],aI+ichunk*9, gc,av, aInd,iv0,iv1, aXYZ,aUVWm0);
+    }
+    for(int ichunk=0;ichunk<nchunk;ichunk++){
+      L += aL[ichunk];
+      for(int i=0;i<9;i++){ I[i] += aI[ichunk*9+i]; }
+    }
+  }
+  // 角速度を求める
+  double Iinv[9];
+  CalcInvMat3(Iinv,I);
+  CVector3D omg;
+  omg.x = Iinv[0]*L.x + Iinv[1]*L.y + Iinv[2]*L.z;
+  omg.y = Iinv[3]*L.x + Iinv[4]*L.y + Iinv[5]*L.z;
+  omg.z = Iinv[6]*L.x + Iinv[7]*L.y + Iinv[8]*L.z;
+  // 中間速度の更新
+#pragma omp parallel for if( nchunk > 1 )
+  for(int iv=0;iv<nInd;iv++){
+    int ino = aInd[iv];
+    CVector3D p(aXYZ[  ino*3+0],aXYZ[  ino*3+1],aXYZ[  ino*3+2]);
+    CVector3D rot = -Cross(p-gc,omg);
+    aUVWm[ino*3+0] = av.x + rot.x;
+    aUVWm[ino*3+1] = av.y + rot.y;
+    aUVWm[ino*3+2] = av.z + rot.z;
+  }
+}
+
+// RIZの頂点を剛体運動させる．RIZは頂点を共有しないので,大きいRIZはRIZの中で,小さいRIZはRIZごとに並列に計算する
 void ApplyRigidImpactZone
 (std::vector<double>& aUVWm, // (in,out)RIZで更新された中間速度
  ////
- const std::vector< std::set<int> >& aRIZ,  // (in)各RIZに属する節点の集合(set)の配列
+ const CJaggedArray& aRIZ,  // (in)各RIZに属する節点の配列(MakeRigidImpactZoneCSRを参照)
  const std::vector<double>& aXYZ, // (in) 前ステップの節点の位置の配列
  const std::vector<double>& aUVWm0) // (in) RIZを使う前の中間速度
 {
-  for(int iriz=0;iriz<aRIZ.size();iriz++){
-    std::vector<int> aInd; // index of points belong to this RIZ
-    for(std::set<int>::iterator jtr=aRIZ[iriz].begin();jtr!=aRIZ[iriz].end();jtr++){
-      aInd.push_back(*jtr);
-    }
-    CVector3D gc(0,0,0); // 重心位置
-    CVector3D av(0,0,0); // 平均速度
-    for(int iv=0;iv<aInd.size();iv++){
-      int ino = aInd[iv];
-      gc += CVector3D(aXYZ[  ino*3+0],aXYZ[  ino*3+1],aXYZ[  ino*3+2]);
-      av += CVector3D(aUVWm0[ino*3+0],aUVWm0[ino*3+1],aUVWm0[ino*3+2]);
-    }
-    gc /= (double)aInd.size();
-    av /= (double)aInd.size();
-    CVector3D L(0,0,0); // 角運動量
-    double I[9] = {0,0,0, 0,0,0, 0,0,0}; // 慣性テンソル
-    for(int iv=0;iv<aInd.size();iv++){
-      int ino = aInd[iv];
-      CVector3D p(aXYZ[  ino*3+0],aXYZ[  ino*3+1],aXYZ[  ino*3+2]);
-      CVector3D v(aUVWm0[ino*3+0],aUVWm0[ino*3+1],aUVWm0[ino*3+2]);
-      L += Cross(p-gc,v-av);
-      CVector3D q = p-gc;
-      I[0] += v*v - q[0]*q[0];  I[1] +=     - q[0]*q[1];  I[2] +=     - q[0]*q[2];
-      I[3] +=     - q[1]*q[0];  I[4] += v*v - q[1]*q[1];  I[5] +=     - q[1]*q[2];
-      I[6] +=     - q[2]*q[0];  I[7] +=     - q[2]*q[1];  I[8] += v*v - q[2]*q[2];
-    }
-    // 角速度を求める
-    double Iinv[9];
-    CalcInvMat3(Iinv,I);
-    CVector3D omg;
-    omg.x = Iinv[0]*L.x + Iinv[1]*L.y + Iinv[2]*L.z;
-    omg.y = Iinv[3]*L.x + Iinv[4]*L.y + Iinv[5]*L.z;
-    omg.z = Iinv[6]*L.x + Iinv[7]*L.y + Iinv[8]*L.z;
-    // 中間速度の更新
-    for(int iv=0;iv<aInd.size();iv++){
-      int ino = aInd[iv];
-      CVector3D p(aXYZ[  ino*3+0],aXYZ[  ino*3+1],aXYZ[  ino*3+2]);
-      CVector3D rot = -Cross(p-gc,omg);
-      aUVWm[ino*3+0] = av.x + rot.x;
-      aUVWm[ino*3+1] = av.y + rot.y;
-      aUVWm[ino*3+2] = av.z + rot.z;
-    }
+  const int nriz = aRIZ.Size();
+  for(int iriz=0;iriz<nriz;iriz++){
+    const int nInd = aRIZ.index[iriz+1]-aRIZ.index[iriz];
+    if( nInd <= NNODE_RIZ_CHUNK ) continue;
+    ApplyRigidImpactZone_Zone(aUVWm, aRIZ.array.data()+aRIZ.index[iriz],nInd, aXYZ,aUVWm0);
+  }
+#pragma omp parallel for schedule(dynamic,4) if( nriz > 1 )
+  for(int iriz=0;iriz<nriz;iriz++){
+    const int nInd = aRIZ.index[iriz+1]-aRIZ.index[iriz];
+    if( nInd > NNODE_RIZ_CHUNK ) continue;
+    ApplyRigidImpactZone_Zone(aUVWm, aRIZ.array.data()+aRIZ.index[iriz],nInd, aXYZ,aUVWm0);
   }
 }
 
@@ -351,6 +634,206 @@ void ApplyRigidImpactZone
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+// CCDの候補を各段階で除いた数を表示する
+static void PrintCounterFilterCCD(const CCounterFilterCCD& c)
+{
+  const char* aName[NFILTER_CCD] = { "share", "box", "csat", "dist", "bernstein", "root", "miss", "hit" };
+  std::cout << "    CCD filter FV";
+  for(int i=0;i<NFILTER_CCD;i++){ std::cout << "  " << aName[i] << ":" << c.aNumFV[i]; }
+  std::cout << std::endl;
+  std::cout << "    CCD filter EE";
+  for(int i=0;i<NFILTER_CCD;i++){ std::cout << "  " << aName[i] << ":" << c.aNumEE[i]; }
+  std::cout << std::endl;
+}
+
+// 接触要素の頂点を集める(重複を含む)
+static void GetContactVertex
+(std::vector<int>& aIno,
+ ////
+ const std::vector<CContactElement>& aContactElem)
+{
+  aIno.resize(aContactElem.size()*4);
+  for(int ice=0;ice<(int)aContactElem.size();ice++){
+    const CContactElement& ce = aContactElem[ice];
+    aIno[ice*4+0] = ce.ino0;
+    aIno[ice*4+1] = ce.ino1;
+    aIno[ice*4+2] = ce.ino2;
+    aIno[ice*4+3] = ce.ino3;
+  }
+}
+
+// CCDで接触する要素を抽出する．is_localなら前の反復から速度が変わった頂点aInoDirtyの周りだけを更新して探索し直す
+static void GetContactElement_CCD_Iteration
+(std::vector<CContactElement>& aContactElem,
+ CContactBuffer& buffer,
+ CFrontBVTT& front_ccd,
+ CNormalConeBVH& cone,
+ CDirtyBVH& dirty,
+ ////
+ bool is_local,
+ const std::vector<int>& aInoDirty,
+ double dt,
+ double contact_clearance,
+ const std::vector<double>& aXYZ,
+ const std::vector<double>& aUVWm,
+ const std::vector<int>& aTri,
+ const std::vector<unsigned char>& aFlgOwnTri,
+ int iroot_bvh,
+ const std::vector<CNodeBVH>& aNodeBVH,
+ const CJaggedArray& aLevelBVH,
+ std::vector<CAABB3D>& aBB,
+ std::vector<CAABBChildBVH>& aBBC)
+{
+  if( dirty.aIsDirty.size() != aNodeBVH.size() ){ is_local = false; } // 初期化されていない
+  if( is_local ){ dirty.SetDirtyVertex(aInoDirty,aNodeBVH); }
+  const CJaggedArray& aLevelUpdate = is_local ? dirty.aLevelDirty : aLevelBVH; // 箱を更新するノード
+  BuildBoundingBoxLevel_CCD(dt,
+                            aXYZ,aUVWm,aTri,aNodeBVH,aLevelUpdate,aBB,aBBC);
+  cone.Update_CCD(dt,aXYZ,aUVWm,aTri,aNodeBVH,aLevelUpdate);
+  buffer.Clear();
+  if( is_local ){
+    GetContactElement_CCD(buffer,front_ccd,cone,dirty,
+                          dt,contact_clearance,
+                          aXYZ,aUVWm,aTri,aFlgOwnTri,
+                          iroot_bvh,
+                          aNodeBVH,aBB,aBBC); // output
+  }
+  else{
+    GetContactElement_CCD(buffer,front_ccd,cone,
+                          dt,contact_clearance,
+                          aXYZ,aUVWm,aTri,aFlgOwnTri,
+                          iroot_bvh,
+                          aNodeBVH,aBB,aBBC); // output
+  }
+  buffer.Gather(aContactElem);
+}
+
+const double COS_WARM_START_IMPULSE = 0.5; // 撃力の向きがこれより大きく変わった接触要素には初期値を使わない
+
+// 前のステップのCCDで撃力を受けた接触要素を,近接の判定とは別に今の形状で調べ直し,
+// このステップの間に接触の距離まで近づくものにはその撃力を初期値として加える
+// 向きと重心座標は今の形状で求め直す．CCDの撃力と同じく相対速度を0.1*delta/dtの離れる速度にする分より大きくは加えない
+// 撃力を加えた接触要素の数を返す
+static int WarmStartImpulseContact
+(std::vector<double>& aUVWm,
+ std::vector<CContactState>& aStateWarm, // (out)加えた撃力
+ std::vector<double>& aDV, // (作業領域)接触要素ごとの速度の変化
+ ////
+ const CContactCache& cache,
+ double delta,
+ double dt,
+ const std::vector<double>& aXYZ)
+{
+  const int ncache = (int)cache.aState.size();
+  aStateWarm.resize(ncache);
+  aDV.resize(ncache*12);
+  // 全て同じ速度から求める
+#pragma omp parallel for if( ncache > 64 )
+  for(int icache=0;icache<ncache;icache++){
+    const CContactState& state0 = cache.aState[icache];
+    const CContactElement& ce = state0.ce;
+    CContactState& state = aStateWarm[icache];
+    double (*dv)[3] = (double (*)[3])(aDV.data()+icache*12);
+    state.ce = ce;
+    state.imp = 0;
+    const int ino0 = ce.ino0;
+    const int ino1 = ce.ino1;
+    const int ino2 = ce.ino2;
+    const int ino3 = ce.ino3;
+    CVector3D p0( aXYZ[ ino0*3+0], aXYZ[ ino0*3+1], aXYZ[ ino0*3+2] );
+    CVector3D p1( aXYZ[ ino1*3+0], aXYZ[ ino1*3+1], aXYZ[ ino1*3+2] );
+    CVector3D p2( aXYZ[ ino2*3+0], aXYZ[ ino2*3+1], aXYZ[ ino2*3+2] );
+    CVector3D p3( aXYZ[ ino3*3+0], aXYZ[ ino3*3+1], aXYZ[ ino3*3+2] );
+    CVector3D v0( aUVWm[ino0*3+0], aUVWm[ino0*3+1], aUVWm[ino0*3+2] );
+    CVector3D v1( aUVWm[ino1*3+0], aUVWm[ino1*3+1], aUVWm[ino1*3+2] );
+    CVector3D v2( aUVWm[ino2*3+0], aUVWm[ino2*3+1], aUVWm[ino2*3+2] );
+    CVector3D v3( aUVWm[ino3*3+0], aUVWm[ino3*3+1], aUVWm[ino3*3+2] );
+    const CVector3D norm0(state0.norm[0],state0.norm[1],state0.norm[2]);
+    double w[4]; // 4点の重み(撃力の向きに動く点が正)
+    CVector3D norm;
+    double dist;
+    if( ce.is_fv ){ // face-vtx
+      double w0,w1;
+      dist = DistanceFaceVertex(p0, p1, p2, p3, w0,w1);
+      if( w0 < 0 || w0 > 1 ) continue;
+      if( w1 < 0 || w1 > 1 ) continue;
+      const double w2 = 1.0 - w0 - w1;
+      norm = p3 - (w0*p0 + w1*p1 + w2*p2);
+      w[0] = -w0;  w[1] = -w1;  w[2] = -w2;  w[3] = 1;
+      state.w[0] = w0;  state.w[1] = w1;
+    }
+    else{ // edge-edge
+      double w01,w23;
+      dist = DistanceEdgeEdge(p0, p1, p2, p3, w01,w23);
+      if( w01 < 0 || w01 > 1 ) continue;
+      if( w23 < 0 || w23 > 1 ) continue;
+      norm = ((1-w23)*p2 + w23*p3) - ((1-w01)*p0 + w01*p1);
+      w[0] = -(1-w01);  w[1] = -w01;  w[2] = 1-w23;  w[3] = w23;
+      state.w[0] = w01;  state.w[1] = w23;
+    }
+    norm.SetNormalizedVector();
+    if( Dot(norm,norm0) < COS_WARM_START_IMPULSE ) continue; // 向きが大きく変わった
+    const double rel_v = Dot(w[0]*v0+w[1]*v1+w[2]*v2+w[3]*v3,norm); // 正なら離れている
+    if( rel_v > 0.1*delta/dt ) continue;
+    if( dist > delta - rel_v*dt ) continue; // このステップの間には接触の距離まで近づかない
+    const double imp_max = (0.1*delta/dt-rel_v)/(w[0]*w[0]+w[1]*w[1]+w[2]*w[2]+w[3]*w[3]);
+    const double imp = ( state0.imp < imp_max ) ? state0.imp : imp_max;
+    for(int i=0;i<4;i++){
+      dv[i][0] = norm.x*imp*w[i];
+      dv[i][1] = norm.y*imp*w[i];
+      dv[i][2] = norm.z*imp*w[i];
+    }
+    state.imp = imp;
+    state.norm[0] = norm.x;  state.norm[1] = norm.y;  state.norm[2] = norm.z;
+  }
+  int nwarm = 0;
+  for(int icache=0;icache<ncache;icache++){
+    if( aStateWarm[icache].imp == 0 ) continue;
+    AddImpulseContact(aUVWm, aStateWarm[icache].ce,(const double (*)[3])(aDV.data()+icache*12));
+    nwarm++;
+  }
+  return nwarm;
+}
+
+// 接触要素の順,同じ接触要素なら加えた順に並べるための比較
+class CCompareStateOrder
+{
+public:
+  CCompareStateOrder(const std::vector<CContactState>& aState) : aState(aState){}
+  bool operator()(int i, int j) const {
+    if( aState[i] < aState[j] ) return true;
+    if( aState[j] < aState[i] ) return false;
+    return i < j;
+  }
+public:
+  const std::vector<CContactState>& aState;
+};
+
+// このステップで加えた撃力を接触要素ごとに足してキャッシュにする(向きと重心座標は最後に加えたもの)
+// std::stable_sortは作業領域を確保するので,番号をstd::sortで並べる
+static void UpdateContactCache
+(CContactCache& cache,
+ std::vector<int>& aIndSort, // (作業領域)
+ ////
+ const std::vector<CContactState>& aStateStep) // 加えた順に並んだ撃力
+{
+  aIndSort.resize(aStateStep.size());
+  for(int i=0;i<(int)aStateStep.size();i++){ aIndSort[i] = i; }
+  std::sort(aIndSort.begin(),aIndSort.end(),CCompareStateOrder(aStateStep));
+  cache.aState.clear();
+  for(int i=0;i<(int)aIndSort.size();i++){
+    const CContactState& state = aStateStep[aIndSort[i]];
+    if( state.imp <= 0 ) continue;
+    if( !cache.aState.empty() && !(cache.aState.back() < state) ){ // 同じ接触要素
+      const double imp = cache.aState.back().imp + state.imp;
+      cache.aState.back() = state;
+      cache.aState.back().imp = imp;
+      continue;
+    }
+    cache.aState.push_back(state);
+  }
+}
+
 // 衝突が解消された中間速度を返す
 void GetIntermidiateVelocityContactResolved
 (std::vector<double>& aUVWm,
@@ -360,98 +843,97 @@ void GetIntermidiateVelocityContactResolved
  double contact_clearance,
  double mass_point,
  double cloth_contact_stiffness,
+ int imode_impulse,
  const std::vector<double>& aXYZ,
  const std::vector<int>& aTri,
+ const std::vector<unsigned char>& aFlgOwnTri,
  const CJaggedArray& aEdge,
  int iroot_bvh,
  const std::vector<CNodeBVH>& aNodeBVH,
- std::vector<CAABB3D>& aBB)
+ const CJaggedArray& aLevelBVH,
+ std::vector<CAABB3D>& aBB,
+ std::vector<CAABBChildBVH>& aBBC,
+ CFrontBVTT& front_prx,
+ CFrontBVTT& front_ccd,
+ CNormalConeBVH& cone,
+ CDirtyBVH& dirty,
+ CContextSelfCollision& context)
 {
+  CContactBuffer& buffer = context.buffer; // 接触要素を集めるバッファ
+  std::vector<CContactElement>& aContactElem = context.aContactElem;
+  std::vector<CContactState>& aStateStep = context.aStateStep; // このステップの初期値とCCDで加えた撃力(キャッシュにする)
+  std::vector<int>& aInoDirty = context.aInoDirty; // 前の反復で接触した(速度が変わった)頂点.二回目からはこの周りだけを探索し直す
+  aStateStep.clear();
   {
-    std::vector<CContactElement> aContactElem;
-    {
-      BuildBoundingBoxChild_Prx(iroot_bvh,
+    BuildBoundingBoxLevel_Prx(contact_clearance,
+                              aXYZ,aTri,aNodeBVH,aLevelBVH,aBB,aBBC);
+    cone.Update_Prx(aXYZ,aTri,aNodeBVH,aLevelBVH);
+    buffer.Clear();
+    GetContactElement_Proximity(buffer,front_prx,cone,
                                 contact_clearance,
-                                aXYZ,aTri,aNodeBVH,aBB);
-      std::set<CContactElement> setCE;
-      GetContactElement_Proximity(setCE,
-                                  contact_clearance,
-                                  aXYZ,aTri,
-                                  iroot_bvh,
-                                  aNodeBVH,aBB); // output
-      aContactElem.clear();
-      for(std::set<CContactElement>::iterator itr=setCE.begin();itr!=setCE.end();itr++){
-        aContactElem.push_back(*itr);
-      }
-      std::cout << "  Proximity      Contact Elem Size: " << aContactElem.size() << std::endl;
-    }
+                                aXYZ,aTri,aFlgOwnTri,
+                                iroot_bvh,
+                                aNodeBVH,aBB,aBBC); // output
+    buffer.Gather(aContactElem);
+    std::cout << "  Proximity      Contact Elem Size: " << aContactElem.size() << std::endl;
     is_impulse_applied = aContactElem.size() > 0;
-    SelfCollisionImpulse_Proximity(aUVWm,
+    SelfCollisionImpulse_Proximity(aUVWm,context, imode_impulse,
                               contact_clearance,
                               cloth_contact_stiffness,
                               dt,
                               mass_point,
                               aXYZ,aTri,
                               aContactElem);
+    const int nwarm = WarmStartImpulseContact(aUVWm,aStateStep,context.aDV, context.cache,contact_clearance,dt,aXYZ);
+    is_impulse_applied = is_impulse_applied || (nwarm > 0);
   }
   ////////
   for(int itr=0;itr<5;itr++){
-    std::vector<CContactElement> aContactElem;
-    {
-      BuildBoundingBoxChild_CCD(iroot_bvh,
-                                dt,
-                                aXYZ,aUVWm,aTri,aNodeBVH,aBB);
-      std::set<CContactElement> setCE;
-      GetContactElement_CCD(setCE,
-                            dt,contact_clearance,
-                            aXYZ,aUVWm,aTri,
-                            iroot_bvh,
-                            aNodeBVH,aBB); // output
-      aContactElem.clear();
-      for(std::set<CContactElement>::iterator itr=setCE.begin();itr!=setCE.end();itr++){
-        aContactElem.push_back(*itr);
-      }
-    }
+    GetContactElement_CCD_Iteration(aContactElem,buffer,front_ccd,cone,dirty,
+                                    itr>0,aInoDirty,
+                                    dt,contact_clearance,
+                                    aXYZ,aUVWm,aTri,aFlgOwnTri,
+                                    iroot_bvh,aNodeBVH,aLevelBVH,aBB,aBBC);
       std::cout << "  CCD iter: " << itr << "    Contact Elem Size: " << aContactElem.size() << std::endl;    
-    if( aContactElem.size() == 0 ){ return; }
+    PrintCounterFilterCCD(buffer.counter);
+    if( aContactElem.size() == 0 ){
+      UpdateContactCache(context.cache,context.aIndSort, aStateStep);
+      return;
+    }
     is_impulse_applied = is_impulse_applied || (aContactElem.size() > 0);    
-    SelfCollisionImpulse_CCD(aUVWm,
+    SelfCollisionImpulse_CCD(aUVWm,context, imode_impulse,
                               contact_clearance,
                               cloth_contact_stiffness,
                               dt,
                               mass_point,
                               aXYZ,aTri,
                               aContactElem);
+    aStateStep.insert(aStateStep.end(),context.aState.begin(),context.aState.end());
+    GetContactVertex(aInoDirty, aContactElem);
   }
-  std::vector<double> aUVWm0 = aUVWm;
-  std::vector< std::set<int> > aRIZ;
+  UpdateContactCache(context.cache,context.aIndSort, aStateStep);
+  std::vector<double>& aUVWm0 = context.aUVWm0;
+  std::vector<int>& aRootRIZ = context.aRootRIZ; // RIZの互いに素な集合
+  CJaggedArray& aRIZ = context.aRIZ; // RIZごとの頂点の配列
+  aUVWm0 = aUVWm;
+  aRootRIZ.clear(); // 最初のMakeRigidImpactZoneで全ての頂点がRIZに属さないとして作り直す
+  aRIZ.InitializeSize(0);
   for(int itr=0;itr<100;itr++){
-    std::vector<CContactElement> aContactElem;    
-    {
-      BuildBoundingBoxChild_CCD(iroot_bvh,
-                                dt,
-                                aXYZ,aUVWm,aTri,aNodeBVH,aBB);
-      std::set<CContactElement> setCE;
-      GetContactElement_CCD(setCE,
-                            dt,contact_clearance,
-                            aXYZ,aUVWm,aTri,
-                            iroot_bvh,
-                            aNodeBVH,aBB); // output
-      for(std::set<CContactElement>::iterator itr=setCE.begin();itr!=setCE.end();itr++){
-        aContactElem.push_back(*itr);
-      }
-    }
-    int nnode_riz = 0;
-    for(int iriz=0;iriz<aRIZ.size();iriz++){
-      nnode_riz += aRIZ[iriz].size();
-    }
+    GetContactElement_CCD_Iteration(aContactElem,buffer,front_ccd,cone,dirty,
+                                    true,aInoDirty,
+                                    dt,contact_clearance,
+                                    aXYZ,aUVWm,aTri,aFlgOwnTri,
+                                    iroot_bvh,aNodeBVH,aLevelBVH,aBB,aBBC);
+    const int nnode_riz = (int)aRIZ.array.size();
     std::cout << "  RIZ iter: " << itr << "    Contact Elem Size: " << aContactElem.size() << "   NNode In RIZ: " << nnode_riz << std::endl;
     if( aContactElem.size() == 0 ){
       std::cout << "Resolved All Collisions : " << std::endl;
       break;
     }
-    MakeRigidImpactZone(aRIZ, aContactElem,aEdge);
+    MakeRigidImpactZone(aRootRIZ, aContactElem,aEdge);
+    MakeRigidImpactZoneCSR(aRIZ,context.aZoneRIZ, aRootRIZ);
     ApplyRigidImpactZone(aUVWm, aRIZ,aXYZ,aUVWm0);
+    aInoDirty = aRIZ.array; // RIZの頂点は接触した頂点を全て含む
   }
 }
 
@@ -16,6 +16,57 @@
 #include "bvh_aabb.h"
 
 
+// 接触要素の撃力の加え方
+enum {
+  IMPULSE_GAUSS_SEIDEL = 0,       // 接触要素の順に一つずつ加える(逐次)
+  IMPULSE_GAUSS_SEIDEL_COLOR = 1, // 頂点を共有しない接触要素を同じ色に塗り分け,色の順に色の中では並列に加える
+  IMPULSE_JACOBI = 2,             // 全ての撃力を同じ速度から並列に求めてから加える(収束は遅い)
+};
+
+// 接触要素に加えた撃力
+class CContactState
+{
+public:
+  bool operator < (const CContactState& s) const { return ce < s.ce; }
+public:
+  CContactElement ce;
+  double imp; // 撃力による速度の変化の大きさ
+  double norm[3]; // 撃力の向き(FVなら面から点,EEなら辺ino0-ino1から辺ino2-ino3に向かう)
+  double w[2]; // 重心座標(FVならw0,w1,EEならw01,w23)
+};
+
+// ステップをまたいで保持する接触の状態．前のステップのCCDで加えた撃力を次のステップの撃力の初期値にする
+class CContactCache
+{
+public:
+  void Clear(){ aState.clear(); }
+public:
+  std::vector<CContactState> aState; // 接触要素の順に整列,同じ接触要素は一つ
+};
+
+// 衝突処理でステップをまたいで保持する状態と作業領域
+// 作業領域を使い回すので,配列が十分に大きくなった後は衝突処理の中でヒープを確保しない
+class CContextSelfCollision
+{
+public:
+  CContactCache cache; // 前のステップの接触の状態
+public: // 作業領域
+  CContactBuffer buffer; // 接触要素を集めるバッファ
+  std::vector<CContactElement> aContactElem; // 接触要素
+  std::vector<CContactState> aState; // 接触要素ごとの撃力
+  std::vector<CContactState> aStateStep; // このステップの初期値とCCDで加えた撃力(キャッシュにする)
+  std::vector<int> aIndSort; // 撃力を接触要素の順に並べる番号
+  std::vector<int> aInoDirty; // 前の反復で速度が変わった頂点
+  CJaggedArray aColor; // 色ごとの接触要素
+  std::vector<unsigned long long> aFlgColor; // 頂点に接する接触要素の色(使った後は0に戻す)
+  std::vector<int> aColorCE; // 接触要素の色
+  std::vector<double> aDV; // 接触要素ごとの4点の速度の変化
+  std::vector<unsigned char> aIsImpulse; // 接触要素に撃力があれば1
+  std::vector<double> aUVWm0; // RIZを使う前の中間速度
+  std::vector<int> aRootRIZ; // RIZの互いに素な集合
+  std::vector<int> aZoneRIZ; // 代表の頂点のRIZの番号
+  CJaggedArray aRIZ; // RIZごとの頂点
+};
 
 // 衝突が解消された中間速度を返す
 void GetIntermidiateVelocityContactResolved
@@ -26,11 +77,20 @@ void GetIntermidiateVelocityContactResolved
  double contact_clearance,
  double mass_point,
  double cloth_contact_stiffness,
+ int imode_impulse, // 撃力の加え方(IMPULSE_GAUSS_SEIDELなど)
  const std::vector<double>& aXYZ,
- const std::vector<int>& aTri,
+ const std::vector<int>& aTri, // BVHの葉の順に並べた三角形(CollapseBVHLeafを参照)
+ const std::vector<unsigned char>& aFlgOwnTri, // 三角形が持つ頂点と辺(MakeFeatureOwnerTriを参照)
  const CJaggedArray& aEdge,
  int iroot_bvh,
  const std::vector<CNodeBVH>& aNodeBVH,
- std::vector<CAABB3D>& aBB);
+ const CJaggedArray& aLevelBVH,
+ std::vector<CAABB3D>& aBB,
+ std::vector<CAABBChildBVH>& aBBC,
+ CFrontBVTT& front_prx, // 近接判定の探索のフロント(ステップをまたいで保持する)
+ CFrontBVTT& front_ccd, // CCDの探索のフロント
+ CNormalConeBVH& cone, // 法線のコーン(初期化されていなければ判定を省略しない)
+ CDirtyBVH& dirty, // 速度が変わった頂点を含むノードの印(初期化されていなければCCDの反復で毎回全体を探索する)
+ CContextSelfCollision& context); // 前のステップの接触の状態と作業領域(ステップをまたいで保持する)
     
 #endif
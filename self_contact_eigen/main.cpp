@@ -158,7 +158,22 @@ double mass_point; // mass for a point，頂点あたりの質量
 // 自己接触のための関数群
 int iroot_bvh; // BVH木構造のルートノードのインデックス
 std::vector<CNodeBVH> aNodeBVH; // BVHのノードの配列
+CJaggedArray aLevelBVH; // BVHのノードを葉からの高さごとに分類したもの
+int imode_build_bvh = 0; // BVHのトポロジーの作り方 0:TopDown 1:Morton 2:SAH
+int ntri_leaf_bvh = 4; // BVHの一つの葉にまとめる三角形の数の上限
+std::vector<int> aTriLeafBVH; // BVHの葉の順に並べ替えた三角形の頂点インデックス
+std::vector<unsigned char> aFlgOwnTriBVH; // aTriLeafBVHの三角形が持つ頂点と辺
+int nstep_rebuild_bvh = 0; // このステップ数ごとにBVHのトポロジーを作り直す(0なら作り直さない)
+int istep_rebuild_bvh = 0;
 std::vector<CAABB3D> aBB_BVH; // AABBの配列，サイズはノードの数
+std::vector<CAABBChildBVH> aBBC_BVH; // 子ノードのAABBを親ノードごとにSoAで並べた配列
+CFrontBVTT front_prx_BVH; // 近接判定のBVTTのフロント
+CFrontBVTT front_ccd_BVH; // CCDのBVTTのフロント
+bool is_cull_normal_cone = true; // 法線のコーンで平らな部分の自己接触の判定を省略するかどうか
+CNormalConeBVH cone_BVH; // BVHのノードごとの法線のコーン
+CDirtyBVH dirty_BVH; // CCDの反復で速度が変わった頂点を含むノードの印
+CContextSelfCollision context_collision; // 衝突処理の前のステップの接触の状態と作業領域
+int imode_impulse = IMPULSE_GAUSS_SEIDEL_COLOR; // 撃力の加え方 0:逐次 1:塗り分けて並列 2:Jacobi
 CJaggedArray aEdge;
 
 std::vector<double> aNormal; // deformed vertex noamals，変形中の頂点の法線(可視化用)
@@ -206,6 +221,27 @@ void MakeNormal()
   }
 }
 
+// BVHのトポロジーを作り,その品質を表示する
+void MakeBVH()
+{
+  if(      imode_build_bvh == 0 ){ iroot_bvh = MakeBVHTopology_TopDown(aTri,aXYZ,aNodeBVH); }
+  else if( imode_build_bvh == 1 ){ iroot_bvh = MakeBVHTopology_Morton( aTri,aXYZ,aNodeBVH); }
+  else{                            iroot_bvh = MakeBVHTopology_SAH(    aTri,aXYZ,aNodeBVH); }
+  iroot_bvh = CollapseBVHLeaf(aTriLeafBVH,aNodeBVH, iroot_bvh,aTri,ntri_leaf_bvh);
+  MakeBVHLevelOrder(aLevelBVH,iroot_bvh,aNodeBVH);
+  MakeFeatureOwnerTri(aFlgOwnTriBVH,aTriLeafBVH);
+  front_prx_BVH.Clear();
+  front_ccd_BVH.Clear();
+  if( is_cull_normal_cone ){ cone_BVH.Initialize(iroot_bvh,aNodeBVH,aTriLeafBVH); }
+  else{ cone_BVH = CNormalConeBVH(); }
+  dirty_BVH.Initialize((int)aXYZ.size()/3,aNodeBVH,aLevelBVH,aTriLeafBVH);
+  BuildBoundingBoxLevel_Prx(contact_clearance,aXYZ,aTriLeafBVH,aNodeBVH,aLevelBVH,aBB_BVH,aBBC_BVH);
+  double cost_sah, ratio_overlap;
+  int ndepth_max;
+  EvaluateQualityBVH(cost_sah,ndepth_max,ratio_overlap, iroot_bvh,aNodeBVH,aBB_BVH);
+  std::cout << "BVH  SAH cost: " << cost_sah << "  depth: " << ndepth_max << "  overlap: " << ratio_overlap << std::endl;
+}
+
 void StepTime()
 {
   
@@ -217,6 +253,10 @@ void StepTime()
     penetrationDepth = penetrationDepth_Sphere;
   }
   
+  if( nstep_rebuild_bvh > 0 && ++istep_rebuild_bvh >= nstep_rebuild_bvh ){ // 大きく変形した時のためにBVHを作り直す
+    istep_rebuild_bvh = 0;
+    MakeBVH();
+  }
   std::vector<double> aXYZ1 = aXYZ;
   ::StepTime_InternalDynamics
   (aXYZ, aUVW,
@@ -235,10 +275,12 @@ void StepTime()
    contact_clearance,
    mass_point,
    stiff_contact,
+   imode_impulse,
    aXYZ1,
-   aTri,
+   aTriLeafBVH, aFlgOwnTriBVH,
    aEdge,
-   iroot_bvh,  aNodeBVH, aBB_BVH);
+   iroot_bvh,  aNodeBVH, aLevelBVH, aBB_BVH, aBBC_BVH,
+   front_prx_BVH, front_ccd_BVH, cone_BVH, dirty_BVH, context_collision);
   if( is_impulse_applied ){
     std::cout << "update middle velocity" << std::endl;
     for(unsigned int ip=0;ip<aXYZ.size()/3;ip++){
@@ -498,6 +540,7 @@ void myGlutKeyboard(unsigned char Key, int x, int y)
       imode_contact++;
       aXYZ = aXYZ0;
       aUVW.assign(aUVW.size(),0.0);
+      context_collision.cache.Clear();
       if( imode_contact >= 2 ){
         imode_contact = 0;
       }
@@ -557,7 +600,7 @@ int main(int argc,char* argv[])
     aUVW.assign(aXYZ.size(),0.0);
     MakeNormal();    
     ////
-    iroot_bvh = MakeBVHTopology_TopDown(aTri,aXYZ,aNodeBVH);
+    MakeBVH();
     aEdge.SetEdgeOfElem(aTri,(int)aTri.size()/3,3,(int)aXYZ.size()/3,false);
   }
   
@@ -20,12 +20,13 @@ void AddWdWddW_Cloth
 (double& W, // (out) energy，歪エネルギー
  std::vector<double>& dW, // (out) first derivative of energy，歪エネルギーの一階微分
  CMatrixSquareSparse& ddW, // (out) second derivative of energy，歪エネルギーの二階微分
- std::vector<int>& tmp_buffer,
  ////
  const std::vector<double>& aXYZ, // (in) deformed vertex positions，現在の頂点の座標配列
  const std::vector<double>& aXYZ0, // (in) initial vertex positions，変形前の頂点の座標配列
  const std::vector<int>& aTri, // (in) triangle index，三角形の頂点インデックス配列
  const std::vector<int>& aQuad, // (in) index of 4 vertices required for bending，曲げ計算のための４頂点のインデックス配列
+ const std::vector<int>& aMapTri, // (in) ddWへ足し込む先の表(ddW.MakeMeargeMapで作る)
+ const std::vector<int>& aMapQuad, // (in) ddWへ足し込む先の表(ddW.MakeMeargeMapで作る)
  double lambda, // (in) Lame's 1st parameter，ラメの第一定数
  double myu,  // (in) Lame's 2nd parameter　ラメの第二定数
  double stiff_bend // (in) bending stiffness，曲げ剛性
@@ -50,7 +51,7 @@ void AddWdWddW_Cloth
       for(int i =0;i<3;i++){ dW[ip*3+i] += de[ino][i]; }
     }
     // marge dde
-    ddW.Mearge(3, aIP, 3, aIP, 9, &dde[0][0][0][0], tmp_buffer);
+    ddW.MeargeMap(3, aIP, &aMapTri[itri*9], 9, &dde[0][0][0][0]);
   }
   // marge element bending energy
   // 曲げエネルギーを追加
@@ -71,7 +72,7 @@ void AddWdWddW_Cloth
       for(int i =0;i<3;i++){ dW[ip*3+i] += de[ino][i]; }
     }
     // marge dde
-    ddW.Mearge(4, aIP, 4, aIP, 9, &dde[0][0][0][0], tmp_buffer);
+    ddW.MeargeMap(4, aIP, &aMapQuad[iq*16], 9, &dde[0][0][0][0]);
   }
 }
 
@@ -138,7 +139,6 @@ void AddWdWddW_Contact
 (double& W, // (out) energy，歪エネルギー
  std::vector<double>& dW, // (out) first derivative of energy，歪エネルギーの一階微分
  CMatrixSquareSparse& ddW, // (out) second derivative of energy，歪エネルギーの二階微分
- std::vector<int>& tmp_buffer,
  ////
  const std::vector<double>& aXYZ, // (in) deformed vertex positions，現在の頂点の座標配列
  double stiff_contact,
@@ -155,8 +155,8 @@ void AddWdWddW_Contact
     W += e;  // marge energy
     // marge de
     for(int i =0;i<3;i++){ dW[ip*3+i] += de[i]; }
-    // marge dde
-    ddW.Mearge(1, &ip, 1, &ip, 9, &dde[0][0], tmp_buffer);
+    // marge dde (対角ブロックだけなので直接足す)
+    for(int i=0;i<9;i++){ ddW.m_valDia[ip*9+i] += (&dde[0][0])[i]; }
   }
 }
 
@@ -192,6 +192,8 @@ void StepTime_InternalDynamics
  const std::vector<int>& aBCFlag, // (in) boundary condition flag (0:free 1:fixed)，境界条件フラグの配列
  const std::vector<int>& aTri, // (in) triangle index，三角形の頂点インデックス配列
  const std::vector<int>& aQuad, // (in) index of 4 vertices required for bending，曲げ計算のための４頂点のインデックス配列
+ const std::vector<int>& aMapTri, // (in) mat_Aへ足し込む先の表(mat_A.MakeMeargeMapで作る)
+ const std::vector<int>& aMapQuad, // (in) mat_Aへ足し込む先の表(mat_A.MakeMeargeMapで作る)
  const double dt, // (in) size of time step，時間ステップの大きさ
  double lambda, // (in) Lame's 1st parameter，ラメ第一定数
  double myu, // (in) Lame's 2nd parameter，ラメ第二定数
@@ -210,13 +212,12 @@ void StepTime_InternalDynamics
   double W = 0;
   std::vector<double> vec_b(nDof,0);
 	mat_A.SetZero();
-  std::vector<int> tmp_buffer(np,-1);
   AddWdWddW_Cloth(W,vec_b,mat_A,
-                  tmp_buffer,
                   aXYZ,aXYZ0,
                   aTri,aQuad,
+                  aMapTri,aMapQuad,
                   lambda,myu,stiff_bend);
-  AddWdWddW_Contact(W,vec_b,mat_A,tmp_buffer,
+  AddWdWddW_Contact(W,vec_b,mat_A,
                     aXYZ,
                     stiff_contact,contact_clearance,penetrationDepth);
   AddWdW_Gravity(W,vec_b,
@@ -263,6 +264,8 @@ void StepTime_InternalDynamicsILU
  const std::vector<int>& aBCFlag, // (in) boundary condition flag (0:free 1:fixed)，境界条件フラグの配列
  const std::vector<int>& aTri, // (in) triangle index，三角形の頂点インデックス配列
  const std::vector<int>& aQuad, // (in) index of 4 vertices required for bending，曲げ計算のための４頂点のインデックス配列
+ const std::vector<int>& aMapTri, // (in) mat_Aへ足し込む先の表(mat_A.MakeMeargeMapで作る)
+ const std::vector<int>& aMapQuad, // (in) mat_Aへ足し込む先の表(mat_A.MakeMeargeMapで作る)
  const double dt, // (in) size of time step，時間ステップの大きさ
  double lambda, // (in) Lame's 1st parameter，ラメ第一定数
  double myu, // (in) Lame's 2nd parameter，ラメ第二定数
@@ -281,13 +284,12 @@ void StepTime_InternalDynamicsILU
   double W = 0;
   std::vector<double> vec_b(nDof,0);
 	mat_A.SetZero();
-  std::vector<int> tmp_buffer(np,-1);
   AddWdWddW_Cloth(W,vec_b,mat_A,
-                  tmp_buffer,
                   aXYZ,aXYZ0,
                   aTri,aQuad,
+                  aMapTri,aMapQuad,
                   lambda,myu,stiff_bend);
-  AddWdWddW_Contact(W,vec_b,mat_A,tmp_buffer,
+  AddWdWddW_Contact(W,vec_b,mat_A,
                     aXYZ,
                     stiff_contact,contact_clearance,penetrationDepth);
   AddWdW_Gravity(W,vec_b,
@@ -317,7 +319,13 @@ void StepTime_InternalDynamicsILU
   std::vector<double> vec_x;
   double conv_ratio = 1.0e-4;
   int iteration = 100;
-  Solve_PCG(conv_ratio, iteration, mat_A,ilu_A, vec_b,vec_x);
+  if( ilu_A.IsPrecisionFloat() ){ // ilu_A.SetPrecisionFloat(true)なら係数行列もfloatの複製で反復する(混合精度)
+    mat_A.SetValueFloat();
+    Solve_PCG_Mixed(conv_ratio, iteration, mat_A,ilu_A, vec_b,vec_x);
+  }
+  else{
+    Solve_PCG(conv_ratio, iteration, mat_A,ilu_A, vec_b,vec_x);
+  }
   std::cout << "  conv_ratio:" << conv_ratio << "  iteration:" << iteration << std::endl;
   // update position，頂点位置の更新
   for(int i=0;i<nDof;i++){ aXYZ[i] += vec_x[i]; }